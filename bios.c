@@ -94,6 +94,9 @@ static volatile sig_atomic_t PIC_active;
 /* Bit vector denoting halted cores */
 static _Atomic uint32_t halt_vector;
 
+/* Bit vector denoting cores with a pending restart */
+static _Atomic uint32_t restart_vector;
+
 /* PIC thread id */
 static pthread_t PIC_thread;
 
@@ -901,6 +904,7 @@ void vm_run(vm_config* vmc)
 
 	/* Initialize the halted vector */
 	halt_vector = 0;
+	restart_vector = 0;
 
 	/* Launch the core threads */
 	for(uint c=0; c < ncores; c++) {
@@ -992,6 +996,11 @@ uint cpu_cores()
 	return ncores;
 }
 
+uint cpu_parallel_cores()
+{
+	return (physical_cores < ncores) ? physical_cores : ncores;
+}
+
 
 
 void cpu_core_halt()
@@ -1006,25 +1015,34 @@ void cpu_core_halt()
 #endif
 
 	/* Set halt bit */
-	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_RELAXED);
+	__atomic_fetch_or(& halt_vector, cmask, __ATOMIC_SEQ_CST);
 
 #if defined(CORE_STATISTICS)
 	core->hlt_count ++;
 #endif
 
-	siginfo_t info;
-
-	/* Sleep for 10 msec */
-	//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
-	//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
-	int rc = sigwaitinfo(&sigusr1_set, &info);
+	/* 
+		If a restart was requested just before we set the halt bit, it did
+		not send us a signal. In this case, we must not sleep.
+	 */
+	if(! (__atomic_fetch_and(& restart_vector, ~cmask, __ATOMIC_SEQ_CST) & cmask)) {
+		siginfo_t info;
+
+		/* Sleep for 10 msec */
+		//struct timespec halt_time = {.tv_sec=0l, .tv_nsec=10000000l};
+		//int rc = sigtimedwait(&sigusr1_set, &info, &halt_time);
+		int rc = sigwaitinfo(&sigusr1_set, &info);
+
+		if(rc>0) {
+			/* Got signal, dispatch */
+			dispatch_interrupts(core);
+		}
+		else {
+			assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+		}
 
-	if(rc>0) {
-		/* Got signal, dispatch */
-		dispatch_interrupts(core);
-	}
-	else {
-		assert(rc==-1 &&  (errno == EINTR || errno == EAGAIN));
+		/* Any restart request was served by this wakeup */
+		__atomic_fetch_and(& restart_vector, ~cmask, __ATOMIC_RELAXED);
 	}
 
 #if defined(CORE_STATISTICS)
@@ -1041,7 +1059,10 @@ static int __core_restart(uint c)
 {
 	uint32_t cmask = 1 << c;
 
-	uint32_t prevhv = __atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_RELAXED);
+	/* Leave a note, in case the core is just about to halt */
+	__atomic_fetch_or(& restart_vector, cmask, __ATOMIC_SEQ_CST);
+
+	uint32_t prevhv = __atomic_fetch_and(& halt_vector, ~cmask, __ATOMIC_SEQ_CST);
 	if( prevhv & cmask ) {
 		interrupt_core(CORE+c);
 #if defined(CORE_STATISTICS)		
@@ -1118,6 +1139,10 @@ void cpu_enable_interrupts()
 }
 
 
+#ifdef BIOS_UCONTEXT
+
+const char* const cpu_context_backend = "ucontext";
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -1140,6 +1165,136 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#else
+
+const char* const cpu_context_backend = "asm";
+
+/*
+  The hand-written context switch.
+
+  cpu_context_switch(&old->sp, new->sp) pushes the callee-saved registers
+  of the ABI on the current stack, stores the stack pointer into old->sp,
+  loads new->sp and pops the registers of the new context, returning into it.
+  Since all core threads have the same signal mask, there is no need to
+  save and restore it (this is what makes swapcontext slow).
+
+  A new context is a stack prepared to look like a suspended one, whose
+  return address is the thread function.
+ */
+void cpu_context_switch(void** oldsp, void* newsp);
+
+#if defined(__x86_64__)
+
+/*
+  Frame (from the saved sp upwards): mxcsr, x87 control word, r15, r14,
+  r13, r12, rbx, rbp, return address.
+ */
+__asm__(
+	".text\n"
+	".globl cpu_context_switch\n"
+	".type cpu_context_switch,@function\n"
+	"cpu_context_switch:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size cpu_context_switch,.-cpu_context_switch\n"
+);
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	uint64_t* top = (uint64_t*) (((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15);
+
+	/*
+	  After the final ret, %rsp points to the null return address of
+	  ctx_func, and is 8 mod 16, as at any function entry.
+	 */
+	*--top = 0;                           /* return address of ctx_func */
+	*--top = (uint64_t) ctx_func;         /* return address of the switch */
+	for(int i=0; i<6; i++) *--top = 0;    /* rbp, rbx, r12, r13, r14, r15 */
+	*--top = 0x1F80 | (0x037Full << 32);  /* default mxcsr and x87 control word */
+
+	ctx->sp = top;
+}
+
+#elif defined(__aarch64__)
+
+/*
+  Frame (from the saved sp upwards): x19-x28, x29 (fp), x30 (lr), d8-d15.
+ */
+__asm__(
+	".text\n"
+	".globl cpu_context_switch\n"
+	".type cpu_context_switch,%function\n"
+	"cpu_context_switch:\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".size cpu_context_switch,.-cpu_context_switch\n"
+);
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	uint64_t* top = (uint64_t*) (((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15);
+
+	/* An all-zero frame, except for the link register (x30) */
+	top -= 20;
+	for(int i=0; i<20; i++) top[i] = 0;
+	top[11] = (uint64_t) ctx_func;
+
+	ctx->sp = top;
+}
+
+#endif
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	cpu_context_switch(&oldctx->sp, newctx->sp);
+}
+
+#endif
+
 
 
 /*
@@ -2,7 +2,20 @@
 #define BIOS_H
 
 #include <stdint.h>
+#include <stddef.h>
+
+/*
+  The context switch backend is selected at build time. By default, a
+  hand-written switch (in assembly) is used on x86-64 and aarch64, and
+  ucontext on all other platforms. Define BIOS_UCONTEXT to force ucontext.
+ */
+#if !defined(BIOS_UCONTEXT) && !defined(__x86_64__) && !defined(__aarch64__)
+#define BIOS_UCONTEXT
+#endif
+
+#ifdef BIOS_UCONTEXT
 #include <ucontext.h>
+#endif
 
 /**
 	@file bios.h
@@ -302,6 +315,16 @@ extern _Thread_local uint cpu_core_id;
  */
 uint cpu_cores();
 
+/**
+	@brief Returns the number of cores that can run at the same time.
+
+	The cores are simulated by threads of the host. When there are more 
+	cores than host processors, a core that is restarted may have to wait
+	for the host to run it. This is the smaller of @c cpu_cores() and the
+	number of host processors.
+ */
+uint cpu_parallel_cores();
+
 
 /**
 	@brief Barrier synchronization for all cores.
@@ -386,6 +409,8 @@ void cpu_core_halt();
 	@brief Restart the given core.
 
 	This call will restart the given core, if it was halted.
+	If the core is just about to halt, its next call to 
+	@c cpu_core_halt() will return without sleeping.
 	@param c the core to restart
 */
 void cpu_core_restart(uint c);
@@ -407,8 +432,23 @@ void cpu_core_restart_all();
 
 /**
 	@brief A type for saving CPU context into.
+
+	With the hand-written backend, a context is just the saved stack pointer;
+	the callee-saved registers of a suspended context are kept on its stack.
+	With the ucontext backend (@c BIOS_UCONTEXT), it is a @c ucontext_t, and
+	each switch also saves and restores the signal mask, which costs a
+	system call.
 */
+#ifdef BIOS_UCONTEXT
 typedef ucontext_t cpu_context_t;
+#else
+typedef struct { void* sp; } cpu_context_t;
+#endif
+
+/**
+	@brief The name of the context switch backend, "asm" or "ucontext".
+*/
+extern const char* const cpu_context_backend;
 
 
 /**
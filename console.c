@@ -64,5 +64,6 @@ void tinyos_pseudo_console()
 
 	fcb[0]->streamfunc = &__stdio_ops;
 	fcb[1]->streamfunc = &__stdio_ops;
+	FCB_install(2, fid, fcb);
 
 }
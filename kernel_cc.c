@@ -1,6 +1,9 @@
 
 
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "kernel_sched.h"
 #include "kernel_proc.h"
@@ -19,45 +22,479 @@
   */
 
 
+static inline void cpu_relax()
+{
+#if defined(__x86__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#endif
+}
+
+
 /*
  	Pre-emption aware mutex.
  	-------------------------
 
  	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	parking mutex if preemption is on.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
 
+ 	A locked mutex holds its owner TCB, with the MUTEX_LOCKED bit set.
+ 	In the preemptive domain, a waiter spins only while the owner is 
+ 	running on some core, since only then will the mutex be released 
+ 	soon. Otherwise, it parks: it sets MUTEX_PARKED, queues itself in 
+ 	the parking bucket of the mutex and goes to sleep. Mutex_Unlock 
+ 	wakes one parked waiter, which then competes for the mutex again.
+
+ 	The parking buckets are a hash table of wait queues, keyed by the 
+ 	address of the mutex, as with futexes. Bucket locks are only locked
+ 	with preemption off, so they never park themselves.
+
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
+
+#define MUTEX_LOCKED ((Mutex)1)
+#define MUTEX_PARKED ((Mutex)2)
+#define MUTEX_OWNER(v) ((TCB*)((v) & ~(MUTEX_LOCKED|MUTEX_PARKED)))
+
+/** \cond HELPER Helper structure for parked mutex waiters. */
+typedef struct __mutex_waiter {
+	rlnode node;			/* become part of a bucket ring */
+	TCB* thread;			/* the parked thread */
+	Mutex* mx;				/* the mutex it waits for */
+	int queued;				/* set while in the bucket ring */
+} __mutex_waiter;
+/** \endcond */
+
+#define MUTEX_PARK_BUCKETS 64
+
+static struct mutex_park_bucket {
+	Mutex lock;					/* protects waiters */
+	__mutex_waiter* waiters;	/* a ring of waiters, or NULL */
+} mutex_buckets[MUTEX_PARK_BUCKETS];
+
+static inline struct mutex_park_bucket* mutex_bucket(Mutex* lock)
+{
+	uintptr_t h = (uintptr_t)lock;
+	return &mutex_buckets[((h >> 3) ^ (h >> 9)) % MUTEX_PARK_BUCKETS];
+}
+
+/* Bucket ring helpers; the bucket lock must be held */
+static inline void bucket_push(struct mutex_park_bucket* b, __mutex_waiter* w)
+{
+	rlnode_init(& w->node, w);
+	if(b->waiters)
+		rlist_push_back(& b->waiters->node, & w->node);
+	else
+		b->waiters = w;
+	w->queued = 1;
+}
+
+static inline void bucket_remove(struct mutex_park_bucket* b, __mutex_waiter* w)
+{
+	__mutex_waiter* nextw = w->node.next->obj;
+	if(b->waiters == w)
+		b->waiters = (nextw == w) ? NULL : nextw;
+	rlist_remove(& w->node);
+	w->queued = 0;
+}
+
+/* Set MUTEX_PARKED, as long as the mutex is locked. Return 1 if it was locked. */
+static inline int mutex_mark_parked(Mutex* lock)
+{
+  Mutex v = __atomic_load_n(lock, __ATOMIC_RELAXED);
+  while((v & MUTEX_LOCKED) && !(v & MUTEX_PARKED))
+    if(__atomic_compare_exchange_n(lock, &v, v | MUTEX_PARKED, 
+        0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      v |= MUTEX_PARKED;
+  return (v & MUTEX_LOCKED) != 0;
+}
+
+
+int Mutex_TryLock(Mutex* lock)
+{
+  Mutex v = __atomic_load_n(lock, __ATOMIC_RELAXED);
+  return !(v & MUTEX_LOCKED) && 
+    __atomic_compare_exchange_n(lock, &v, 
+      (Mutex)cur_thread() | MUTEX_LOCKED | (v & MUTEX_PARKED), 
+      0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+/* Return 1 if the owner of a mutex with value v is running on some core */
+static int mutex_owner_running(Mutex v)
+{
+  TCB* owner = MUTEX_OWNER(v);
+  for(uint c=0; c<cpu_cores(); c++)
+    if(cctx[c].current_thread == owner) return 1;
+  return 0;
+}
+
+
+/* 
+  Sleep until woken by Mutex_Unlock, unless the mutex is no longer locked.
+  The owner inherits our priority until it unlocks: since MUTEX_PARKED is
+  set, its unlock must take the bucket lock we hold, so it cannot exit. 
+
+  A stale wakeup (e.g., meant for a morphed wait that timed out) may end 
+  the sleep while we are still queued; then we sleep again, as our waiter
+  must not be left in the bucket.
+ */
+static void mutex_park(Mutex* lock)
+{
+  __mutex_waiter waiter = { .thread = cur_thread(), .mx = lock };
+  struct mutex_park_bucket* b = mutex_bucket(lock);
+
+  int preempt = preempt_off;
+  Mutex_Lock(&b->lock);
+
+  if(mutex_mark_parked(lock)) {
+    TCB* owner = MUTEX_OWNER(__atomic_load_n(lock, __ATOMIC_RELAXED));
+    if(owner) sched_inherit_priority(owner, waiter.thread->priority, lock);
+    bucket_push(b, &waiter);
+    do {
+      sleep_releasing(STOPPED, &b->lock, SCHED_MUTEX, NO_TIMEOUT);
+      Mutex_Lock(&b->lock);
+    } while(waiter.queued);
+  }
+  Mutex_Unlock(&b->lock);
+
+  if(preempt) preempt_on;
+}
+
+
+/*
+  Queue a sleeping thread on the mutex it will lock next, instead of 
+  waking it (wait morphing). Return 0 if the mutex is not locked.
+
+  This is called with preemption off, for many waiters in a row. The 
+  bucket lock is kept in *held across calls, since the waiters of a 
+  condition usually share a mutex; release it with mutex_morph_done().
+ */
+static int mutex_morph(__mutex_waiter* w, struct mutex_park_bucket** held)
+{
+  struct mutex_park_bucket* b = mutex_bucket(w->mx);
+  if(b != *held) {
+    if(*held) Mutex_Unlock(&(*held)->lock);
+    Mutex_Lock(&b->lock);
+    *held = b;
+  }
+
+  int locked = mutex_mark_parked(w->mx);
+  if(locked)
+    bucket_push(b, w);
+  return locked;
+}
+
+static inline void mutex_morph_done(struct mutex_park_bucket** held)
+{
+  if(*held) Mutex_Unlock(&(*held)->lock);
+  *held = NULL;
+}
+
+
+/* Leave the bucket, if a morphed thread woke up by other means */
+static void mutex_unmorph(__mutex_waiter* w)
+{
+  struct mutex_park_bucket* b = mutex_bucket(w->mx);
+
+  int preempt = preempt_off;
+  Mutex_Lock(&b->lock);
+  if(w->queued)
+    bucket_remove(b, w);
+  Mutex_Unlock(&b->lock);
+  if(preempt) preempt_on;
+}
+
+
+/* 
+  Wake up the first thread parked on the mutex, dropping any priority 
+  inherited through it first. The boost is dropped under the bucket lock,
+  since mutex_park lends it under the bucket lock. The wakeup is also done
+  under the bucket lock: a morphed waiter that timed out checks w->queued
+  under it, and must not receive the wakeup later, in an unrelated sleep.
+ */
+static void mutex_unpark(Mutex* lock)
+{
+  struct mutex_park_bucket* b = mutex_bucket(lock);
+  TCB* thread = NULL;
+
+  int preempt = preempt_off;
+  Mutex_Lock(&b->lock);
+  sched_restore_priority(lock);
+
+  __mutex_waiter* first = b->waiters;
+  __mutex_waiter* w = first;
+  if(w) do {
+    if(w->mx == lock) break;
+    w = w->node.next->obj;
+  } while(w != first);
+
+  if(w && w->mx == lock) {
+    thread = w->thread;
+    bucket_remove(b, w);
+
+    /* If others wait for this mutex, the next unlock must wake them */
+    for(__mutex_waiter* o = b->waiters; o; ) {
+      if(o->mx == lock) {
+        __atomic_or_fetch(lock, MUTEX_PARKED, __ATOMIC_RELAXED);
+        break;
+      }
+      o = o->node.next->obj;
+      if(o == b->waiters) break;
+    }
+  }
+
+  if(thread) wakeup(thread);
+  Mutex_Unlock(&b->lock);
+
+  if(preempt) preempt_on;
+}
+
+
+/*
+	Lock profiling.
+	---------------
+
+	When compiled with MUTEX_PROFILE, every Mutex_Lock call site has a
+	record of its acquisitions, contended acquisitions, spin iterations, 
+	parks and hold times. The sites are found in an open-addressing table,
+	keyed by the address of their "file:line" string, and the records are
+	updated with atomics, so profiling takes no locks. Each thread keeps 
+	the mutexes it holds (up to MUTEX_HOLD_MAX) in its TCB, to charge the 
+	hold time to the site that locked them.
+
+	Without MUTEX_PROFILE, the MUTEX_PROF() hooks compile to nothing.
+ */
+#ifdef MUTEX_PROFILE
+
+#define MUTEX_PROF(stmt) stmt
+#define MUTEX_SITES 1024
+
+static struct mutex_site {
+  const char* where;
+  unsigned long acquired, contended, spins, parks;
+  unsigned long hold_total, hold_max;
+} mutex_sites[MUTEX_SITES];
+
+static struct mutex_site* mutex_site(const char* where)
+{
+  uintptr_t h = (uintptr_t)where;
+  uint i = ((h >> 3) ^ (h >> 13)) % MUTEX_SITES;
+  for(uint n=0; n<MUTEX_SITES; n++, i = (i+1) % MUTEX_SITES) {
+    const char* w = __atomic_load_n(&mutex_sites[i].where, __ATOMIC_ACQUIRE);
+    if(w == NULL && __atomic_compare_exchange_n(&mutex_sites[i].where, &w, where,
+        0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      return &mutex_sites[i];
+    if(w == where) return &mutex_sites[i];
+  }
+  return NULL;  /* table full: the site is not profiled */
+}
+
+/* A clock finer than bios_clock(), in microseconds */
+static unsigned long profile_clock()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000000ul + ts.tv_nsec/1000;
+}
+
+static void mutex_profile_acquired(Mutex* lock, const char* where, 
+  int contended, unsigned long spins, unsigned long parks)
+{
+  struct mutex_site* site = mutex_site(where);
+  if(site == NULL) return;
+  __atomic_add_fetch(&site->acquired, 1, __ATOMIC_RELAXED);
+  if(contended) {
+    __atomic_add_fetch(&site->contended, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->spins, spins, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&site->parks, parks, __ATOMIC_RELAXED);
+  }
+
+  /* Mutexes locked before the scheduler runs have no thread */
+  TCB* tcb = cur_thread();
+  if(tcb == NULL || tcb->mutex_held >= MUTEX_HOLD_MAX) return;
+  struct mutex_hold* h = &tcb->mutex_hold[tcb->mutex_held++];
+  h->lock = lock;
+  h->site = site;
+  h->since = profile_clock();
+}
+
+static void mutex_profile_released(Mutex* lock)
+{
+  TCB* tcb = cur_thread();
+  if(tcb == NULL) return;
+  for(int i = tcb->mutex_held-1; i >= 0; i--) {
+    struct mutex_hold* h = &tcb->mutex_hold[i];
+    if(h->lock != lock) continue;
+
+    struct mutex_site* site = h->site;
+    unsigned long held = profile_clock() - h->since;
+    __atomic_add_fetch(&site->hold_total, held, __ATOMIC_RELAXED);
+    unsigned long max = __atomic_load_n(&site->hold_max, __ATOMIC_RELAXED);
+    while(held > max && !__atomic_compare_exchange_n(&site->hold_max, &max, held,
+        0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    /* Locks are mostly released in reverse order */
+    *h = tcb->mutex_hold[--tcb->mutex_held];
+    return;
+  }
+}
+
+void reset_lock_profile()
+{
+  memset(mutex_sites, 0, sizeof(mutex_sites));
+}
+
+int get_lock_profile(uint index, lockinfo* info)
+{
+  for(; index < MUTEX_SITES; index++) {
+    struct mutex_site* site = &mutex_sites[index];
+    if(site->where == NULL) continue;
+    strncpy(info->site, site->where, LOCKINFO_MAX_SITE-1);
+    info->site[LOCKINFO_MAX_SITE-1] = 0;
+    info->acquired = site->acquired;
+    info->contended = site->contended;
+    info->spins = site->spins;
+    info->yields = site->parks;
+    info->hold_total = site->hold_total;
+    info->hold_max = site->hold_max;
+    return index+1;
+  }
+  return 0;
+}
+
+static int compare_contended(const void* a, const void* b)
+{
+  const lockinfo *la = a, *lb = b;
+  return (la->contended < lb->contended) - (la->contended > lb->contended);
+}
+
+void dump_lock_profile(FILE* f)
+{
+  static lockinfo info[MUTEX_SITES];
+  int n = 0;
+  for(int i = get_lock_profile(0, &info[0]); i; i = get_lock_profile(i, &info[n]))
+    n++;
+  qsort(info, n, sizeof(lockinfo), compare_contended);
+
+  fprintf(f, "%-32s %10s %10s %12s %8s %12s %10s\n", "Mutex_Lock site", 
+    "acquired", "contended", "spins", "yields", "hold usec", "max usec");
+  for(int i=0; i<n; i++)
+    fprintf(f, "%-32s %10lu %10lu %12lu %8lu %12lu %10lu\n", info[i].site, 
+      info[i].acquired, info[i].contended, info[i].spins, info[i].yields,
+      info[i].hold_total, info[i].hold_max);
+}
+
+#else
+
+#define MUTEX_PROF(stmt)
+
+void reset_lock_profile() { }
+int get_lock_profile(uint index, lockinfo* info) { return 0; }
+void dump_lock_profile(FILE* f) { }
+
+#endif
+
+
+#ifdef MUTEX_PROFILE
+void Mutex_Lock_at(Mutex* lock, const char* where)
+#else
 void Mutex_Lock(Mutex* lock)
+#endif
 {
 #define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
-#if defined(__x86__) || defined(__x86_64__)
-      __builtin_ia32_pause();
-#endif
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
-      		yield(SCHED_MUTEX); 
-      }
+  if(Mutex_TryLock(lock)) {
+    MUTEX_PROF(mutex_profile_acquired(lock, where, 0, 0, 0));
+    return;
+  }
+
+  /* This is a system call in the BIOS, so we ask only once */
+  int preemptive = cpu_interrupts_enabled();
+  MUTEX_PROF(unsigned long spins = 0; unsigned long parks = 0);
+
+  int spin=MUTEX_SPINS;
+  while(1) {
+    Mutex v = __atomic_load_n(lock, __ATOMIC_RELAXED);
+    if(!(v & MUTEX_LOCKED)) {
+      if(Mutex_TryLock(lock)) break;
+    }
+    else if(! preemptive || (spin>0 && mutex_owner_running(v))) {
+      /* Spin in the non-preemptive domain, or while the owner runs */
+      if(spin>0) spin--;
+      MUTEX_PROF(spins++);
+      cpu_relax();
+    }
+    else {
+      mutex_park(lock);
+      MUTEX_PROF(parks++);
+      spin=MUTEX_SPINS;
     }
   }
+  MUTEX_PROF(mutex_profile_acquired(lock, where, 1, spins, parks));
 #undef MUTEX_SPINS
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+  MUTEX_PROF(mutex_profile_released(lock));
+  if(__atomic_exchange_n(lock, 0, __ATOMIC_RELEASE) & MUTEX_PARKED)
+    mutex_unpark(lock);
+}
+
+
+/*
+	Ticket spinlock.
+	----------------
+
+	Each core takes a ticket with one atomic increment, and then spins 
+	reading @c owner, which changes only once per release. The lock is 
+	handed over in FIFO order, so no core starves under contention.
+
+	A waiter spins for as long as the cores ahead of it hold the lock,
+	so a Spinlock must only be held with preemption off, for short 
+	critical sections. A Mutex remains the lock of the preemptive domain.
+
+	FIFO handover assumes that every waiting core is running. When there
+	are more cores than physical CPUs, the core holding the next ticket 
+	may be descheduled by the host, and the lock stays idle. In that 
+	case, waiters do not take tickets; they wait until the lock is free 
+	(owner==next) and grab it, as with a test-and-set lock.
+ */
+void Spinlock_Lock(Spinlock* lock)
+{
+  if(cpu_parallel_cores() < cpu_cores()) {
+    while(! Spinlock_TryLock(lock))
+      while(__atomic_load_n(&lock->owner, __ATOMIC_RELAXED) 
+              != __atomic_load_n(&lock->next, __ATOMIC_RELAXED))
+        cpu_relax();
+    return;
+  }
+
+  uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+  while(__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+    cpu_relax();
+}
+
+
+int Spinlock_TryLock(Spinlock* lock)
+{
+  uint16_t owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+  Spinlock old = { owner, owner };
+  Spinlock new = { owner, (uint16_t)(owner+1) };
+  return __atomic_compare_exchange(lock, &old, &new, 0, 
+    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+void Spinlock_Unlock(Spinlock* lock)
+{
+  /* Only the holder writes owner, so a plain increment will do */
+  __atomic_store_n(&lock->owner, (uint16_t)(lock->owner+1), __ATOMIC_RELEASE);
 }
 
 
@@ -73,6 +510,7 @@ typedef struct __cv_waiter {
 	sig_atomic_t signalled;		/* this is set if the thread is signalled */
 	sig_atomic_t removed;		/* this is set if the waiter is removed 
 								   from the ring */
+	__mutex_waiter morph;		/* used to wait for the mutex, after a broadcast */
 } __cv_waiter;
 /** \endcond */
 
@@ -121,7 +559,8 @@ static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
 static int cv_wait(Mutex* mutex, CondVar* cv, 
 		enum SCHED_CAUSE cause, TimerDuration timeout)
 {
-	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0 };
+	__cv_waiter waiter = { .thread=cur_thread(), .signalled = 0, .removed=0,
+		.morph = { .thread=cur_thread(), .mx=mutex, .queued=0 } };
 	rlnode_init(& waiter.node, &waiter);
 
 	Mutex_Lock(&(cv->waitset_lock));
@@ -147,6 +586,10 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
 	}
 	Mutex_Unlock(&(cv->waitset_lock));
 
+	/* A broadcast may have queued us on the mutex, and a timeout woke us */
+	if(waiter.morph.queued)
+		mutex_unmorph(&waiter.morph);
+
 	Mutex_Lock(mutex);
 	return waiter.signalled;
 }
@@ -174,6 +617,65 @@ static inline void cv_signal(CondVar* cv)
 
 
 
+/** @internal The number of waiters woken up by each call to @c wakeup_many. */
+#define CV_BROADCAST_BATCH 32
+
+/** @internal Morph even without parallel cores (see set_cv_morph). */
+static int cv_morph_forced = 0;
+
+void set_cv_morph(int force)
+{
+	cv_morph_forced = force;
+}
+
+/**
+  @internal
+  Helper for Cond_Broadcast. This method removes all the waiters from the
+  ring. 
+
+  Waking them all would only have them contend for their mutex, which is
+  usually held by the broadcaster. Instead, a waiter whose mutex is locked
+  is moved to the wait queue of the mutex (wait morphing), and is woken up
+  by Mutex_Unlock, one at a time. The rest are woken up in batches, with 
+  @c wakeup_many.
+
+  Without parallel cores, woken waiters run one after the other and do 
+  not contend, so all waiters are woken up in batches; this is cheaper.
+ */
+static inline void cv_broadcast(CondVar* cv)
+{
+	__cv_waiter* waiters[CV_BROADCAST_BATCH];
+	TCB* threads[CV_BROADCAST_BATCH];
+	struct mutex_park_bucket* held = NULL;
+
+	/* Only waiters that run in parallel would contend for the mutex */
+	int morph = cv_morph_forced || cpu_parallel_cores() > 1;
+
+	int preempt = morph ? preempt_off : 0;
+	while(cv->waitset) {
+		int n = 0;
+		while(cv->waitset && n < CV_BROADCAST_BATCH) {
+			__cv_waiter* waiter = cv->waitset;
+			remove_from_ring(cv, waiter);
+			waiter->removed = 1;
+			if(morph && mutex_morph(&waiter->morph, &held)) {
+				waiter->signalled = 1;
+				continue;
+			}
+			waiters[n] = waiter;
+			threads[n] = waiter->thread;
+			n++;
+		}
+		mutex_morph_done(&held);
+
+		wakeup_many(threads, n);
+		for(int i=0; i<n; i++)
+			if(threads[i] != NULL) waiters[i]->signalled = 1;
+	}
+	if(preempt) preempt_on;
+}
+
+
 int Cond_Wait(Mutex* mutex, CondVar* cv)
 {
 	return cv_wait(mutex, cv, SCHED_USER, NO_TIMEOUT);
@@ -197,75 +699,278 @@ void Cond_Signal(CondVar* cv)
 void Cond_Broadcast(CondVar* cv)
 {
   Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
+  cv_broadcast(cv);
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
 
+/* 
+  Wait on a condition until an absolute deadline (or NO_TIMEOUT).
+  Return 0, without waiting, if the deadline has passed.
+ */
+static int cv_wait_until(Mutex* mx, CondVar* cv, TimerDuration deadline)
+{
+  if(deadline != NO_TIMEOUT) {
+    TimerDuration now = bios_clock();
+    if(now >= deadline) return 0;
+    cv_wait(mx, cv, SCHED_USER, deadline - now);
+  }
+  else
+    cv_wait(mx, cv, SCHED_USER, NO_TIMEOUT);
+  return 1;
+}
 
+static inline TimerDuration deadline_after(timeout_t timeout)
+{
+  return bios_clock() + timeout*1000ul;
+}
 
 
 /*
- *
- * The kernel locks
- *
+	Reader-writer locks.
+	--------------------
+
+	The readers are counted in per-core slots; a reader may unlock on 
+	another core than it locked, so only the sum of the slots is exact.
+	A reader increments its slot and then checks for writers; a writer
+	announces itself in `writers` and then checks the sum. Both use
+	sequentially consistent atomics, so at least one of them sees the 
+	other. A reader that sees a writer backs off and sleeps, until 
+	no writer holds or waits for the lock.
  */
 
-/**
- * @brief The kernel lock.
- *
- * Kernel locking is provided by a semaphore, implemented as a monitor.
- * A semaphre for kernel locking has advantages over a simple mutex. 
- * The main advantage is that @c kernel_mutex is held for a very short time
- * regardless of contention. Thus, in multicore machines, it allows for cores
- * to be passed to other threads. 
- * 
+static inline long rwlock_readers(RWLock* rw)
+{
+  long sum = 0;
+  for(int i=0; i<RWLOCK_SLOTS; i++)
+    sum += __atomic_load_n(&rw->slot[i].readers, __ATOMIC_SEQ_CST);
+  return sum;
+}
+
+static int rwlock_read_lock(RWLock* rw, TimerDuration deadline)
+{
+  while(1) {
+    __atomic_add_fetch(&rw->slot[cpu_core_id % RWLOCK_SLOTS].readers, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&rw->writers, __ATOMIC_SEQ_CST) == 0)
+      return 1;
+
+    /* Back off, in favour of the writer */
+    RWLock_ReadUnlock(rw);
+    Mutex_Lock(&rw->mx);
+    while(__atomic_load_n(&rw->writers, __ATOMIC_SEQ_CST) > 0)
+      if(! cv_wait_until(&rw->mx, &rw->cv, deadline)) {
+        Mutex_Unlock(&rw->mx);
+        return 0;
+      }
+    Mutex_Unlock(&rw->mx);
+  }
+}
+
+static int rwlock_write_lock(RWLock* rw, TimerDuration deadline)
+{
+  Mutex_Lock(&rw->mx);
+  __atomic_add_fetch(&rw->writers, 1, __ATOMIC_SEQ_CST);
+  while(rw->owned || rwlock_readers(rw) != 0)
+    if(! cv_wait_until(&rw->mx, &rw->cv, deadline)) {
+      /* Readers may have backed off for us */
+      __atomic_sub_fetch(&rw->writers, 1, __ATOMIC_SEQ_CST);
+      Cond_Broadcast(&rw->cv);
+      Mutex_Unlock(&rw->mx);
+      return 0;
+    }
+  rw->owned = 1;
+  Mutex_Unlock(&rw->mx);
+  return 1;
+}
+
+void RWLock_ReadLock(RWLock* rw)
+{
+  rwlock_read_lock(rw, NO_TIMEOUT);
+}
+
+int RWLock_TimedReadLock(RWLock* rw, timeout_t timeout)
+{
+  return rwlock_read_lock(rw, deadline_after(timeout));
+}
+
+void RWLock_ReadUnlock(RWLock* rw)
+{
+  __atomic_sub_fetch(&rw->slot[cpu_core_id % RWLOCK_SLOTS].readers, 1, __ATOMIC_SEQ_CST);
+
+  /* The last reader out wakes up a waiting writer */
+  if(__atomic_load_n(&rw->writers, __ATOMIC_SEQ_CST) > 0 && rwlock_readers(rw) == 0) {
+    Mutex_Lock(&rw->mx);
+    Cond_Broadcast(&rw->cv);
+    Mutex_Unlock(&rw->mx);
+  }
+}
+
+void RWLock_WriteLock(RWLock* rw)
+{
+  rwlock_write_lock(rw, NO_TIMEOUT);
+}
+
+int RWLock_TimedWriteLock(RWLock* rw, timeout_t timeout)
+{
+  return rwlock_write_lock(rw, deadline_after(timeout));
+}
+
+void RWLock_WriteUnlock(RWLock* rw)
+{
+  Mutex_Lock(&rw->mx);
+  rw->owned = 0;
+  __atomic_sub_fetch(&rw->writers, 1, __ATOMIC_SEQ_CST);
+  Cond_Broadcast(&rw->cv);
+  Mutex_Unlock(&rw->mx);
+}
+
+
+/*
+	Counting semaphores.
+	--------------------
+
+	Units are taken and returned with atomics. A thread that finds no 
+	units announces itself in `waiters`, and sleeps on the condition; 
+	as with the reader-writer locks, Sem_Post either sees the waiter or 
+	is seen by it.
  */
 
-/* This mutex is used to implement the kernel semaphore as a monitor. */
-static Mutex kernel_mutex = MUTEX_INIT;
+static inline int sem_trywait(Semaphore* sem)
+{
+  int v = __atomic_load_n(&sem->count, __ATOMIC_RELAXED);
+  while(v > 0)
+    if(__atomic_compare_exchange_n(&sem->count, &v, v-1, 0, 
+        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      return 1;
+  return 0;
+}
 
-/* Semaphore counter */
-static int kernel_sem = 1;
+static int sem_wait(Semaphore* sem, TimerDuration deadline)
+{
+  if(sem_trywait(sem)) return 1;
+
+  int taken = 1;
+  Mutex_Lock(&sem->mx);
+  __atomic_add_fetch(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+  while(! sem_trywait(sem))
+    if(! cv_wait_until(&sem->mx, &sem->cv, deadline)) {
+      taken = 0;
+      break;
+    }
+  __atomic_sub_fetch(&sem->waiters, 1, __ATOMIC_SEQ_CST);
+  Mutex_Unlock(&sem->mx);
+  return taken;
+}
 
-/* Semaphore condition */
-static CondVar kernel_sem_cv = COND_INIT;
+void Sem_Wait(Semaphore* sem)
+{
+  sem_wait(sem, NO_TIMEOUT);
+}
 
-void kernel_lock()
+int Sem_TimedWait(Semaphore* sem, timeout_t timeout)
 {
-	Mutex_Lock(& kernel_mutex);
-	while(kernel_sem<=0) {
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	}
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);
+  return sem_wait(sem, deadline_after(timeout));
 }
 
-void kernel_unlock()
+void Sem_Post(Semaphore* sem)
 {
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	Mutex_Unlock(& kernel_mutex);
+  __atomic_add_fetch(&sem->count, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&sem->waiters, __ATOMIC_SEQ_CST) > 0) {
+    Mutex_Lock(&sem->mx);
+    Cond_Signal(&sem->cv);
+    Mutex_Unlock(&sem->mx);
+  }
 }
 
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
-	const char* wchan_name, TimerDuration timeout)
+
+
+
+
+/*
+	Epochs.
+	-------
+
+	Readers are counted per core slot and per parity of the global epoch
+	they entered in. After incrementing its counter, a reader re-reads the
+	epoch, so that it is counted in the epoch it sees. The epoch advances 
+	from E to E+1 only when no reader of E-1 (which has the parity of E+1)
+	remains. Hence, when the epoch reaches S+2, the readers of S and 
+	before have left, and an object unpublished before epoch_now() 
+	returned S is no longer seen by anyone.
+
+	All the epoch atomics are sequentially consistent, so that a reader 
+	either sees the unpublished state, or is counted by the writer.
+ */
+
+static unsigned long epoch_global = 2;
+
+static struct {
+  long readers[2];
+  char pad[64 - 2*sizeof(long)];
+} epoch_slots[MAX_CORES];
+
+int epoch_enter()
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
+  uint slot = cpu_core_id;
+  while(1) {
+    unsigned long e = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&epoch_slots[slot].readers[e & 1], 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST) == e)
+      return 2*slot + (e & 1);
+    __atomic_sub_fetch(&epoch_slots[slot].readers[e & 1], 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+void epoch_exit(int token)
+{
+  __atomic_sub_fetch(&epoch_slots[token/2].readers[token & 1], 1, __ATOMIC_SEQ_CST);
+}
 
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
+unsigned long epoch_now()
+{
+  return __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+}
 
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
+/* Advance the epoch from e, if the readers of e-1 have left */
+static void epoch_advance(unsigned long e)
+{
+  for(uint c=0; c<MAX_CORES; c++)
+    if(__atomic_load_n(&epoch_slots[c].readers[(e+1) & 1], __ATOMIC_SEQ_CST) != 0)
+      return;
+  __atomic_compare_exchange_n(&epoch_global, &e, e+1, 0, 
+    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
 
-	return ret;
+int epoch_expired(unsigned long stamp)
+{
+  for(int i=0; i<2; i++) {
+    unsigned long e = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+    if(e >= stamp+2) return 1;
+    epoch_advance(e);
+  }
+  return __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST) >= stamp+2;
+}
+
+
+
+/*
+ *
+ * Kernel object locking
+ *
+ */
+
+/*
+ * There is no global kernel lock. Each kernel object (the process table,
+ * each PCB, the file table, each pipe, the socket port map, each serial
+ * device) is protected by its own Mutex, and system calls on disjoint
+ * objects run in parallel. A system call that must block waits on a
+ * condition variable, releasing the Mutex of the object it waits on.
+ */
+
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
+	const char* wchan_name, TimerDuration timeout)
+{
+	return cv_wait(mx, cv, cause, timeout);
 }
 
 void kernel_signal(CondVar* cv) 
@@ -278,14 +983,3 @@ void kernel_broadcast(CondVar* cv)
 	Cond_Broadcast(cv); 
 }
 
-void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
-{
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);
-	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
-}
-
-
-
-
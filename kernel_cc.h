@@ -26,43 +26,138 @@
 	Many of the header definitions for Mutexes and CondVars are in the 
    	tinyos.h file
 */
+#include <stdio.h>
 #include "kernel_sys.h"
 #include "kernel_sched.h"
 
 
 
 
+/**
+	@brief Try to lock a mutex, without spinning.
+
+	This is useful in the non-preemptive domain, when a lock must be
+	acquired out of the usual locking order.
+
+	@returns 1 if the mutex was locked, 0 if it was already locked
+  */
+int Mutex_TryLock(Mutex* lock);
+
+
+/**
+	@brief Lock a ticket spinlock.
+
+	The lock is granted in FIFO order among the waiting cores. It must
+	be called with preemption off.
+
+	@see Spinlock
+  */
+void Spinlock_Lock(Spinlock* lock);
+
+/**
+	@brief Try to lock a ticket spinlock, without spinning.
+
+	@returns 1 if the lock was acquired, 0 if it was held
+  */
+int Spinlock_TryLock(Spinlock* lock);
+
+/**
+	@brief Unlock a ticket spinlock.
+  */
+void Spinlock_Unlock(Spinlock* lock);
+
+
 /*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
+ * Epoch-based read-side protection.
+ *
+ * A reader brackets a lock-free lookup with epoch_enter()/epoch_exit(),
+ * and must not block in between. A writer unpublishes an object (e.g.,
+ * clears the FIDT slot that points to it) and stamps it with epoch_now();
+ * the object may be reused once epoch_expired() is true for its stamp,
+ * since no reader can still hold a pointer to it. Retired objects are
+ * kept by their owners, e.g., on a limbo list next to their free list.
  */
 
 /**
-	@brief Lock the kernel.
- */
-void kernel_lock();
+	@brief Enter a read-side section.
+
+	@returns a token to pass to @ref epoch_exit
+  */
+int epoch_enter();
+
+/**
+	@brief Leave a read-side section.
+  */
+void epoch_exit(int token);
 
 /**
-	@brief Unlock the kernel.
+	@brief Return the stamp of an object that was just unpublished.
+  */
+unsigned long epoch_now();
+
+/**
+	@brief Check if an object retired with @c stamp may be reused.
+
+	This tries to advance the epoch, if all the readers of the previous
+	epoch have left.
+
+	@returns 1 if no reader may still see the object, 0 otherwise
+  */
+int epoch_expired(unsigned long stamp);
+
+
+/**
+	@brief Clear the lock statistics. This is called at boot.
+
+	Lock statistics are only collected when compiled with @c MUTEX_PROFILE;
+	otherwise, the lock profile calls do nothing.
+	@see OpenLockInfo
+  */
+void reset_lock_profile();
+
+/**
+	@brief Get the lock statistics of a call site.
+
+	The sites are enumerated by starting with @c index equal to 0, and
+	passing the return value of each call to the next.
+
+	@returns the index to pass next, or 0 if there are no more sites
+  */
+int get_lock_profile(uint index, lockinfo* info);
+
+/**
+	@brief Print the lock statistics, most contended sites first.
+  */
+void dump_lock_profile(FILE* f);
+
+
+/*
+ * Kernel object locking.
+ *
+ * There is no global kernel lock: each kernel object is protected by 
+ * its own Mutex. The lock order is: the socket port map, the process 
+ * table, a PCB, the file table, a pipe, a serial device. Two pipes 
+ * (see Splice) are locked in address order.
  */
-void kernel_unlock();
 
 /**
-	@brief Wait on a condition variable using the kernel lock.
+	@brief Wait on a condition variable, releasing the Mutex of a kernel object.
+
+	The Mutex is released atomically with going to sleep, and it is locked
+	again before returning.
+
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
 
 /**
 	@brief Signal a kernel condition to one waiter.
-
-	This call must be made 
   */
 void kernel_signal(CondVar* cv);
 
@@ -71,14 +166,14 @@ void kernel_signal(CondVar* cv);
   */
 void kernel_broadcast(CondVar* cv);
 
-
 /**
-	@brief Put thread to sleep, unlocking the kernel.
+	@brief Force wait morphing in broadcasts, for testing.
 
-	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
+	A broadcast moves the waiters whose mutex is locked to the wait queue
+	of the mutex (wait morphing), but only when there are parallel cores.
+	If @c force is nonzero, waiters are morphed on any host.
   */
-void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
+void set_cv_morph(int force);
 
 
 
@@ -34,6 +34,8 @@
 */
 
 
+struct pipe_control_block;
+
 /**
   @brief The device-specific file operations table.
 
@@ -92,6 +94,21 @@ typedef struct file_operations {
     - There was a I/O runtime problem.
      */
     int (*Close)(void* this);
+
+    /** @brief The pipe that Read takes data from (optional).
+
+      Streams whose data is held in a pipe buffer (pipes and sockets) may
+      return it, so that @c Splice can move data between pipe buffers 
+      without copying through a user buffer. If this is NULL, or returns 
+      NULL, @c Splice uses Read.
+
+      The pipe is returned with a reference (see @c pipe_incref), which
+      the caller drops with @c pipe_decref.
+     */
+    struct pipe_control_block* (*ReadPipe)(void* this);
+
+    /** @brief The pipe that Write puts data into (optional, see @c ReadPipe). */
+    struct pipe_control_block* (*WritePipe)(void* this);
 } file_ops;
 
 
@@ -156,6 +173,14 @@ int device_open(Device_type major, uint minor, void** obj, file_ops** ops);
   */
 uint device_no(Device_type major);
 
+/**
+  @brief Get the stream operations of devices of a particular major number.
+
+  These are the @c file_ops that @ref device_open stores in the streams 
+  of the device, so this can be used to check the type of a stream.
+  */
+file_ops* device_fops(Device_type major);
+
 /** @} */
 
 #endif
@@ -9,6 +9,7 @@
 #include "kernel_proc.h"
 #include "kernel_dev.h"
 #include "kernel_streams.h"
+#include "kernel_cc.h"
 
 
 
@@ -39,6 +40,7 @@ void boot_tinyos_kernel()
     initialize_devices();
     initialize_files();
     initialize_scheduler();
+    reset_lock_profile();
 
     /* The boot task is executed normally! */
     if(Exec(boot_rec.init_task, boot_rec.argl, boot_rec.args)!=1)
@@ -53,8 +55,14 @@ void boot_tinyos_kernel()
 
   run_scheduler();
 
+  cpu_core_barrier_sync();
+
   if(cpu_core_id==0) {
-    /* Here, we could add cleanup after the scheduler has ended. */    
+    /* Cleanup after the scheduler has ended on all cores */
+    finalize_scheduler();
+#ifdef MUTEX_PROFILE
+    dump_lock_profile(stderr);
+#endif
   }
 }
 
@@ -3,21 +3,161 @@
 #include "kernel_sched.h"
 #include "kernel_cc.h"
 
+/* The total size of all pipe buffers */
+static unsigned long pipe_buffer_memory = 0;
+
+/* The smallest power of 2 buffer which can hold n bytes */
+static unsigned int pipe_roundup(unsigned int n)
+{
+	unsigned int size = PIPE_MIN_BUFFER;
+	while(size < n)
+		size <<= 1;
+	return size;
+}
+
+/* Copy n bytes into the ring, in at most two segments: up to the end of the buffer, and from its start */
+static void pipe_put(PIPE_CB* pipe_cb, const char* buf, unsigned int n)
+{
+	unsigned int first = pipe_cb->size - pipe_cb->w_position;
+	if(first > n)
+		first = n;
+
+	memcpy(pipe_cb->BUFFER + pipe_cb->w_position, buf, first);
+	memcpy(pipe_cb->BUFFER, buf + first, n - first);
+	pipe_cb->w_position = (pipe_cb->w_position + n) & (pipe_cb->size - 1);
+
+	pipe_cb->count += n;
+	if(pipe_cb->count > pipe_cb->peak)
+		pipe_cb->peak = pipe_cb->count;
+}
+
+/* Copy n bytes out of the ring, like pipe_put */
+static void pipe_get(PIPE_CB* pipe_cb, char* buf, unsigned int n)
+{
+	unsigned int first = pipe_cb->size - pipe_cb->r_position;
+	if(first > n)
+		first = n;
+
+	memcpy(buf, pipe_cb->BUFFER + pipe_cb->r_position, first);
+	memcpy(buf + first, pipe_cb->BUFFER, n - first);
+	pipe_cb->r_position = (pipe_cb->r_position + n) & (pipe_cb->size - 1);
+
+	pipe_cb->count -= n;
+}
+
+/* Replace the buffer by one of the given size (0 to release it), keeping the data */
+static void pipe_resize(PIPE_CB* pipe_cb, unsigned int size)
+{
+	unsigned int count = pipe_cb->count;
+	char* buffer = NULL;
+
+	if(size > 0) {
+		assert(count <= size);
+		buffer = xmalloc(size);
+		if(count > 0)
+			pipe_get(pipe_cb, buffer, count);
+	} else {
+		assert(count == 0);
+	}
+	free(pipe_cb->BUFFER);
+
+	__atomic_add_fetch(&pipe_buffer_memory, size, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&pipe_buffer_memory, pipe_cb->size, __ATOMIC_RELAXED);
+
+	pipe_cb->BUFFER = buffer;
+	pipe_cb->size = size;
+	pipe_cb->count = count;
+	pipe_cb->r_position = 0;
+	pipe_cb->w_position = (size > 0) ? (count & (size - 1)) : 0;
+}
+
+/* Make room for n more bytes */
+static void pipe_grow(PIPE_CB* pipe_cb, unsigned int n)
+{
+	if(pipe_cb->count + n > pipe_cb->size)
+		pipe_resize(pipe_cb, pipe_roundup(pipe_cb->count + n));
+}
+
+/* 
+	Called when data is taken out. When the pipe becomes empty, release the
+	buffer if the pipe has no writer, or shrink it if the data since the
+	pipe was last empty fit in a quarter of it.
+ */
+static void pipe_drained(PIPE_CB* pipe_cb)
+{
+	if(pipe_cb->count > 0)
+		return;
+
+	if(pipe_cb->writer == NULL) {
+		pipe_resize(pipe_cb, 0);
+	} else {
+		unsigned int size = 2*pipe_roundup(pipe_cb->peak);
+		if(size > pipe_roundup(pipe_cb->capacity))
+			size = pipe_roundup(pipe_cb->capacity);
+		if(2*size <= pipe_cb->size)
+			pipe_resize(pipe_cb, size);
+	}
+	pipe_cb->peak = 0;
+}
+
+
+static PIPE_CB* pipe_self(void* pipecb_t)
+{
+	PIPE_CB* pipe_cb = (PIPE_CB*) pipecb_t;
+	pipe_incref(pipe_cb);
+	return pipe_cb;
+}
+
 static file_ops reader_file_ops ={
 	.Open = NULL,
 	.Read = pipe_read,
 	.Write = NULL,
-	.Close = pipe_reader_close
+	.Close = pipe_reader_close,
+	.ReadPipe = pipe_self
 };
 
 static file_ops writer_file_ops ={
 	.Open = NULL,
 	.Read = NULL,
 	.Write = pipe_write,
-	.Close = pipe_writer_close
+	.Close = pipe_writer_close,
+	.WritePipe = pipe_self
 };
 
 
+void pipe_init(PIPE_CB* pipe_cb, FCB* reader, FCB* writer)
+{
+	pipe_cb->reader = reader;
+	pipe_cb->writer = writer;
+	pipe_cb->lock = MUTEX_INIT;
+	pipe_cb->has_space = COND_INIT;
+	pipe_cb->has_data = COND_INIT;
+	pipe_cb->w_position = 0;
+	pipe_cb->r_position = 0;
+	pipe_cb->BUFFER = NULL;
+	pipe_cb->size = 0;
+	pipe_cb->count = 0;
+	pipe_cb->capacity = PIPE_BUFFER_SIZE;
+	pipe_cb->peak = 0;
+	pipe_cb->refcount = 2;
+}
+
+void pipe_incref(PIPE_CB* pipe_cb)
+{
+	__atomic_add_fetch(&pipe_cb->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void pipe_decref(PIPE_CB* pipe_cb)
+{
+	if(__atomic_sub_fetch(&pipe_cb->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	/* Both ends are closed, so the buffer has been released */
+	assert(pipe_cb->BUFFER == NULL);
+	free(pipe_cb);
+}
+
+
 int sys_Pipe(pipe_t* pipe)
 {
 	//Reserve
@@ -34,21 +174,13 @@ int sys_Pipe(pipe_t* pipe)
 	pipe->write = fid[1];
 
 	//Init pipe_cb
-	pipe_cb->space = PIPE_BUFFER_SIZE;
-	pipe_cb->reader = 0;
-	pipe_cb->writer = 0;
-	pipe_cb->has_space = COND_INIT;
-	pipe_cb->has_data = COND_INIT;
-	pipe_cb->w_position = 0;
-	pipe_cb->r_position = 0;
+	pipe_init(pipe_cb, fcb[0], fcb[1]);
 
 	fcb[0]->streamobj = pipe_cb;
 	fcb[1]->streamobj = pipe_cb;
 	fcb[0]->streamfunc = &reader_file_ops;
 	fcb[1]->streamfunc = &writer_file_ops;
-
-	pipe_cb->reader = fcb[0];
-	pipe_cb->writer = fcb[1];
+	FCB_install(2, fid, fcb);
 
 	return 0;
 }
@@ -59,31 +191,30 @@ int pipe_write(void* pipecb_t, const char *buf, unsigned int size){
 
 	assert(pipe_cb != NULL);
 
-	int bytes_written = 0;
+	unsigned int bytes_written;
+
+	Mutex_Lock(&pipe_cb->lock);
 
-	while(pipe_cb->space == 0 && pipe_cb->reader != NULL){
-		kernel_wait(&pipe_cb->has_space, SCHED_PIPE);
+	while(pipe_cb->count >= pipe_cb->capacity && pipe_cb->reader != NULL){
+		kernel_wait(&pipe_cb->lock, &pipe_cb->has_space, SCHED_PIPE);
 	}
 
-	if(pipe_cb->reader == NULL)
+	if(pipe_cb->reader == NULL) {
+		Mutex_Unlock(&pipe_cb->lock);
 		return -1;
-
-	//write while data written is not greater than pipe buffer size
-	while(bytes_written < pipe_cb->space){
-
-		if(bytes_written >= size)
-			break;
-
-		pipe_cb->BUFFER[pipe_cb->w_position] = buf[bytes_written];//copy to buffer
-		pipe_cb->w_position = (pipe_cb->w_position + 1) %PIPE_BUFFER_SIZE;//move to next write position
-
-		bytes_written++;//increase data counter
 	}
 
-	pipe_cb->space -= bytes_written;//decrease available space
+	//write as much as fits, growing the buffer if needed
+	unsigned int space = pipe_cb->capacity - pipe_cb->count;
+	bytes_written = (size < space) ? size : space;
+
+	pipe_grow(pipe_cb, bytes_written);
+	pipe_put(pipe_cb, buf, bytes_written);
 
 	kernel_broadcast(&pipe_cb->has_data);
 
+	Mutex_Unlock(&pipe_cb->lock);
+
 	return bytes_written;
 }
 
@@ -93,29 +224,29 @@ int pipe_read(void* pipecb_t, char *buf, unsigned int size){
 
 	assert(pipe_cb != NULL);
 
-	int bytes_read = 0;
+	unsigned int bytes_read;
+
+	Mutex_Lock(&pipe_cb->lock);
 
-	while(pipe_cb->space == PIPE_BUFFER_SIZE && pipe_cb->writer != NULL){
-		kernel_wait(&(pipe_cb->has_data), SCHED_PIPE);
+	while(pipe_cb->count == 0 && pipe_cb->writer != NULL){
+		kernel_wait(&pipe_cb->lock, &(pipe_cb->has_data), SCHED_PIPE);
 	}
 
-	if(pipe_cb->space == PIPE_BUFFER_SIZE)
+	if(pipe_cb->count == 0) {
+		pipe_drained(pipe_cb);
+		Mutex_Unlock(&pipe_cb->lock);
 		return 0;
-
-	while(bytes_read < PIPE_BUFFER_SIZE - pipe_cb->space){
-		if(bytes_read >= size)
-			break;
-
-		buf[bytes_read] = pipe_cb->BUFFER[pipe_cb->r_position];
-		pipe_cb->r_position = (pipe_cb->r_position + 1) % PIPE_BUFFER_SIZE;
-
-		bytes_read++;
 	}
 
-	pipe_cb->space += bytes_read;
+	//read as much as is available
+	bytes_read = (size < pipe_cb->count) ? size : pipe_cb->count;
+	pipe_get(pipe_cb, buf, bytes_read);
+	pipe_drained(pipe_cb);
 
 	kernel_broadcast(&pipe_cb->has_space);
 
+	Mutex_Unlock(&pipe_cb->lock);
+
 	return bytes_read;
 }
 
@@ -128,14 +259,15 @@ int pipe_writer_close(void* _pipecb){
 
 	assert(pipe_cb != NULL);
 
+	Mutex_Lock(&pipe_cb->lock);
 	pipe_cb->writer = NULL;
+	/* the reader may still read the data in the buffer */
+	if(pipe_cb->count == 0)
+		pipe_resize(pipe_cb, 0);
 	kernel_broadcast(&pipe_cb->has_data);
+	Mutex_Unlock(&pipe_cb->lock);
 
-	if(pipe_cb->reader == NULL){
-		pipe_cb = NULL;
-		free(pipe_cb);
-	}
-
+	pipe_decref(pipe_cb);
 	return 0;
 }
 
@@ -149,13 +281,196 @@ int pipe_reader_close(void* _pipecb){
 
 	assert(pipe_cb != NULL);
 
+	Mutex_Lock(&pipe_cb->lock);
 	pipe_cb->reader = NULL;
+	/* nobody will read the data in the buffer */
+	pipe_cb->count = 0;
+	pipe_resize(pipe_cb, 0);
 	kernel_broadcast(&pipe_cb->has_space);
+	Mutex_Unlock(&pipe_cb->lock);
+
+	pipe_decref(pipe_cb);
+	return 0;
+}
+
+
+/*
+	Pipe sizes
+ */
+
+static void pipe_set_capacity(PIPE_CB* pipe_cb, unsigned int capacity)
+{
+	Mutex_Lock(&pipe_cb->lock);
+	pipe_cb->capacity = capacity;
+	kernel_broadcast(&pipe_cb->has_space);
+	Mutex_Unlock(&pipe_cb->lock);
+}
+
+int sys_SetPipeSize(Fid_t fd, unsigned int size)
+{
+	FCB* fcb = get_fcb_ref(fd);
+	if(fcb == NULL)
+		return -1;
+
+	PIPE_CB* rpipe = fcb->streamfunc->ReadPipe ? fcb->streamfunc->ReadPipe(fcb->streamobj) : NULL;
+	PIPE_CB* wpipe = fcb->streamfunc->WritePipe ? fcb->streamfunc->WritePipe(fcb->streamobj) : NULL;
+	PIPE_CB* pipe_cb = rpipe ? rpipe : wpipe;
+	int retcode = -1;
+
+	if(pipe_cb == NULL)
+		goto finish;
 
-	if(pipe_cb->writer == NULL){
-		pipe_cb = NULL;
-		free(pipe_cb);
+	if(size > 0) {
+		if(size < PIPE_MIN_BUFFER) size = PIPE_MIN_BUFFER;
+		if(size > PIPE_MAX_BUFFER) size = PIPE_MAX_BUFFER;
+		if(rpipe) pipe_set_capacity(rpipe, size);
+		if(wpipe) pipe_set_capacity(wpipe, size);
 	}
+	retcode = __atomic_load_n(&pipe_cb->capacity, __ATOMIC_RELAXED);
 
-	return 0;
-}
\ No newline at end of file
+finish:
+	if(rpipe) pipe_decref(rpipe);
+	if(wpipe) pipe_decref(wpipe);
+	FCB_decref(fcb);
+	return retcode;
+}
+
+unsigned long sys_GetPipeMemory()
+{
+	return __atomic_load_n(&pipe_buffer_memory, __ATOMIC_RELAXED);
+}
+
+
+/*
+	Splice
+ */
+
+/* The size of the buffer that Splice uses for streams without a pipe */
+#define SPLICE_BOUNCE_SIZE 1024
+
+/*
+	Move up to size bytes from pipe src to pipe dst, without a user buffer.
+	Like pipe_read, wait for data in src, and like pipe_write, wait for
+	space in dst. Since we cannot wait on both pipes at once, we wait on
+	each one in turn, and then lock both (in address order) to copy.
+ */
+static int pipe_splice(PIPE_CB* src, PIPE_CB* dst, unsigned int size)
+{
+	PIPE_CB* first_lock = (src < dst) ? src : dst;
+	PIPE_CB* second_lock = (src < dst) ? dst : src;
+
+	for(;;) {
+		Mutex_Lock(&src->lock);
+		while(src->count == 0 && src->writer != NULL)
+			kernel_wait(&src->lock, &src->has_data, SCHED_PIPE);
+		int eof = (src->count == 0);
+		if(eof)
+			pipe_drained(src);
+		Mutex_Unlock(&src->lock);
+		if(eof)
+			return 0;
+
+		Mutex_Lock(&dst->lock);
+		while(dst->count >= dst->capacity && dst->reader != NULL)
+			kernel_wait(&dst->lock, &dst->has_space, SCHED_PIPE);
+		int broken = (dst->reader == NULL);
+		Mutex_Unlock(&dst->lock);
+		if(broken)
+			return -1;
+
+		Mutex_Lock(&first_lock->lock);
+		Mutex_Lock(&second_lock->lock);
+
+		unsigned int n = src->count;
+		unsigned int space = (dst->count < dst->capacity) ? dst->capacity - dst->count : 0;
+		if(n > space) n = space;
+		if(n > size) n = size;
+		if(dst->reader == NULL) n = 0;
+
+		/* Copy in at most three segments, split where either ring wraps around */
+		pipe_grow(dst, n);
+		for(unsigned int left = n; left > 0; ) {
+			unsigned int seg = left;
+			if(seg > src->size - src->r_position) seg = src->size - src->r_position;
+			if(seg > dst->size - dst->w_position) seg = dst->size - dst->w_position;
+
+			memcpy(dst->BUFFER + dst->w_position, src->BUFFER + src->r_position, seg);
+			src->r_position = (src->r_position + seg) & (src->size - 1);
+			dst->w_position = (dst->w_position + seg) & (dst->size - 1);
+			left -= seg;
+		}
+		src->count -= n;
+		dst->count += n;
+		if(dst->count > dst->peak)
+			dst->peak = dst->count;
+
+		if(n > 0) {
+			pipe_drained(src);
+			kernel_broadcast(&src->has_space);
+			kernel_broadcast(&dst->has_data);
+		}
+
+		Mutex_Unlock(&second_lock->lock);
+		Mutex_Unlock(&first_lock->lock);
+
+		/* Another thread may have taken the data or the space meanwhile */
+		if(n > 0)
+			return n;
+	}
+}
+
+/* 
+	Move up to size bytes through a kernel buffer, with a Read and Writes.
+	If a Write fails, the bytes read but not written are lost, and this 
+	is an error, even if some bytes were written.
+ */
+static int bounce_splice(FCB* in, FCB* out, unsigned int size)
+{
+	char buf[SPLICE_BOUNCE_SIZE];
+	if(size > SPLICE_BOUNCE_SIZE)
+		size = SPLICE_BOUNCE_SIZE;
+
+	int n = in->streamfunc->Read(in->streamobj, buf, size);
+	if(n <= 0)
+		return n;
+
+	int written = 0;
+	while(written < n) {
+		int rc = out->streamfunc->Write(out->streamobj, buf+written, n-written);
+		if(rc <= 0)
+			return -1;
+		written += rc;
+	}
+	return written;
+}
+
+int sys_Splice(Fid_t in, Fid_t out, unsigned int size)
+{
+	FCB* fin = get_fcb_ref(in);
+	FCB* fout = get_fcb_ref(out);
+	int retcode = -1;
+
+	if(fin == NULL || fout == NULL || fin->streamfunc->Read == NULL || fout->streamfunc->Write == NULL)
+		goto finish;
+
+	if(size == 0) {
+		retcode = 0;
+		goto finish;
+	}
+
+	PIPE_CB* src = fin->streamfunc->ReadPipe ? fin->streamfunc->ReadPipe(fin->streamobj) : NULL;
+	PIPE_CB* dst = fout->streamfunc->WritePipe ? fout->streamfunc->WritePipe(fout->streamobj) : NULL;
+
+	if(src != NULL && dst != NULL && src != dst)
+		retcode = pipe_splice(src, dst, size);
+	else
+		retcode = bounce_splice(fin, fout, size);
+
+	if(src) pipe_decref(src);
+	if(dst) pipe_decref(dst);
+
+finish:
+	if(fin) FCB_decref(fin);
+	if(fout) FCB_decref(fout);
+	return retcode;
+}
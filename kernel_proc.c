@@ -18,6 +18,7 @@
 /* The process table */
 PCB PT[MAX_PROC];
 unsigned int process_count;
+Mutex process_table_mutex = MUTEX_INIT;
 
 PCB* get_pcb(Pid_t pid)
 {
@@ -33,6 +34,7 @@ Pid_t get_pid(PCB* pcb)
 static inline void initialize_PCB(PCB* pcb)
 {
   pcb->pstate = FREE;
+  pcb->lock = MUTEX_INIT;
   pcb->argl = 0;
   pcb->args = NULL;
   pcb->thread_count = 0;
@@ -55,6 +57,13 @@ static inline void initialize_PCB(PCB* pcb)
 
 static PCB* pcb_freelist;
 
+/* 
+  Released PCBs wait in limbo, in release order, until no lock-free
+  reader (see procinfo_read) may still see them. The limbo list is
+  linked through exited_node, which is unused after cleanup_zombie.
+ */
+static rlnode pcb_limbo;
+
 void initialize_processes()
 {
   /* initialize the PCBs */
@@ -65,6 +74,7 @@ void initialize_processes()
   /* use the parent field to build a free list */
   PCB* pcbiter;
   pcb_freelist = NULL;
+  rlnode_init(&pcb_limbo, NULL);
   for(pcbiter = PT+MAX_PROC; pcbiter!=PT; ) {
     --pcbiter;
     pcbiter->parent = pcb_freelist;
@@ -79,13 +89,37 @@ void initialize_processes()
 }
 
 
+/* Move the expired PCBs from the limbo to the free list */
+static void reclaim_PCBs()
+{
+  while(! is_rlist_empty(&pcb_limbo) && epoch_expired(pcb_limbo.next->pcb->retired)) {
+    PCB* pcb = rlist_pop_front(&pcb_limbo)->pcb;
+    free(pcb->args);
+    pcb->args = NULL;
+    pcb->parent = pcb_freelist;
+    pcb_freelist = pcb;
+  }
+}
+
 /*
-  Must be called with kernel_mutex held
+  Must be called with process_table_mutex held. 
+
+  If no PCB is free but some are in limbo, wait for them to expire, 
+  since the readers that may still see them do not block. The mutex is
+  released while waiting.
 */
 PCB* acquire_PCB()
 {
   PCB* pcb = NULL;
 
+  reclaim_PCBs();
+  while(pcb_freelist == NULL && ! is_rlist_empty(&pcb_limbo)) {
+    Mutex_Unlock(&process_table_mutex);
+    yield(SCHED_POLL);
+    Mutex_Lock(&process_table_mutex);
+    reclaim_PCBs();
+  }
+
   if(pcb_freelist != NULL) {
     pcb = pcb_freelist;
     pcb->pstate = ALIVE;
@@ -97,13 +131,13 @@ PCB* acquire_PCB()
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with process_table_mutex held
 */
 void release_PCB(PCB* pcb)
 {
-  pcb->pstate = FREE;
-  pcb->parent = pcb_freelist;
-  pcb_freelist = pcb;
+  __atomic_store_n(&pcb->pstate, FREE, __ATOMIC_SEQ_CST);
+  pcb->retired = epoch_now();
+  rlist_push_back(&pcb_limbo, &pcb->exited_node);
   process_count--;
 }
 
@@ -152,14 +186,19 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   PCB *curproc, *newproc;
   
   /* The new process PCB */
+  Mutex_Lock(&process_table_mutex);
   newproc = acquire_PCB();
 
-  if(newproc == NULL) goto finish;  /* We have run out of PIDs! */
+  if(newproc == NULL) {  /* We have run out of PIDs! */
+    Mutex_Unlock(&process_table_mutex);
+    goto finish;
+  }
 
   if(get_pid(newproc)<=1) {
     /* Processes with pid<=1 (the scheduler and the init process) 
        are parentless and are treated specially. */
     newproc->parent = NULL;
+    Mutex_Unlock(&process_table_mutex);
   }
   else
   {
@@ -169,13 +208,16 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     /* Add new process to the parent's child list */
     newproc->parent = curproc;
     rlist_push_front(& curproc->children_list, & newproc->children_node);
+    Mutex_Unlock(&process_table_mutex);
 
     /* Inherit file streams from parent */
+    Mutex_Lock(&curproc->lock);
     for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
+       /* Skip the fids that are reserved but not open yet */
+       FCB* fcb = curproc->FIDT[i];
+       newproc->FIDT[i] = (fcb && FCB_tryref(fcb)) ? fcb : NULL;
     }
+    Mutex_Unlock(&curproc->lock);
   }
 
 
@@ -185,8 +227,10 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   /* Copy the arguments to new storage, owned by the new process */
   newproc->argl = argl;
   if(args!=NULL) {
-    newproc->args = malloc(argl);
-    memcpy(newproc->args, args, argl);
+    void* args_copy = malloc(argl);
+    memcpy(args_copy, args, argl);
+    /* Publish to lock-free readers, after argl (see procinfo_read) */
+    __atomic_store_n(&newproc->args, args_copy, __ATOMIC_RELEASE);
   }
   else
     newproc->args=NULL;
@@ -198,7 +242,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
    */
   if(call != NULL) {
 
-    newproc->main_thread = spawn_thread(newproc, start_main_thread);
+    newproc->main_thread = spawn_thread(newproc, start_main_thread, 0);
 
     /*Acquire a PTCB*/
     PTCB* ptcb = (PTCB*)xmalloc(sizeof(PTCB));
@@ -246,10 +290,16 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  Mutex_Lock(&process_table_mutex);
+  Pid_t ppid = get_pid(CURPROC->parent);
+  Mutex_Unlock(&process_table_mutex);
+  return ppid;
 }
 
 
+/*
+  Must be called with process_table_mutex held
+*/
 static void cleanup_zombie(PCB* pcb, int* status)
 {
   if(status != NULL)
@@ -267,10 +317,11 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Legality checks */
   if((cpid<0) || (cpid>=MAX_PROC)) {
-    cpid = NOPROC;
-    goto finish;
+    return NOPROC;
   }
 
+  Mutex_Lock(&process_table_mutex);
+
   PCB* parent = CURPROC;
   PCB* child = get_pcb(cpid);
   if( child == NULL || child->parent != parent)
@@ -281,11 +332,12 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(&process_table_mutex, & parent->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
   
 finish:
+  Mutex_Unlock(&process_table_mutex);
   return cpid;
 }
 
@@ -294,6 +346,8 @@ static Pid_t wait_for_any_child(int* status)
 {
   Pid_t cpid;
 
+  Mutex_Lock(&process_table_mutex);
+
   PCB* parent = CURPROC;
 
   /* Make sure I have children! */
@@ -305,17 +359,20 @@ static Pid_t wait_for_any_child(int* status)
     has_exited = ! is_rlist_empty(& parent->exited_list);
     if( has_exited ) break;
 
-    kernel_wait(& parent->child_exit, SCHED_USER);    
+    kernel_wait(&process_table_mutex, & parent->child_exit, SCHED_USER);    
   }
 
-  if(no_children)
+  if(no_children) {
+    Mutex_Unlock(&process_table_mutex);
     return NOPROC;
+  }
 
   PCB* child = parent->exited_list.next->pcb;
   assert(child->pstate == ZOMBIE);
   cpid = get_pid(child);
   cleanup_zombie(child, status);
 
+  Mutex_Unlock(&process_table_mutex);
   return cpid;
 }
 
@@ -340,7 +397,9 @@ void sys_Exit(int exitval)
   PCB *curproc = CURPROC;  /* cache for efficiency */
 
   /* First, store the exit status */
+  Mutex_Lock(&process_table_mutex);
   curproc->exitval = exitval;
+  Mutex_Unlock(&process_table_mutex);
 
   /* 
     Here, we must check that we are not the init task. 
@@ -377,15 +436,18 @@ Fid_t sys_OpenInfo()
 
   picb->PCB_cursor = 1;
 
-  fcb->refcount = 0;
   fcb->streamobj = picb;
   fcb->streamfunc = &procinfo_ops;
-
-  rlnode_init(&fcb->freelist_node, NULL);
+  FCB_install(1, &fid, &fcb);
 
   return fid;
 }
 
+/*
+  The process table is read without locking, in an epoch read-side
+  section: a PCB may change while it is read, but it is not reused
+  (and its args are not freed) until the section ends.
+ */
 int procinfo_read(void* procinfoCB_t, char* buf, unsigned int size){
 
   PICB* picb = (PICB*)procinfoCB_t;
@@ -393,36 +455,40 @@ int procinfo_read(void* procinfoCB_t, char* buf, unsigned int size){
   if(picb == NULL)
     return -1;
 
+  int epoch = epoch_enter();
+
   while(picb->PCB_cursor < MAX_PROC){
 
-    if(PT[picb->PCB_cursor].pstate == FREE)
+    PCB* pcb = &PT[picb->PCB_cursor];
+    pid_state pstate = __atomic_load_n(&pcb->pstate, __ATOMIC_SEQ_CST);
+
+    if(pstate == FREE) {
       picb->PCB_cursor++;
+    }
 
     else{
 
-      PCB pcb = PT[picb->PCB_cursor];
-
-      picb->p_info.pid = get_pid(&PT[picb->PCB_cursor]);
-      picb->p_info.ppid = get_pid(pcb.parent);
-
-      if(pcb.pstate == ALIVE)
-        picb->p_info.alive = 1;
-      else
-        picb->p_info.alive = 0;
+      picb->p_info.pid = get_pid(pcb);
+      picb->p_info.ppid = get_pid(pcb->parent);
+      picb->p_info.alive = (pstate == ALIVE);
+      picb->p_info.thread_count = pcb->thread_count;
+      picb->p_info.main_task = pcb->main_task;
 
-      picb->p_info.thread_count = pcb.thread_count;
-      picb->p_info.main_task = PT[picb->PCB_cursor].main_task;
-      picb->p_info.argl = pcb.argl;
+      /* Read args before argl, as Exec publishes them in reverse order */
+      void* args = __atomic_load_n(&pcb->args, __ATOMIC_ACQUIRE);
+      picb->p_info.argl = pcb->argl;
 
       int sizeof_args;
       
-      if(pcb.argl > PROCINFO_MAX_ARGS_SIZE)
+      if(picb->p_info.argl > PROCINFO_MAX_ARGS_SIZE)
         sizeof_args = PROCINFO_MAX_ARGS_SIZE;
       else
-        sizeof_args = pcb.argl;
+        sizeof_args = picb->p_info.argl;
+
+      if(args != NULL)
+        memcpy(picb->p_info.args, args, sizeof_args);
 
-      if(pcb.args != NULL)
-        memcpy(picb->p_info.args, pcb.args, sizeof_args);
+      epoch_exit(epoch);
 
       memcpy(buf, (char*)&picb->p_info, size);
 
@@ -434,11 +500,62 @@ int procinfo_read(void* procinfoCB_t, char* buf, unsigned int size){
 
     }
 
+  epoch_exit(epoch);
 
   return 0;
 
 }
 
+/*
+  The lock information stream. Its stream object is the index of the next
+  call site to report (see get_lock_profile).
+ */
+static int lockinfo_read(void* cursor, char* buf, unsigned int size)
+{
+  if(size < sizeof(lockinfo))
+    return -1;
+
+  lockinfo info;
+  int next = get_lock_profile(*(uint*)cursor, &info);
+  if(next == 0)
+    return 0;
+
+  *(uint*)cursor = next;
+  memcpy(buf, &info, sizeof(lockinfo));
+  return sizeof(lockinfo);
+}
+
+static int lockinfo_close(void* cursor)
+{
+  free(cursor);
+  return 0;
+}
+
+static file_ops lockinfo_ops = {
+  .Open = NULL,
+  .Read = lockinfo_read,
+  .Write = NULL,
+  .Close = lockinfo_close
+};
+
+Fid_t sys_OpenLockInfo()
+{
+  Fid_t fid;
+  FCB* fcb;
+
+  if(FCB_reserve(1, &fid, &fcb) == 0)
+    return NOFILE;
+
+  uint* cursor = (uint*)xmalloc(sizeof(uint));
+  *cursor = 0;
+
+  fcb->streamobj = cursor;
+  fcb->streamfunc = &lockinfo_ops;
+  FCB_install(1, &fid, &fcb);
+  return fid;
+}
+
+
 int procinfo_close(void* _picb){
 
   PICB* picb = (PICB*)_picb;
@@ -45,6 +45,9 @@ typedef enum pid_state_e {
 typedef struct process_control_block {
   pid_state  pstate;      /**< @brief The pid state for this PCB */
 
+  Mutex lock;             /**< @brief Protects @c FIDT, @c ptcb_list, @c thread_count
+                               and the PTCBs of the process */
+
   PCB* parent;            /**< @brief Parent's pcb. */
   int exitval;            /**< @brief The exit value of the process */
 
@@ -57,7 +60,9 @@ typedef struct process_control_block {
   rlnode exited_list;     /**< @brief List of exited children */
 
   rlnode children_node;   /**< @brief Intrusive node for @c children_list */
-  rlnode exited_node;     /**< @brief Intrusive node for @c exited_list */
+  rlnode exited_node;     /**< @brief Intrusive node for @c exited_list, and for
+                               the limbo list of released PCBs */
+  unsigned long retired;  /**< @brief The epoch stamp of a released PCB (see epoch_now) */
 
   CondVar child_exit;     /**< @brief Condition variable for @c WaitChild. 
 
@@ -75,6 +80,16 @@ typedef struct process_control_block {
 } PCB;
 
 void start_thread();
+
+/**
+  @brief Protects the process table.
+
+  This Mutex protects the PCB free list, and the process tree: the 
+  @c pstate, @c parent and @c exitval of each PCB, and its children 
+  and exited lists. Waiting on @c child_exit releases it.
+*/
+extern Mutex process_table_mutex;
+
 /**
   @brief Initialize the process table.
 
@@ -1,5 +1,6 @@
 
 #include <assert.h>
+#include <string.h>
 #include <sys/mman.h>
 
 #include "kernel_cc.h"
@@ -11,10 +12,18 @@
 #include <valgrind/valgrind.h>
 #endif
 
-#define queueNum 3 //Number of queues
 #define maxYieldCalls 69
 
-int yieldCalls = 0;
+/* 
+  Do not send quantum interrupts to idle cores, and to cores running
+  a single thread. Comment out to get a periodic tick on every core.
+*/
+#define SCHED_TICKLESS
+
+/*
+  Print the thread pool statistics at shutdown.
+*/
+//#define THREAD_POOL_STATISTICS
 
 /********************************************
 	
@@ -41,16 +50,30 @@ CCB cctx[MAX_CORES];
 #define CURTHREAD (CURCORE.current_thread)
 
 
+/* Not inlined, so that each call reads the core id of the current pthread */
+static __attribute__((noinline, noipa)) uint cur_core_id() 
+{ 
+  return cpu_core_id; 
+}
+
 /*
 	This can be used in the preemptive context to
 	obtain the current thread.
+
+	It does not turn preemption off, since that takes two system calls. 
+	If we are preempted while reading, we may resume on another core, 
+	and read the thread of that core. But then the core we started on 
+	has switched threads, so we retry.
  */
 TCB* cur_thread()
 {
-  int preempt = preempt_off;
-  TCB* cur = CURTHREAD;
-  if(preempt) preempt_on;
-  return cur;
+  for(;;) {
+    uint c = cur_core_id();
+    unsigned long sw = __atomic_load_n(&cctx[c].ctx_switches, __ATOMIC_ACQUIRE);
+    TCB* cur = __atomic_load_n(&cctx[c].current_thread, __ATOMIC_ACQUIRE);
+    if(cur_core_id() == c && __atomic_load_n(&cctx[c].ctx_switches, __ATOMIC_ACQUIRE) == sw)
+      return cur;
+  }
 }
 
 
@@ -65,6 +88,8 @@ TCB* cur_thread()
   +-------------+
   |   TCB       |
   +-------------+
+  | guard page  |
+  +-------------+
   |             |
   |    stack    |
   |             |
@@ -96,28 +121,48 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+/*
+  Thread memory is allocated with mmap by default. The stack is separated
+  from the TCB by a guard page, with access PROT_NONE, so that a stack
+  overflow is detected as a seg.fault instead of corrupting the TCB.
+  Since the mapping is committed lazily, a thread only consumes memory for
+  the part of its stack it has actually used.
 
-//#define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
+  Comment out to allocate threads with malloc (no guard page).
+ */
+#define MMAPPED_THREAD_MEM
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Measure the stack high-water mark of every thread when it is released
+  (with mincore), and report it. Pooled blocks are also trimmed back to
+  their pre-faulted pages. This costs a couple of system calls per thread.
  */
+//#define THREAD_STACK_STATISTICS
+
+#if defined(THREAD_STACK_STATISTICS) && !defined(MMAPPED_THREAD_MEM)
+#error "THREAD_STACK_STATISTICS requires MMAPPED_THREAD_MEM"
+#endif
+
+#ifdef MMAPPED_THREAD_MEM
+
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
+
 void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
 
 void* allocate_thread(size_t size)
 {
 	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
 
 	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+	CHECK(mprotect(ptr + THREAD_TCB_SIZE, THREAD_GUARD_SIZE, PROT_NONE));
 
 	return ptr;
 }
 #else
+
+#define THREAD_GUARD_SIZE 0
+
 /*
   Use malloc to allocate a thread. This is probably faster than  mmap, but
   cannot be made easily to 'detect' stack overflow.
@@ -132,7 +177,199 @@ void* allocate_thread(size_t size)
 }
 #endif
 
+/* The total size of a thread block, for a given stack size */
+#define THREAD_BLOCK_SIZE(stack_size) (THREAD_TCB_SIZE + THREAD_GUARD_SIZE + (stack_size))
+
+/* The stack segment of a thread */
+#define THREAD_STACK(tcb) (((void*)(tcb)) + THREAD_TCB_SIZE + THREAD_GUARD_SIZE)
+
+
+/*
+  The thread pool.
+  ----------------
+
+  Thread blocks (TCB + stack) of exited threads are not freed, but kept
+  for reuse by new threads. This saves both the allocator cost and the
+  page faults of touching a fresh stack.
+
+  Each core keeps a small cache of free blocks (up to THREAD_POOL_CORE_CACHE),
+  which is only accessed by the core itself in the non-preemptive domain,
+  and therefore needs no lock. Behind the core caches there is a global
+  depot, protected by a spinlock, which holds up to thread_pool_high_water
+  blocks. Blocks move between a core cache and the depot in batches of
+  half the core cache size.
+
+  A free block is linked through an rlnode placed at its start (where the
+  TCB would be).
+ */
+
+#define THREAD_POOL_BATCH (THREAD_POOL_CORE_CACHE/2)
+
+/* Bytes at the top of the stack which are pre-faulted in a fresh block */
+#define THREAD_POOL_PREFAULT (2 * SYSTEM_PAGE_SIZE)
+
+static Mutex thread_depot_spinlock = MUTEX_INIT;
+static rlnode thread_depot;
+static uint thread_depot_size = 0;
+static uint thread_pool_high_water = THREAD_POOL_HIGH_WATER;
+
+/* Allocate a fresh block and touch the pages a new thread will use first */
+static void* thread_block_fresh()
+{
+	void* ptr = allocate_thread(THREAD_BLOCK_SIZE(THREAD_STACK_SIZE));
+	memset(ptr, 0, THREAD_TCB_SIZE);
+	memset(ptr + THREAD_BLOCK_SIZE(THREAD_STACK_SIZE) - THREAD_POOL_PREFAULT, 0, THREAD_POOL_PREFAULT);
+	return ptr;
+}
+
+static inline void thread_block_push(rlnode* list, void* ptr)
+{
+	rlnode* node = (rlnode*) ptr;
+	rlnode_init(node, ptr);
+	rlist_push_front(list, node);
+}
+
+/* Free every block of a list */
+static uint thread_block_free_list(rlnode* list)
+{
+	uint count = 0;
+	while(! is_rlist_empty(list)) {
+		free_thread(rlist_pop_front(list)->obj, THREAD_BLOCK_SIZE(THREAD_STACK_SIZE));
+		count++;
+	}
+	return count;
+}
+
+#ifdef THREAD_STACK_STATISTICS
+/*
+  Return the stack high-water mark of a thread, i.e., the distance from the
+  top of the stack to the deepest page that has been touched.
+ */
+static size_t thread_stack_usage(TCB* tcb)
+{
+	void* stack = THREAD_STACK(tcb);
+	size_t npages = tcb->stack_size / SYSTEM_PAGE_SIZE;
+	unsigned char vec[256];
+
+	for(size_t p = 0; p < npages; p += sizeof(vec)) {
+		size_t n = (npages - p < sizeof(vec)) ? npages - p : sizeof(vec);
+		CHECK(mincore(stack + p*SYSTEM_PAGE_SIZE, n*SYSTEM_PAGE_SIZE, vec));
+		for(size_t i = 0; i < n; i++)
+			if(vec[i] & 1)
+				return tcb->stack_size - (p+i)*SYSTEM_PAGE_SIZE;
+	}
+	return 0;
+}
+#endif
+
+/*
+  Get a block for a new thread. This must be called in the
+  non-preemptive domain; it returns NULL if the pool is empty.
+ */
+static void* thread_pool_get(CCB* core)
+{
+	core->pool_stats.allocs++;
+
+	if(core->thread_cache_size == 0) {
+		/* Refill the core cache from the depot */
+		Mutex_Lock(&thread_depot_spinlock);
+		while(thread_depot_size > 0 && core->thread_cache_size < THREAD_POOL_BATCH) {
+			rlist_push_front(&core->thread_cache, rlist_pop_front(&thread_depot));
+			thread_depot_size--;
+			core->thread_cache_size++;
+		}
+		Mutex_Unlock(&thread_depot_spinlock);
+
+		if(core->thread_cache_size == 0) return NULL;
+		core->pool_stats.depot_hits++;
+	}
+	else
+		core->pool_stats.core_hits++;
+
+	core->thread_cache_size--;
+	return rlist_pop_front(&core->thread_cache)->obj;
+}
+
+/*
+  Return the block of an exited thread to the pool. This must be called
+  in the non-preemptive domain.
+ */
+static void thread_pool_put(CCB* core, void* ptr, size_t stack_usage)
+{
+	core->pool_stats.releases++;
+
+#ifdef THREAD_STACK_STATISTICS
+	/* Give back the stack pages below the pre-faulted area */
+	if(stack_usage > THREAD_POOL_PREFAULT)
+		CHECK(madvise(THREAD_STACK(ptr), THREAD_STACK_SIZE - THREAD_POOL_PREFAULT, MADV_DONTNEED));
+#endif
+
+	thread_block_push(&core->thread_cache, ptr);
+	if(++core->thread_cache_size <= THREAD_POOL_CORE_CACHE) return;
+
+	/* Spill a batch to the depot, freeing whatever does not fit */
+	rlnode excess;
+	rlnode_init(&excess, NULL);
+
+	Mutex_Lock(&thread_depot_spinlock);
+	for(int i = 0; i < THREAD_POOL_BATCH; i++) {
+		rlnode* node = rlist_pop_front(&core->thread_cache);
+		if(thread_depot_size < thread_pool_high_water) {
+			rlist_push_front(&thread_depot, node);
+			thread_depot_size++;
+		}
+		else
+			rlist_push_front(&excess, node);
+	}
+	Mutex_Unlock(&thread_depot_spinlock);
+	core->thread_cache_size -= THREAD_POOL_BATCH;
+
+	core->pool_stats.frees += thread_block_free_list(&excess);
+}
+
+uint set_thread_pool_high_water(uint hw)
+{
+	rlnode excess;
+	rlnode_init(&excess, NULL);
+
+	int preempt = preempt_off;
+	Mutex_Lock(&thread_depot_spinlock);
+	uint old = thread_pool_high_water;
+	thread_pool_high_water = hw;
+	while(thread_depot_size > hw) {
+		rlist_push_front(&excess, rlist_pop_front(&thread_depot));
+		thread_depot_size--;
+	}
+	Mutex_Unlock(&thread_depot_spinlock);
+	CURCORE.pool_stats.frees += thread_block_free_list(&excess);
+	if(preempt) preempt_on;
+
+	return old;
+}
+
+void get_thread_pool_stats(thread_pool_stats* stats)
+{
+	*stats = (thread_pool_stats){ 0 };
+	for(uint c = 0; c < MAX_CORES; c++) {
+		thread_pool_stats* cs = &cctx[c].pool_stats;
+		stats->allocs += cs->allocs;
+		stats->core_hits += cs->core_hits;
+		stats->depot_hits += cs->depot_hits;
+		stats->releases += cs->releases;
+		stats->frees += cs->frees;
+		if(cs->stack_high_water > stats->stack_high_water)
+			stats->stack_high_water = cs->stack_high_water;
+	}
+}
+
 
+unsigned long get_context_switches()
+{
+	unsigned long switches = 0;
+	for(uint c = 0; c < MAX_CORES; c++)
+		switches += cctx[c].ctx_switches;
+	return switches;
+}
 
 
 /*
@@ -154,10 +391,24 @@ static void thread_start()
   Initialize and return a new TCB
 */
 
-TCB* spawn_thread(PCB* pcb, void (*func)())
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size)
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	if(stack_size > THREAD_STACK_MAX) return NULL;
+	if(stack_size == 0) stack_size = THREAD_STACK_SIZE;
+	if(stack_size < THREAD_STACK_MIN) stack_size = THREAD_STACK_MIN;
+	stack_size = ((stack_size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE;
+
+	TCB* tcb;
+	if(stack_size == THREAD_STACK_SIZE) {
+		/* Take a block from the pool, or allocate a fresh one */
+		int preempt = preempt_off;
+		tcb = (TCB*)thread_pool_get(&CURCORE);
+		if(preempt) preempt_on;
+		if(tcb == NULL)
+			tcb = (TCB*)thread_block_fresh();
+	}
+	else
+		tcb = (TCB*)allocate_thread(THREAD_BLOCK_SIZE(stack_size));
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
@@ -166,6 +417,7 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->type = NORMAL_THREAD;
 	tcb->state = INIT;
 	tcb->phase = CTX_CLEAN;
+	tcb->state_spinlock = SPINLOCK_INIT;
 	tcb->thread_func = func;
 	tcb->wakeup_time = NO_TIMEOUT;
 	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
@@ -176,15 +428,24 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->curr_cause = SCHED_IDLE;
 
 	tcb->priority = queueNum-1;
+	tcb->pi_saved = -1;
+	tcb->pi_mutex = NULL;
+	tcb->mlfq_core = NULL;
+#ifdef MUTEX_PROFILE
+	tcb->mutex_held = 0;
+#endif
+	tcb->vruntime = 0;
+	tcb->dl_runtime = tcb->dl_period = 0;
 
 	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	void* sp = THREAD_STACK(tcb);
+	tcb->stack_size = stack_size;
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + stack_size);
 #endif
 
 	/* increase the count of active threads */
@@ -196,7 +457,8 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 }
 
 /*
-  This is called with sched_spinlock locked !
+  This is called by the scheduler (in the non-preemptive domain),
+  once the thread has exited and its context is clean.
  */
 void release_TCB(TCB* tcb)
 {
@@ -204,7 +466,21 @@ void release_TCB(TCB* tcb)
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	CCB* curcore = &CURCORE;
+	size_t stack_usage = 0;
+
+#ifdef THREAD_STACK_STATISTICS
+	stack_usage = thread_stack_usage(tcb);
+	if(stack_usage > curcore->pool_stats.stack_high_water)
+		curcore->pool_stats.stack_high_water = stack_usage;
+	fprintf(stderr, "Thread %p: stack high-water mark %zu of %zu bytes\n",
+		tcb, stack_usage, tcb->stack_size);
+#endif
+
+	if(tcb->stack_size == THREAD_STACK_SIZE)
+		thread_pool_put(curcore, tcb, stack_usage);
+	else
+		free_thread(tcb, THREAD_BLOCK_SIZE(tcb->stack_size));
 
 	Mutex_Lock(&active_threads_spinlock);
 	active_threads--;
@@ -222,254 +498,360 @@ void release_TCB(TCB* tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
-
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
-
-  Both of these structures are protected by @c sched_spinlock.
+  Every core has its own scheduler queue, managed by the scheduler
+  policy, stored in its CCB and protected by the core's @c sched_spinlock.
+  A ready thread is added to the queues of the core chosen by
+  sched_target_core: usually the adding core, but possibly an idle core,
+  or a core whose current thread it outranks. The adding core then takes 
+  the @c sched_spinlock of the target core, and restarts or interrupts 
+  it. When its queues are empty, a core steals a thread from the queues 
+  of the most loaded core.
+
+  The state of each thread is protected by its own @c state_spinlock.
+
+  Also, the scheduler contains a timing wheel of all the sleeping
+  threads with a timeout, protected by @c timeout_spinlock.
+
+  The locking order is: a thread's state_spinlock, then timeout_spinlock,
+  then a core's sched_spinlock.
 */
 
-rlnode SCHED[queueNum]; /* The scheduler queue */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
-
-/* Interrupt handler for ALARM */
-void yield_handler() { yield(SCHED_QUANTUM); }
-
-/* Interrupt handle for inter-core interrupts */
-void ici_handler()
-{ /* noop for now... */
-}
+Spinlock timeout_spinlock = SPINLOCK_INIT; /* spinlock for the timeout wheel */
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Scheduler tracing.
+  ------------------
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
-{
-	if (timeout != NO_TIMEOUT) {
-		/* set the wakeup time */
-		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+  When tracing is enabled (see set_sched_trace), every core records its
+  scheduler events in its own trace ring. A ring is only written by its
+  core, in the non-preemptive domain, so no locking is needed. When a ring
+  is full, the oldest events are overwritten. The rings are written to the
+  trace file by finalize_scheduler, after all cores have stopped.
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
-	}
-}
+  When tracing is disabled, the cost of SCHED_TRACE is a predictable branch.
+*/
+static const char* sched_trace_file = NULL;
+static int sched_trace_on = 0;
 
-/*
-  Add TCB to the end of the scheduler list.
+#define SCHED_TRACE_MASK (SCHED_TRACE_SIZE - 1)
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static void sched_queue_add(TCB* tcb)
+static void sched_trace_record(CCB* core, enum SCHED_TRACE_EVENT type, TCB* tcb, int arg)
 {
-	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
-
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+	sched_trace_event* ev = &core->trace[core->trace_count++ & SCHED_TRACE_MASK];
+	ev->time = bios_clock();
+	ev->tid = (tcb == NULL) ? 0 : (Tid_t) tcb->ptcb;
+	ev->pid = (tcb == NULL) ? 0 : get_pid(tcb->owner_pcb);
+	ev->type = type;
+	ev->arg = arg;
 }
 
-/*
-	Adjust the state of a thread to make it READY.
+#define SCHED_TRACE(core, type, tcb, arg) \
+	do { if (__builtin_expect(sched_trace_on, 0)) \
+		sched_trace_record((core), (type), (tcb), (arg)); } while (0)
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
- */
-static void sched_make_ready(TCB* tcb)
+void set_sched_trace(const char* filename)
 {
-	assert(tcb->state == STOPPED || tcb->state == INIT);
+	sched_trace_file = filename;
+}
 
-	/* Possibly remove from TIMEOUT_LIST */
-	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
-		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
-		tcb->wakeup_time = NO_TIMEOUT;
+static void sched_trace_start()
+{
+	if (sched_trace_file == NULL)
+		return;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		cctx[c].trace = xmalloc(SCHED_TRACE_SIZE * sizeof(sched_trace_event));
+		cctx[c].trace_count = 0;
 	}
+	sched_trace_on = 1;
+}
 
-	/* Mark as ready */
-	tcb->state = READY;
+static const char* const sched_cause_names[] = {
+	"quantum", "io", "mutex", "pipe", "poll", "idle", "user", "preempt"
+};
 
-	/* Possibly add to the scheduler queue */
-	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
-}
+static const char* const sched_trace_names[] = {
+	"switch", "wakeup", "timeout", "sleep", "priority", "boost", "throttle"
+};
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
-
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  Write the trace rings in the Chrome trace format. Each core is a track;
+  the time a thread ran is a complete ('X') event, from the switch that
+  brought it in to the next switch. All other events are instant events.
 */
-static void sched_wakeup_expired_timeouts()
+static void sched_trace_write(FILE* f)
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
+	fprintf(f, "{\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"TinyOS\"}}");
+
+	for (uint c = 0; c < cpu_cores(); c++) {
+		CCB* core = &cctx[c];
+		fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,"
+			"\"args\":{\"name\":\"core %u\"}}", c, c);
+
+		unsigned long first = (core->trace_count > SCHED_TRACE_SIZE) ?
+			core->trace_count - SCHED_TRACE_SIZE : 0;
+		sched_trace_event* running = NULL;
+
+		for (unsigned long i = first; i < core->trace_count; i++) {
+			sched_trace_event* ev = &core->trace[i & SCHED_TRACE_MASK];
+
+			if (ev->type == TRACE_SWITCH) {
+				if (running != NULL && running->tid != 0)
+					fprintf(f, ",\n{\"name\":\"pid %d thread %#lx\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,"
+						"\"ts\":%lu,\"dur\":%lu,\"args\":{\"cause\":\"%s\"}}",
+						running->pid, (unsigned long) running->tid, c,
+						(unsigned long) running->time, (unsigned long) (ev->time - running->time),
+						sched_cause_names[ev->arg]);
+				running = ev;
+				continue;
+			}
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
-		sched_make_ready(tcb);
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":0,\"tid\":%u,"
+				"\"ts\":%lu,\"args\":{\"pid\":%d,\"thread\":\"%#lx\"",
+				sched_trace_names[ev->type], c, (unsigned long) ev->time,
+				ev->pid, (unsigned long) ev->tid);
+			if (ev->type == TRACE_SLEEP)
+				fprintf(f, ",\"cause\":\"%s\"", sched_cause_names[ev->arg]);
+			else if (ev->type == TRACE_PRIORITY)
+				fprintf(f, ",\"priority\":%d", ev->arg);
+			fprintf(f, "}}");
+		}
 	}
-}
 
-/*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+	fprintf(f, "\n]}\n");
+}
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static TCB* sched_queue_select(TCB* current)
+static void sched_trace_stop()
 {
-
-	int selectNextThread = queueNum-1;
-
-	for(int i = queueNum-1; i >= 0; i--){
-		
-		if(!is_rlist_empty(&SCHED[i])){
-			selectNextThread = i;
-			break;
-		}
+	if (!sched_trace_on)
+		return;
+	sched_trace_on = 0;
+
+	FILE* f = fopen(sched_trace_file, "w");
+	if (f == NULL)
+		fprintf(stderr, "Cannot write the scheduler trace to %s\n", sched_trace_file);
+	else {
+		sched_trace_write(f);
+		fclose(f);
 	}
-	
 
-	/* Get the head of the SCHED list */
-	rlnode* sel = rlist_pop_front(&SCHED[selectNextThread]);
+	for (uint c = 0; c < cpu_cores(); c++) {
+		free(cctx[c].trace);
+		cctx[c].trace = NULL;
+	}
+}
 
-	TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
 
-	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
 
-	next_thread->its = QUANTUM;
+/* Interrupt handler for ALARM */
+void yield_handler() { yield(CURCORE.preempt_pending ? SCHED_PREEMPT : SCHED_QUANTUM); }
 
-	return next_thread;
-}
+/* Interrupt handler for inter-core interrupts: a thread that outranks ours was queued */
+void ici_handler() { yield(SCHED_PREEMPT); }
 
 /*
-  Make the process ready.
- */
-int wakeup(TCB* tcb)
-{
-	int ret = 0;
+  The timeout wheel.
+  ------------------
 
-	/* Preemption off */
-	int oldpre = preempt_off;
+  Sleeping threads with a timeout are kept in a hierarchical timing wheel,
+  so that adding and cancelling a timeout take O(1) time, regardless of 
+  the number of sleeping threads.
 
-	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+  Time is counted in ticks of TW_TICK microseconds. Level 0 of the wheel has 
+  one slot per tick, for the next TW_SIZE ticks. A slot of level l covers
+  TW_SIZE^l ticks; when the wheel reaches it, its threads are cascaded to the
+  lower levels. A timeout beyond the range of the top level is put in its 
+  furthest slot, and cascaded again later.
 
-	if (tcb->state == STOPPED || tcb->state == INIT) {
-		sched_make_ready(tcb);
-		ret = 1;
-	}
+  Threads whose timeout has expired are moved to the 'expired' list, from
+  which they are made ready.
 
-	Mutex_Unlock(&sched_spinlock);
+  A thread in the wheel is linked by its sched_node, and has a wakeup_time
+  other than NO_TIMEOUT.
+*/
+#define TW_TICK 1000
+#define TW_BITS 6
+#define TW_SIZE (1 << TW_BITS)
+#define TW_MASK (TW_SIZE - 1)
+#define TW_LEVELS 4
+
+static struct {
+	TimerDuration now; /* The last tick processed */
+	volatile uint count; /* Number of threads in the wheel, including expired ones */
+	rlnode slot[TW_LEVELS][TW_SIZE];
+	rlnode expired;
+} TIMEOUT_WHEEL;
 
-	/* Restore preemption state */
-	if (oldpre)
-		preempt_on;
+/*
+  Put a thread in the proper slot of the wheel.
 
-	return ret;
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void timeout_wheel_insert(TCB* tcb)
+{
+	/* Round up, so that we never wake up early */
+	TimerDuration expires = (tcb->wakeup_time + TW_TICK - 1) / TW_TICK;
+	rlnode* list;
+
+	if (expires <= TIMEOUT_WHEEL.now) {
+		list = &TIMEOUT_WHEEL.expired;
+	} else {
+		TimerDuration delta = expires - TIMEOUT_WHEEL.now;
+		int l = 0;
+		while (l < TW_LEVELS - 1 && delta >= (1ull << (TW_BITS * (l + 1))))
+			l++;
+		if (delta >= (1ull << (TW_BITS * TW_LEVELS)))
+			expires = TIMEOUT_WHEEL.now + (1ull << (TW_BITS * TW_LEVELS)) - 1;
+		list = &TIMEOUT_WHEEL.slot[l][(expires >> (TW_BITS * l)) & TW_MASK];
+	}
+
+	rlist_push_back(list, &tcb->sched_node);
 }
 
 /*
-  Atomically put the current process to sleep, after unlocking mx.
- */
-void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
-	TimerDuration timeout)
-{
-	assert(state == STOPPED || state == EXITED);
+  Re-insert the threads of the current slot of level l (and, if needed,
+  of the levels above it) to the lower levels.
 
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void timeout_wheel_cascade(int l)
+{
+	int idx = (TIMEOUT_WHEEL.now >> (TW_BITS * l)) & TW_MASK;
 
-	int preempt = preempt_off;
-	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
-
-	/* mark the thread as stopped or exited */
-	tcb->state = state;
+	/* The upper level must go first, it may add to our slot */
+	if (idx == 0 && l + 1 < TW_LEVELS)
+		timeout_wheel_cascade(l + 1);
 
-	/* register the timeout (if any) for the sleeping thread */
-	if (state != EXITED)
-		sched_register_timeout(tcb, timeout);
+	rlnode list;
+	rlnode_init(&list, NULL);
+	rlist_append(&list, &TIMEOUT_WHEEL.slot[l][idx]);
+	while (!is_rlist_empty(&list))
+		timeout_wheel_insert(rlist_pop_front(&list)->tcb);
+}
 
-	/* Release mx */
-	if (mx != NULL)
-		Mutex_Unlock(mx);
+/*
+  Advance the wheel up to the given tick, moving expired threads to
+  the 'expired' list.
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void timeout_wheel_advance(TimerDuration tick)
+{
+	while (TIMEOUT_WHEEL.now < tick) {
+		TIMEOUT_WHEEL.now++;
+		int idx = TIMEOUT_WHEEL.now & TW_MASK;
+		if (idx == 0)
+			timeout_wheel_cascade(1);
+		rlist_append(&TIMEOUT_WHEEL.expired, &TIMEOUT_WHEEL.slot[0][idx]);
+	}
+}
 
-	/* call this to schedule someone else */
-	yield(cause);
+/*
+  Remove a thread from the wheel.
 
-	/* Restore preemption state */
-	if (preempt)
-		preempt_on;
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static void timeout_wheel_remove(TCB* tcb)
+{
+	rlist_remove(&tcb->sched_node);
+	tcb->wakeup_time = NO_TIMEOUT;
+	TIMEOUT_WHEEL.count--;
 }
 
-/* This function is the entry point to the scheduler's context switching */
+/*
+  Return the time of the next event of the wheel, or NO_TIMEOUT if the
+  wheel is empty. This is exact for level 0; for the upper levels, it 
+  is the time of the next cascade, which is a lower bound.
 
-void yield(enum SCHED_CAUSE cause)
+  *** MUST BE CALLED WITH timeout_spinlock HELD ***
+*/
+static TimerDuration timeout_wheel_next()
 {
+	if (TIMEOUT_WHEEL.count == 0)
+		return NO_TIMEOUT;
+	if (!is_rlist_empty(&TIMEOUT_WHEEL.expired))
+		return TIMEOUT_WHEEL.now * TW_TICK;
+
+	TimerDuration next = NO_TIMEOUT;
+	for (int l = 0; l < TW_LEVELS; l++) {
+		TimerDuration base = TIMEOUT_WHEEL.now >> (TW_BITS * l);
+		for (int k = 1; k <= TW_SIZE; k++) {
+			if (!is_rlist_empty(&TIMEOUT_WHEEL.slot[l][(base + k) & TW_MASK])) {
+				TimerDuration t = ((base + k) << (TW_BITS * l)) * TW_TICK;
+				if (t < next)
+					next = t;
+				break;
+			}
+		}
+	}
+	return next;
+}
 
-	yieldCalls++; //Increase yield counter every time yield is called
-
-	/* Reset the timer, so that we are not interrupted by ALARM */
-	TimerDuration remaining = bios_cancel_timer();
+static void initialize_timeout_wheel()
+{
+	TIMEOUT_WHEEL.now = bios_clock() / TW_TICK;
+	TIMEOUT_WHEEL.count = 0;
+	for (int l = 0; l < TW_LEVELS; l++)
+		for (int i = 0; i < TW_SIZE; i++)
+			rlnode_init(&TIMEOUT_WHEEL.slot[l][i], NULL);
+	rlnode_init(&TIMEOUT_WHEEL.expired, NULL);
+}
 
-	/* We must stop preemption but save it! */
-	int preempt = preempt_off;
+/*
+  Scheduler policies.
+  -------------------
 
-	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
+  The ready queue of each core is managed by the scheduler policy, through
+  the methods of a sched_policy (see kernel_sched.h). 
+*/
 
-	Mutex_Lock(&sched_spinlock);
 
-	/*Priority Boost*/
-	if(yieldCalls == maxYieldCalls){	//If we reach max number of yield calls
-
-		yieldCalls = 0;	//Reset counter
-		
-		for(int i = 0; i < queueNum-1; i++){
-		
-			if(!is_rlist_empty(&SCHED[i])){	//Check if queue is empty
-
-				/*Increase priority of each thread in queue*/
-				for(int j=0; j < rlist_len((&SCHED[i]));j++){	
-					
-					TCB* tcb = rlist_pop_front(&SCHED[i])->tcb; //Remove the head of the queue
-					tcb->priority++; //Increase priority
-					rlist_push_back(&SCHED[i+1], &tcb->sched_node); //Put it at the back of the next queue
-				}
+/*
+  The multi-level feedback queue (MLFQ) policy.
 
-			}
-		}
+  There is one queue per priority level. A thread loses a level when its
+  quantum expires (or when it keeps yielding on a contended mutex), and
+  gains one when it sleeps for I/O. Every maxYieldCalls calls to yield(),
+  all the queued threads of the core are boosted by one level.
+*/
 
-	}
+static void mlfq_init(CCB* core)
+{
+	for(int i = 0; i < queueNum; i++)	//Init every queue
+		rlnode_init(&core->sched_queue[i], NULL);
+	core->sched_bitmap = 0;
+	core->yield_calls = 0;
+}
 
-	/* Update CURTHREAD state */
-	if (current->state == RUNNING)
-		current->state = READY;
+/* Insert at the end of the queue of the thread's priority */
+static void mlfq_enqueue(CCB* core, TCB* tcb)
+{
+	rlist_push_back(&core->sched_queue[tcb->priority], &tcb->sched_node);
+	core->sched_bitmap |= 1u << tcb->priority;
+	tcb->mlfq_core = core;
+}
 
-	/* Update CURTHREAD scheduler data */
-	current->rts = remaining;
-	current->last_cause = current->curr_cause;
-	current->curr_cause = cause;
+/*
+  Remove the head of the highest-priority non-empty queue.
 
-	/* Wake up threads whose sleep timeout has expired */
-	sched_wakeup_expired_timeouts();
+  The non-empty queues are marked in the core's sched_bitmap, so the
+  highest one is found in O(1). The priority of a queued thread is
+  only fixed here, when it leaves the queue (see mlfq_priority_boost).
+*/
+static TCB* mlfq_pick_next(CCB* core)
+{
+	int level = 31 - __builtin_clz(core->sched_bitmap);
+	TCB* tcb = rlist_pop_front(&core->sched_queue[level])->tcb;
+	if (is_rlist_empty(&core->sched_queue[level]))
+		core->sched_bitmap &= ~(1u << level);
+	tcb->mlfq_core = NULL;
+	tcb->priority = level;
+	tcb->its = QUANTUM;
+	return tcb;
+}
 
+static void mlfq_on_yield(CCB* core, TCB* current, enum SCHED_CAUSE cause, TimerDuration runtime)
+{
 	switch(cause){
 
 	/*Thread quantum has expired*/
@@ -505,28 +887,977 @@ void yield(enum SCHED_CAUSE cause)
 		break;
 
 	}
+}
 
-	/* Get next */
-	TCB* next = sched_queue_select(current);
-	assert(next != NULL);
+/*
+  Raise each thread of this core's queues by one priority level.
 
-	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
+  Each queue is spliced in one step at the end of the queue above it,
+  starting from the top, so that every thread moves up exactly once.
+  The priority field of the moved threads is not touched; it is
+  derived from their queue in mlfq_pick_next().
+*/
+static void mlfq_priority_boost(CCB* core)
+{
+	const uint top = 1u << (queueNum - 1);
 
-	Mutex_Unlock(&sched_spinlock);
+	Spinlock_Lock(&core->sched_spinlock);
 
-	/* Switch contexts */
-	if (current != next) {
-		CURTHREAD = next;
-		cpu_swap_context(&current->context, &next->context);
-	}
+	for (int i = queueNum - 2; i >= 0; i--)
+		rlist_append(&core->sched_queue[i + 1], &core->sched_queue[i]);
+	core->sched_bitmap = ((core->sched_bitmap << 1) | (core->sched_bitmap & top)) & (2 * top - 1);
 
-	/* This is where we get after we are switched back on! A long time
-	   may have passed. Start a new timeslice...
-	  */
+	Spinlock_Unlock(&core->sched_spinlock);
+}
+
+/*
+  Raise a thread to a priority level lent by a thread blocked on it
+  (see sched_inherit_priority).
+
+  A queued thread is moved to the end of the queue of the new level,
+  unless its queue is already as high (the priority of a queued thread
+  may be stale). Its queue is found by walking to the list head, which
+  is the only node without a TCB.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void mlfq_inherit(TCB* tcb, int priority)
+{
+	if (tcb->pi_saved < 0)
+		tcb->pi_saved = tcb->priority;
+	tcb->priority = priority;
+
+	CCB* core = tcb->mlfq_core;
+	if (core == NULL)
+		return;
+
+	Spinlock_Lock(&core->sched_spinlock);
+	if (tcb->mlfq_core == core) {
+		rlnode* head = tcb->sched_node.next;
+		while (head->tcb != NULL)
+			head = head->next;
+		int level = head - core->sched_queue;
+		if (level < priority) {
+			rlist_remove(&tcb->sched_node);
+			if (is_rlist_empty(head))
+				core->sched_bitmap &= ~(1u << level);
+			mlfq_enqueue(core, tcb);
+		}
+	}
+	Spinlock_Unlock(&core->sched_spinlock);
+}
+
+static void mlfq_on_tick(CCB* core)
+{
+	/*Priority Boost*/
+	if(++core->yield_calls == maxYieldCalls){	//If we reach max number of yield calls
+		core->yield_calls = 0;	//Reset counter
+		mlfq_priority_boost(core);
+		SCHED_TRACE(core, TRACE_BOOST, NULL, 0);
+	}
+}
+
+static const sched_policy mlfq_policy = {
+	.name = "mlfq",
+	.init = mlfq_init,
+	.enqueue = mlfq_enqueue,
+	.pick_next = mlfq_pick_next,
+	.on_yield = mlfq_on_yield,
+	.on_tick = mlfq_on_tick
+};
+
+
+/*
+  The fair-share policy.
+
+  Each thread is charged for the time it runs, in its vruntime, and the 
+  thread with the smallest vruntime runs next. The ready threads of a core
+  are kept in a pairing heap, ordered by vruntime, linked through the 
+  fair_child and fair_sibling fields of the TCB.
+
+  The timeslice is FAIR_LATENCY shared among the ready threads of the core,
+  but no less than FAIR_MIN_SLICE.
+
+  A thread which was asleep (or ran on another core) is placed within a
+  window around the core's min_vruntime. Thus, a sleeper gets at most
+  FAIR_LATENCY/2 of credit, and a migrated thread is neither starved nor
+  favored by the different clock of its previous core.
+*/
+#define FAIR_LATENCY (2*QUANTUM)
+#define FAIR_MIN_SLICE (QUANTUM/4)
+
+/* Meld two heaps, whose roots have no siblings */
+static TCB* fair_meld(TCB* a, TCB* b)
+{
+	if (a == NULL) return b;
+	if (b == NULL) return a;
+	if (b->vruntime < a->vruntime) {
+		TCB* t = a; a = b; b = t;
+	}
+	b->fair_sibling = a->fair_child;
+	a->fair_child = b;
+	return a;
+}
+
+static void fair_init(CCB* core)
+{
+	core->fair_heap = NULL;
+	core->min_vruntime = 0;
+}
+
+static void fair_enqueue(CCB* core, TCB* tcb)
+{
+	if (tcb->vruntime + FAIR_LATENCY/2 < core->min_vruntime)
+		tcb->vruntime = core->min_vruntime - FAIR_LATENCY/2;
+	else if (tcb->vruntime > core->min_vruntime + FAIR_LATENCY)
+		tcb->vruntime = core->min_vruntime + FAIR_LATENCY;
+
+	tcb->fair_child = tcb->fair_sibling = NULL;
+	core->fair_heap = fair_meld(core->fair_heap, tcb);
+}
+
+/* Pop the root, and meld its children in two passes (pairwise, then right to left) */
+static TCB* fair_pick_next(CCB* core)
+{
+	TCB* tcb = core->fair_heap;
+
+	TCB* pairs = NULL;
+	TCB* c = tcb->fair_child;
+	while (c != NULL) {
+		TCB* a = c;
+		TCB* b = a->fair_sibling;
+		c = (b != NULL) ? b->fair_sibling : NULL;
+		a->fair_sibling = NULL;
+		if (b != NULL) b->fair_sibling = NULL;
+		TCB* m = fair_meld(a, b);
+		m->fair_sibling = pairs;
+		pairs = m;
+	}
+
+	TCB* heap = NULL;
+	while (pairs != NULL) {
+		TCB* next = pairs->fair_sibling;
+		pairs->fair_sibling = NULL;
+		heap = fair_meld(heap, pairs);
+		pairs = next;
+	}
+	core->fair_heap = heap;
+
+	if (tcb->vruntime > core->min_vruntime)
+		core->min_vruntime = tcb->vruntime;
+
+	TimerDuration slice = FAIR_LATENCY / core->sched_load;
+	tcb->its = (slice < FAIR_MIN_SLICE) ? FAIR_MIN_SLICE : slice;
+	return tcb;
+}
+
+/* Charge the current thread with the time it ran */
+static void fair_on_yield(CCB* core, TCB* current, enum SCHED_CAUSE cause, TimerDuration runtime)
+{
+	if (current->type != IDLE_THREAD)
+		current->vruntime += runtime;
+}
+
+static void fair_on_tick(CCB* core) { }
+
+static const sched_policy fair_policy = {
+	.name = "fair",
+	.init = fair_init,
+	.enqueue = fair_enqueue,
+	.pick_next = fair_pick_next,
+	.on_yield = fair_on_yield,
+	.on_tick = fair_on_tick
+};
+
+
+/* The available policies */
+static const sched_policy* sched_policies[] = { &mlfq_policy, &fair_policy, NULL };
+
+/* The policy in effect */
+static const sched_policy* SCHED_POLICY = &mlfq_policy;
+
+int set_sched_policy(const char* name)
+{
+	for (const sched_policy** p = sched_policies; *p != NULL; p++)
+		if (strcmp((*p)->name, name) == 0) {
+			SCHED_POLICY = *p;
+			return 0;
+		}
+	return -1;
+}
+
+
+/*
+  Possibly add TCB to the scheduler timeout wheel.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
+{
+	if (timeout != NO_TIMEOUT) {
+		Spinlock_Lock(&timeout_spinlock);
+
+		/* set the wakeup time */
+		TimerDuration curtime = bios_clock();
+		tcb->wakeup_time = curtime + timeout;
+
+		/* An empty wheel may be far behind; bring it to the present */
+		if (TIMEOUT_WHEEL.count++ == 0 && TIMEOUT_WHEEL.now < curtime / TW_TICK)
+			TIMEOUT_WHEEL.now = curtime / TW_TICK;
+
+		timeout_wheel_insert(tcb);
+
+		Spinlock_Unlock(&timeout_spinlock);
+	}
+}
+
+/*
+  The deadline class.
+  -------------------
+
+  Deadline threads (those with a dl_runtime) are kept in a separate queue
+  of each core, sorted by deadline, and are always selected ahead of the
+  threads of the policy. This is a constant bandwidth server: a deadline
+  thread is charged for the time it runs, and when its budget is exhausted
+  it is throttled (put to sleep in the timeout wheel) until its deadline,
+  where it gets a new period. The timeslice of a deadline thread never 
+  exceeds its budget, so the core timer enforces it.
+
+  Admission control keeps the sum of the bandwidths (runtime/period, in
+  1/1024 of a core) of all deadline threads within DL_MAX_BANDWIDTH per
+  core. It is protected by dl_spinlock, which is locked before the 
+  state_spinlock of a thread.
+*/
+static Spinlock dl_spinlock = SPINLOCK_INIT;
+static uint dl_bandwidth = 0;
+
+/* The bandwidth of a deadline thread, rounded up */
+static uint dl_bw(TimerDuration runtime, TimerDuration period)
+{
+	return (runtime == 0) ? 0 : (runtime * 1024 + period - 1) / period;
+}
+
+/* The timeslice of a deadline thread */
+static TimerDuration dl_slice(TCB* tcb)
+{
+	return (tcb->dl_budget < QUANTUM) ? tcb->dl_budget : QUANTUM;
+}
+
+/*
+  Start a new period for a deadline thread which wakes up, if its 
+  deadline has passed, or if the rest of its budget would exceed its
+  bandwidth until the deadline.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void dl_wakeup(TCB* tcb)
+{
+	TimerDuration now = bios_clock();
+	if (tcb->dl_deadline <= now ||
+	    tcb->dl_budget * tcb->dl_period > tcb->dl_runtime * (tcb->dl_deadline - now)) {
+		tcb->dl_deadline = now + tcb->dl_period;
+		tcb->dl_budget = tcb->dl_runtime;
+	}
+}
+
+/*
+  Charge a deadline thread with the time it ran. If its budget is 
+  exhausted, a ready thread is throttled until its deadline; a thread 
+  that is going to sleep anyway gets a new period, after its deadline.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void dl_charge(TCB* tcb, TimerDuration runtime, TimerDuration now)
+{
+	tcb->dl_budget -= (runtime < tcb->dl_budget) ? runtime : tcb->dl_budget;
+	if (tcb->dl_budget > 0)
+		return;
+
+	if (tcb->state == READY && tcb->dl_deadline > now) {
+		SCHED_TRACE(&CURCORE, TRACE_THROTTLE, tcb, 0);
+		tcb->state = STOPPED;
+		sched_register_timeout(tcb, tcb->dl_deadline - now);
+	} else {
+		tcb->dl_deadline = ((tcb->dl_deadline > now) ? tcb->dl_deadline : now) + tcb->dl_period;
+		tcb->dl_budget = tcb->dl_runtime;
+	}
+}
+
+/*
+  Insert a deadline thread into the queue of a core, after all threads
+  with an earlier (or equal) deadline. A thread that overran its 
+  deadline gets a new period.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static void dl_enqueue(CCB* core, TCB* tcb)
+{
+	TimerDuration now = bios_clock();
+	if (tcb->dl_deadline <= now) {
+		tcb->dl_deadline = now + tcb->dl_period;
+		tcb->dl_budget = tcb->dl_runtime;
+	}
+
+	rlnode* pos = core->dl_queue.prev;
+	while (pos != &core->dl_queue && pos->tcb->dl_deadline > tcb->dl_deadline)
+		pos = pos->prev;
+	rlist_push_front(pos, &tcb->sched_node);
+}
+
+/*
+  Remove the deadline thread with the earliest deadline.
+
+  *** MUST BE CALLED WITH core->sched_spinlock HELD ***
+*/
+static TCB* dl_pick_next(CCB* core)
+{
+	TCB* tcb = rlist_pop_front(&core->dl_queue)->tcb;
+	tcb->its = dl_slice(tcb);
+	return tcb;
+}
+
+int sched_set_deadline(TimerDuration runtime, TimerDuration period)
+{
+	if (runtime > period)
+		return -1;
+
+	int ret = -1;
+	int preempt = preempt_off;
+	TCB* tcb = CURTHREAD;
+
+	Spinlock_Lock(&dl_spinlock);
+	uint bw = dl_bandwidth - dl_bw(tcb->dl_runtime, tcb->dl_period) + dl_bw(runtime, period);
+	if (bw <= cpu_cores() * DL_MAX_BANDWIDTH) {
+		dl_bandwidth = bw;
+
+		/* The thread is running, so it is in no queue */
+		Spinlock_Lock(&tcb->state_spinlock);
+		tcb->dl_runtime = runtime;
+		tcb->dl_period = (runtime == 0) ? 0 : period;
+		tcb->dl_deadline = bios_clock() + period;
+		tcb->dl_budget = runtime;
+		Spinlock_Unlock(&tcb->state_spinlock);
+		ret = 0;
+	}
+	Spinlock_Unlock(&dl_spinlock);
+
+	if (preempt)
+		preempt_on;
+	return ret;
+}
+
+/* Return the bandwidth of an exited deadline thread */
+static void dl_release(TCB* tcb)
+{
+	Spinlock_Lock(&dl_spinlock);
+	dl_bandwidth -= dl_bw(tcb->dl_runtime, tcb->dl_period);
+	Spinlock_Unlock(&dl_spinlock);
+}
+
+
+/*
+  The rank of a thread, used to decide when a newly ready thread should
+  preempt a running one: -1 for the idle thread, queueNum for deadline
+  threads, and the priority for the threads of the policy. A core publishes
+  the rank of its current thread in cur_rank; while the core is inside 
+  yield() it publishes SCHED_RANK_BUSY, so that it is neither preempted
+  nor woken up (it is about to select a thread anyway).
+*/
+#define SCHED_RANK_BUSY (queueNum+1)
+
+/* The delay before this core preempts its current thread for a woken thread */
+#define SCHED_PREEMPT_GRACE (QUANTUM/20)
+
+static inline int sched_rank(TCB* tcb)
+{
+	if (tcb->type == IDLE_THREAD)
+		return -1;
+	return (tcb->dl_runtime != 0) ? queueNum : tcb->priority;
+}
+
+/*
+  Choose the core to queue a ready thread on. If this core is idle, or
+  (with preempt set) is inside yield() or runs a thread that tcb outranks,
+  it is chosen. Else, an idle core is best, searching round-robin from the
+  next core, as long as fewer than cpu_parallel_cores() cores are busy (a 
+  core woken beyond that only competes with the others for the host). 
+  Else, with preempt set, the lowest-ranked core whose current thread is
+  outranked by tcb. Else, this core.
+  The ranks are read without locking, so this is only a hint.
+*/
+static CCB* sched_target_core(TCB* tcb, int preempt)
+{
+	uint ncores = cpu_cores();
+	CCB* curcore = &CURCORE;
+	int rank = sched_rank(tcb);
+	int currank = curcore->cur_rank;
+
+	if (currank < 0 || (preempt && (currank == SCHED_RANK_BUSY || currank < rank)))
+		return curcore;
+
+	CCB* idle = NULL;
+	uint busy = 1;
+	CCB* target = curcore;
+	int lowest = preempt ? rank : -1;
+	for (uint i = 1; i < ncores; i++) {
+		CCB* core = &cctx[(cpu_core_id + i) % ncores];
+		int r = core->cur_rank;
+		if (r < 0) {
+			if (idle == NULL)
+				idle = core;
+			continue;
+		}
+		busy++;
+		if (r < lowest) {
+			lowest = r;
+			target = core;
+		}
+	}
+
+	return (idle != NULL && busy < cpu_parallel_cores()) ? idle : target;
+}
+
+/*
+  This core queued threads of the given rank. Give it back its quantum,
+  if it was tickless, and possibly preempt its current thread, after a
+  grace period. The caller (e.g., Cond_Signal) is likely to hold a Mutex
+  which the woken threads are about to take; preempting it at once would
+  leave them spinning on that Mutex.
+*/
+static void sched_queued_here(CCB* core, int rank)
+{
+#ifdef SCHED_TICKLESS
+	/* A tickless core needs its quantum back, now that it has work queued */
+	if (core->tickless) {
+		core->tickless = 0;
+		bios_set_timer(QUANTUM);
+	}
+#endif
+
+	if (core->cur_rank < rank && !core->preempt_pending) {
+		core->preempt_pending = 1;
+		TimerDuration remaining = bios_set_timer(SCHED_PREEMPT_GRACE);
+		if (remaining != 0 && remaining < SCHED_PREEMPT_GRACE)
+			bios_set_timer(remaining);
+	}
+}
+
+/*
+  Add TCB to the scheduler queue of the best core (see sched_target_core),
+  and get that core to run it: a halted core is restarted, and another 
+  core running a thread that tcb outranks is sent an ICI. Threads that were
+  just preempted are re-added with preempt unset.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_queue_add(TCB* tcb, int preempt)
+{
+	CCB* curcore = &CURCORE;
+	CCB* core = sched_target_core(tcb, preempt);
+
+	/* Insert into the deadline queue, or the ready queue of the policy */
+	Spinlock_Lock(&core->sched_spinlock);
+	if (tcb->dl_runtime != 0)
+		dl_enqueue(core, tcb);
+	else
+		SCHED_POLICY->enqueue(core, tcb);
+	core->sched_load++;
+	Spinlock_Unlock(&core->sched_spinlock);
+
+	if (core != curcore) {
+		/* The target is idle (maybe halted), or runs a thread that tcb outranks */
+		if (core->cur_rank < 0)
+			cpu_core_restart(core->id);
+		else
+			cpu_ici(core->id);
+		return;
+	}
+
+	sched_queued_here(core, preempt ? sched_rank(tcb) : -1);
+}
+
+/*
+	Adjust the state of a thread to make it READY, without queueing it.
+
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+ */
+static void sched_set_ready(TCB* tcb)
+{
+	assert(tcb->state == STOPPED || tcb->state == INIT);
+
+	/* Possibly remove from the timeout wheel */
+	if (tcb->wakeup_time != NO_TIMEOUT) {
+		/* tcb is in the timeout wheel, fix it */
+		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
+		Spinlock_Lock(&timeout_spinlock);
+		timeout_wheel_remove(tcb);
+		Spinlock_Unlock(&timeout_spinlock);
+	}
+
+	/* Mark as ready */
+	tcb->state = READY;
+	if (tcb->dl_runtime != 0)
+		dl_wakeup(tcb);
+}
+
+/*
+	Make a thread READY, and add it to a scheduler queue, unless its
+	context is still in use (then, gain() will add it).
+
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+ */
+static void sched_make_ready(TCB* tcb)
+{
+	sched_set_ready(tcb);
+	if (tcb->phase == CTX_CLEAN)
+		sched_queue_add(tcb, 1);
+}
+
+/*
+  Advance the timeout wheel to the current time, and wake up the 
+  threads whose timeout has expired.
+*/
+static void sched_wakeup_expired_timeouts()
+{
+	/* Avoid the lock when there is nothing to do */
+	if (TIMEOUT_WHEEL.count == 0)
+		return;
+
+	TimerDuration curtime = bios_clock();
+
+	Spinlock_Lock(&timeout_spinlock);
+	timeout_wheel_advance(curtime / TW_TICK);
+	while (!is_rlist_empty(&TIMEOUT_WHEEL.expired)) {
+		TCB* tcb = TIMEOUT_WHEEL.expired.next->tcb;
+
+		/* 
+		  We are holding timeout_spinlock, so we can only try to lock the thread.
+		  If this fails, the thread is being woken up (or is still going to sleep)
+		  on another core; we will retry at the next yield.
+		 */
+		if (!Spinlock_TryLock(&tcb->state_spinlock))
+			break;
+		timeout_wheel_remove(tcb);
+		sched_make_ready(tcb);
+		SCHED_TRACE(&CURCORE, TRACE_TIMEOUT, tcb, 0);
+		Spinlock_Unlock(&tcb->state_spinlock);
+	}
+	Spinlock_Unlock(&timeout_spinlock);
+}
+
+/*
+  Remove the next thread from the queue of a core and return it: the
+  deadline thread with the earliest deadline, or else the thread chosen
+  by the policy. Return NULL if the queue is empty.
+*/
+static TCB* sched_queue_pop(CCB* core)
+{
+	TCB* tcb = NULL;
+
+	/* Avoid the lock when there is nothing to do */
+	if (core->sched_load == 0)
+		return NULL;
+
+	Spinlock_Lock(&core->sched_spinlock);
+	if (core->sched_load > 0) {
+		if (!is_rlist_empty(&core->dl_queue))
+			tcb = dl_pick_next(core);
+		else
+			tcb = SCHED_POLICY->pick_next(core);
+		core->sched_load--;
+	}
+	Spinlock_Unlock(&core->sched_spinlock);
+
+	return tcb;
+}
+
+/*
+  Steal a thread from the queues of the most loaded core, if any.
+  The loads are read without locking, so this is only a hint.
+*/
+static TCB* sched_queue_steal()
+{
+	uint ncores = cpu_cores();
+	CCB* victim = NULL;
+	uint maxload = 0;
+
+	for (uint i = 1; i < ncores; i++) {
+		CCB* core = &cctx[(cpu_core_id + i) % ncores];
+		if (core->sched_load > maxload) {
+			maxload = core->sched_load;
+			victim = core;
+		}
+	}
+
+	return (victim == NULL) ? NULL : sched_queue_pop(victim);
+}
+
+/*
+  Check if a queued deadline thread of a core has an earlier deadline 
+  than a given deadline thread.
+*/
+static int dl_queue_preempts(CCB* core, TCB* tcb)
+{
+	Spinlock_Lock(&core->sched_spinlock);
+	int ret = !is_rlist_empty(&core->dl_queue) && 
+		core->dl_queue.next->tcb->dl_deadline < tcb->dl_deadline;
+	Spinlock_Unlock(&core->sched_spinlock);
+	return ret;
+}
+
+/*
+  Select the next thread to run on this core. Threads in our own 
+  queues come first, then threads stolen from other cores. If there 
+  is no such thread, return the current thread (if it is READY) or
+  the idle thread.
+
+  A READY deadline thread is not in the queues while it is selected
+  (it is queued again in gain()), so it is compared to the queued 
+  deadline threads here. It keeps the core ahead of the threads of 
+  the policy, until its budget is exhausted.
+*/
+static TCB* sched_queue_select(TCB* current)
+{
+	if (current->state == READY && current->dl_runtime != 0 && 
+	    !dl_queue_preempts(&CURCORE, current)) {
+		current->its = dl_slice(current);
+		return current;
+	}
+
+	TCB* next_thread = sched_queue_pop(&CURCORE);
+
+	if (next_thread == NULL)
+		next_thread = sched_queue_steal();
+
+	if (next_thread == NULL) {
+		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+		next_thread->its = (next_thread->dl_runtime != 0) ? dl_slice(next_thread) : QUANTUM;
+	}
+
+	return next_thread;
+}
+
+/*
+  Make the process ready.
+ */
+int wakeup(TCB* tcb)
+{
+	int ret = 0;
+
+	/* Preemption off */
+	int oldpre = preempt_off;
+
+	/* To touch tcb->state, we must get its spinlock. */
+	Spinlock_Lock(&tcb->state_spinlock);
+
+	if (tcb->state == STOPPED || tcb->state == INIT) {
+		sched_make_ready(tcb);
+		SCHED_TRACE(&CURCORE, TRACE_WAKEUP, tcb, 0);
+		ret = 1;
+	}
+
+	Spinlock_Unlock(&tcb->state_spinlock);
+
+	/* Restore preemption state */
+	if (oldpre)
+		preempt_on;
+
+	return ret;
+}
+
+/*
+  Restart up to count idle cores (other than this one), so that they 
+  steal work from our queues. As in sched_target_core, cores are not 
+  restarted beyond cpu_parallel_cores() busy cores.
+*/
+static void sched_restart_idle(uint count)
+{
+	uint ncores = cpu_cores();
+	uint busy = 1;
+	for (uint i = 1; i < ncores; i++)
+		if (cctx[(cpu_core_id + i) % ncores].cur_rank >= 0)
+			busy++;
+	if (busy >= cpu_parallel_cores())
+		return;
+	if (count > cpu_parallel_cores() - busy)
+		count = cpu_parallel_cores() - busy;
+
+	for (uint i = 1; i < ncores && count > 0; i++) {
+		CCB* core = &cctx[(cpu_core_id + i) % ncores];
+		if (core->cur_rank < 0) {
+			cpu_core_restart(core->id);
+			count--;
+		}
+	}
+}
+
+/*
+  Make ready a batch of threads. The sleeping threads are marked READY 
+  one by one, and then queued on this core under a single lock. Then,
+  there is one round of core restarts: an idle core for each thread
+  that this core will not run next.
+ */
+int wakeup_many(TCB** tcbs, int n)
+{
+	int woken = 0;
+	int rank = -1;
+	rlnode ready;
+	rlnode_init(&ready, NULL);
+
+	/* Preemption off */
+	int oldpre = preempt_off;
+	CCB* core = &CURCORE;
+
+	for (int i = 0; i < n; i++) {
+		TCB* tcb = tcbs[i];
+		Spinlock_Lock(&tcb->state_spinlock);
+		if (tcb->state == STOPPED || tcb->state == INIT) {
+			sched_set_ready(tcb);
+			SCHED_TRACE(core, TRACE_WAKEUP, tcb, 0);
+			woken++;
+
+			/* 
+			  Nobody else touches a READY thread with a clean context,
+			  until it is queued; otherwise, gain() will queue it.
+			 */
+			if (tcb->phase == CTX_CLEAN)
+				rlist_push_back(&ready, &tcb->sched_node);
+		} else
+			tcbs[i] = NULL;
+		Spinlock_Unlock(&tcb->state_spinlock);
+	}
+
+	uint queued = 0;
+	if (!is_rlist_empty(&ready)) {
+		Spinlock_Lock(&core->sched_spinlock);
+		while (!is_rlist_empty(&ready)) {
+			TCB* tcb = rlist_pop_front(&ready)->tcb;
+			if (tcb->dl_runtime != 0)
+				dl_enqueue(core, tcb);
+			else
+				SCHED_POLICY->enqueue(core, tcb);
+			if (sched_rank(tcb) > rank)
+				rank = sched_rank(tcb);
+			queued++;
+		}
+		core->sched_load += queued;
+		Spinlock_Unlock(&core->sched_spinlock);
+
+		int currank = core->cur_rank;
+		sched_queued_here(core, rank);
+		sched_restart_idle((currank < 0 || currank < rank) ? queued - 1 : queued);
+	}
+
+	/* Restore preemption state */
+	if (oldpre)
+		preempt_on;
+
+	return woken;
+}
+
+void sched_inherit_priority(TCB* tcb, int priority, Mutex* lock)
+{
+	if (SCHED_POLICY != &mlfq_policy)
+		return;
+
+	/* Preemption off */
+	int oldpre = preempt_off;
+
+	Spinlock_Lock(&tcb->state_spinlock);
+	if (tcb->dl_runtime == 0 && tcb->state != EXITED && tcb->priority < priority) {
+		mlfq_inherit(tcb, priority);
+		tcb->pi_mutex = lock;
+		SCHED_TRACE(&CURCORE, TRACE_PRIORITY, tcb, priority);
+	}
+	Spinlock_Unlock(&tcb->state_spinlock);
+
+	/* Restore preemption state */
+	if (oldpre)
+		preempt_on;
+}
+
+/*
+  Only the waiter with the highest priority is remembered, since the boost
+  is its priority. Unlocking another mutex keeps the boost. 
+ */
+void sched_restore_priority(Mutex* lock)
+{
+	TCB* current = cur_thread();
+
+	/* Avoid the lock when there is nothing to do */
+	if (current->pi_mutex != lock)
+		return;
+
+	/* Preemption off */
+	int oldpre = preempt_off;
+
+	Spinlock_Lock(&current->state_spinlock);
+	int restore = (current->pi_mutex == lock);
+	if (restore) {
+		current->priority = current->pi_saved;
+		current->pi_saved = -1;
+		current->pi_mutex = NULL;
+	}
+	Spinlock_Unlock(&current->state_spinlock);
+
+	if (restore) {
+		CCB* curcore = &CURCORE;
+		curcore->cur_rank = sched_rank(current);
+		SCHED_TRACE(curcore, TRACE_PRIORITY, current, current->priority);
+	}
+
+	/* Restore preemption state */
+	if (oldpre)
+		preempt_on;
+}
+
+/*
+  Atomically put the current process to sleep, after unlocking mx.
+ */
+void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
+	TimerDuration timeout)
+{
+	assert(state == STOPPED || state == EXITED);
+
+
+	int preempt = preempt_off;
+	TCB* tcb = CURTHREAD;
+	Spinlock_Lock(&tcb->state_spinlock);
+
+	/* mark the thread as stopped or exited */
+	tcb->state = state;
+	SCHED_TRACE(&CURCORE, TRACE_SLEEP, tcb, cause);
+
+	/* register the timeout (if any) for the sleeping thread */
+	if (state != EXITED)
+		sched_register_timeout(tcb, timeout);
+
+	/* Release the thread spinlock before calling yield() !!! */
+	Spinlock_Unlock(&tcb->state_spinlock);
+
+	/* 
+	   Release mx. We are already marked as sleeping, so a wakeup by the
+	   next owner of mx is not lost; gain() will queue us. This is done 
+	   without the spinlock, since Mutex_Unlock may take parking bucket
+	   locks, which are locked before thread spinlocks.
+	 */
+	if (mx != NULL)
+		Mutex_Unlock(mx);
+
+	/* call this to schedule someone else */
+	yield(cause);
+
+	/* Restore preemption state */
+	if (preempt)
+		preempt_on;
+}
+
+/* This function is the entry point to the scheduler's context switching */
+
+void yield(enum SCHED_CAUSE cause)
+{
+	/* Reset the timer, so that we are not interrupted by ALARM */
+	TimerDuration remaining = bios_cancel_timer();
+
+	/* We must stop preemption but save it! */
+	int preempt = preempt_off;
+
+	CCB* curcore = &CURCORE;
+	TCB* current = curcore->current_thread; /* Make a local copy of current process, for speed */
+
+	/* The timer was canceled above; gain() will set it again */
+	curcore->tickless = 0;
+	curcore->preempt_pending = 0;
+	curcore->cur_rank = SCHED_RANK_BUSY;
+
+	SCHED_POLICY->on_tick(curcore);
+
+	/* The time that the current thread ran */
+	TimerDuration now = bios_clock();
+	TimerDuration runtime = now - curcore->slice_start;
+	curcore->slice_start = now;
+
+	/* Update CURTHREAD state */
+	Spinlock_Lock(&current->state_spinlock);
+	if (current->state == RUNNING)
+		current->state = READY;
+	if (current->dl_runtime != 0)
+		dl_charge(current, runtime, now);
+	Spinlock_Unlock(&current->state_spinlock);
+
+	/* Update CURTHREAD scheduler data */
+	current->rts = remaining;
+	current->last_cause = current->curr_cause;
+	current->curr_cause = cause;
+
+	/* Wake up threads whose sleep timeout has expired */
+	sched_wakeup_expired_timeouts();
+
+	/* Adjust the scheduling parameters of the current thread, unless it
+	   runs on an inherited priority */
+	if (current->dl_runtime == 0 && current->pi_saved < 0) {
+		int priority = current->priority;
+		SCHED_POLICY->on_yield(curcore, current, cause, runtime);
+		if (current->priority != priority)
+			SCHED_TRACE(curcore, TRACE_PRIORITY, current, current->priority);
+	}
+
+	/* Get next */
+	TCB* next = sched_queue_select(current);
+	assert(next != NULL);
+
+	/* Save the current TCB for the gain phase */
+	curcore->previous_thread = current;
+
+	/* Switch contexts */
+	if (current != next) {
+		SCHED_TRACE(curcore, TRACE_SWITCH, next, cause);
+		curcore->ctx_switches++;
+		curcore->current_thread = next;
+		cpu_swap_context(&current->context, &next->context);
+	}
+
+	/* This is where we get after we are switched back on! A long time
+	   may have passed. Start a new timeslice...
+	  */
 	gain(preempt);
 }
 
+#ifdef SCHED_TICKLESS
+/*
+  Compute the alarm for a new timeslice of the current thread. 
+
+  A core that is idle, or that runs a thread with nothing else in its 
+  queues, needs no quantum interrupts. Its alarm is set only for the next 
+  event of the timeout wheel, or not at all if there are no timeouts.
+  Such a core is marked as tickless, and gets its quantum back as soon as
+  a thread is added to its queues (see sched_queue_add).
+*/
+static TimerDuration sched_timeslice(CCB* core, TCB* current)
+{
+	if (current->type != IDLE_THREAD && (core->sched_load > 0 || current->dl_runtime != 0))
+		return current->rts;
+
+	core->tickless = 1;
+
+	Spinlock_Lock(&timeout_spinlock);
+	TimerDuration deadline = timeout_wheel_next();
+	Spinlock_Unlock(&timeout_spinlock);
+
+	if (deadline == NO_TIMEOUT)
+		return 0;
+
+	/* bios_set_timer(0) would cancel the alarm */
+	TimerDuration curtime = bios_clock();
+	return (deadline > curtime) ? deadline - curtime : 1;
+}
+#else
+static TimerDuration sched_timeslice(CCB* core, TCB* current)
+{
+	return current->rts;
+}
+#endif
+
 /*
   This function must be called at the beginning of each new timeslice.
   This is done mostly from inside yield().
@@ -541,42 +1872,52 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
-
-	TCB* current = CURTHREAD;
+	CCB* curcore = &CURCORE;
+	TCB* current = curcore->current_thread;
 
 	/* Mark current state */
+	Spinlock_Lock(&current->state_spinlock);
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
+	Spinlock_Unlock(&current->state_spinlock);
 	current->rts = current->its;
 
 	/* Take care of the previous thread */
-	TCB* prev = CURCORE.previous_thread;
+	TCB* prev = curcore->previous_thread;
 	if (current != prev) {
+		Spinlock_Lock(&prev->state_spinlock);
 		prev->phase = CTX_CLEAN;
-		switch (prev->state) {
+		Thread_state prev_state = prev->state;
+		switch (prev_state) {
 		case READY:
 			if (prev->type != IDLE_THREAD)
-				sched_queue_add(prev);
+				sched_queue_add(prev, 0);
 			break;
 		case EXITED:
-			release_TCB(prev);
-			break;
 		case STOPPED:
 			break;
 		default:
 			assert(0); /* prev->state should not be INIT or RUNNING ! */
 		}
+		Spinlock_Unlock(&prev->state_spinlock);
+
+		/* Nobody else may access an exited thread */
+		if (prev_state == EXITED) {
+			if (prev->dl_runtime != 0)
+				dl_release(prev);
+			release_TCB(prev);
+		}
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	TimerDuration timeslice = sched_timeslice(curcore, current);
+	curcore->cur_rank = sched_rank(current);
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
 
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
+	/* Set a 1-quantum alarm, or none at all when tickless */
+	bios_set_timer(timeslice);
 }
 
 static void idle_thread()
@@ -600,11 +1941,53 @@ static void idle_thread()
  */
 void initialize_scheduler()
 {
-	for(int i = 0; i < queueNum; i++){	//Init every queue
-		rlnode_init(&SCHED[i], NULL);
+	for(uint c = 0; c < MAX_CORES; c++) {
+		CCB* core = &cctx[c];
+		core->sched_spinlock = SPINLOCK_INIT;
+		SCHED_POLICY->init(core);
+		rlnode_init(&core->dl_queue, NULL);
+		core->sched_load = 0;
+		core->cur_rank = -1;
+		core->tickless = 0;
+		core->preempt_pending = 0;
+		rlnode_init(&core->thread_cache, NULL);
+		core->thread_cache_size = 0;
+		core->pool_stats = (thread_pool_stats){ 0 };
+		core->ctx_switches = 0;
+	}
+
+	initialize_timeout_wheel();
+	sched_trace_start();
+
+	/* Pre-fault a few thread blocks */
+	rlnode_init(&thread_depot, NULL);
+	thread_depot_size = 0;
+	thread_pool_high_water = THREAD_POOL_HIGH_WATER;
+	for(int i = 0; i < THREAD_POOL_PREFILL; i++) {
+		thread_block_push(&thread_depot, thread_block_fresh());
+		thread_depot_size++;
 	}
+}
+
+void finalize_scheduler()
+{
+	sched_trace_stop();
 
-	rlnode_init(&TIMEOUT_LIST, NULL);
+	for(uint c = 0; c < MAX_CORES; c++) {
+		cctx[c].pool_stats.frees += thread_block_free_list(&cctx[c].thread_cache);
+		cctx[c].thread_cache_size = 0;
+	}
+	cctx[0].pool_stats.frees += thread_block_free_list(&thread_depot);
+	thread_depot_size = 0;
+
+#ifdef THREAD_POOL_STATISTICS
+	thread_pool_stats st;
+	get_thread_pool_stats(&st);
+	fprintf(stderr, "Thread pool: %lu allocs, %lu core hits, %lu depot hits, "
+		"%lu releases, %lu frees, stack high-water mark %zu bytes\n",
+		st.allocs, st.core_hits, st.depot_hits, st.releases, st.frees,
+		st.stack_high_water);
+#endif
 }
 
 void run_scheduler()
@@ -615,11 +1998,13 @@ void run_scheduler()
 	curcore->id = cpu_core_id;
 
 	curcore->current_thread = &curcore->idle_thread;
+	curcore->slice_start = bios_clock();
 
 	curcore->idle_thread.owner_pcb = get_pcb(0);
 	curcore->idle_thread.type = IDLE_THREAD;
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
+	curcore->idle_thread.state_spinlock = SPINLOCK_INIT;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
@@ -628,6 +2013,9 @@ void run_scheduler()
 
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
+#ifdef MUTEX_PROFILE
+	curcore->idle_thread.mutex_held = 0;
+#endif
 
 	/* Initialize interrupt handler */
 	cpu_interrupt_handler(ALARM, yield_handler);
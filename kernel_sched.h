@@ -24,6 +24,24 @@
 #include "tinyos.h"
 #include "util.h"
 
+/** @brief A ticket spinlock, for the non-preemptive domain.
+
+  A @c Spinlock is acquired in FIFO order: each core takes a ticket 
+  from @c next and spins until @c owner reaches it. Unlike a @c Mutex,
+  it never yields, and it must only be locked with preemption off.
+  The scheduler locks are Spinlocks.
+
+  @see Spinlock_Lock
+*/
+typedef struct {
+	volatile uint16_t owner;  /**< @brief The ticket now holding the lock */
+	volatile uint16_t next;   /**< @brief The next ticket to hand out */
+} Spinlock;
+
+/** @brief Initializer for a Spinlock */
+#define SPINLOCK_INIT ((Spinlock){ 0, 0 })
+
+
 /*****************************
  *
  *  The Thread Control Block
@@ -69,6 +87,9 @@ typedef enum {
 	CTX_DIRTY /**< @brief Context is dirty. */
 } Thread_phase;
 
+/** @brief The held mutexes each thread tracks for lock profiling (see OpenLockInfo). */
+#define MUTEX_HOLD_MAX 8
+
 /** @brief Thread type. */
 typedef enum {
 	IDLE_THREAD, /**< @brief Marks an idle thread. */
@@ -88,7 +109,8 @@ enum SCHED_CAUSE {
 	SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
 	SCHED_POLL, /**< @brief The thread is polling a device */
 	SCHED_IDLE, /**< @brief The idle thread called yield */
-	SCHED_USER /**< @brief User-space code called yield */
+	SCHED_USER, /**< @brief User-space code called yield */
+	SCHED_PREEMPT /**< @brief A reschedule interrupt preempted the thread */
 };
 
 /**
@@ -107,6 +129,7 @@ typedef struct thread_control_block {
 	Thread_type type; /**< @brief The type of thread */
 	Thread_state state; /**< @brief The state of the thread */
 	Thread_phase phase; /**< @brief The phase of the thread */
+	Spinlock state_spinlock; /**< @brief Protects the state, phase and timeout of the thread */
 
 	void (*thread_func)(); /**< @brief The initial function executed by this thread */
 
@@ -119,7 +142,35 @@ typedef struct thread_control_block {
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
-  int priority;
+	size_t stack_size; /**< @brief The size of the thread stack, in bytes */
+
+	int priority; /**< @brief The priority level (scheduler queue) of the thread.
+
+	  While the thread is in a scheduler queue, this may be stale (due to priority
+	  boosts); the scheduler sets it from the queue, when the thread is selected.
+	  */
+	int pi_saved; /**< @brief The priority before an inherited boost, or -1 (see sched_inherit_priority) */
+	Mutex* pi_mutex; /**< @brief The mutex whose waiter lent the inherited boost, or NULL */
+	struct core_control_block* mlfq_core; /**< @brief The core whose MLFQ queues hold the thread, or NULL */
+
+	TimerDuration vruntime; /**< @brief The virtual runtime of the thread (fair policy) */
+	struct thread_control_block* fair_child;   /**< @brief First child in the fair policy heap */
+	struct thread_control_block* fair_sibling; /**< @brief Next sibling in the fair policy heap */
+
+	TimerDuration dl_runtime;  /**< @brief The runtime budget per period of a deadline thread, 
+	                                or 0 for other threads */
+	TimerDuration dl_period;   /**< @brief The period of a deadline thread */
+	TimerDuration dl_deadline; /**< @brief The absolute deadline of the current period */
+	TimerDuration dl_budget;   /**< @brief The runtime left in the current period */
+
+#ifdef MUTEX_PROFILE
+	struct mutex_hold {
+		Mutex* lock;              /* a mutex held by this thread */
+		struct mutex_site* site;  /* the site that locked it */
+		unsigned long since;      /* the time it was locked */
+	} mutex_hold[MUTEX_HOLD_MAX]; /**< @brief The mutexes held, for lock profiling */
+	int mutex_held;               /**< @brief The entries of @c mutex_hold */
+#endif
 
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
@@ -163,12 +214,79 @@ typedef struct process_thread_control_block{
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief The smallest thread stack size accepted by @ref spawn_thread. */
+#define THREAD_STACK_MIN (16 * 1024)
+
+/** @brief The largest thread stack size accepted by @ref spawn_thread. */
+#define THREAD_STACK_MAX (64 * 1024 * 1024)
+
+/** @brief High-water mark of the thread pool.
+
+  Memory blocks of exited threads (TCB and stack) are kept for reuse,
+  first in a small per-core cache and then in a global depot. This is
+  the default maximum number of blocks held in the depot; blocks
+  released beyond it are returned to the system allocator. It can be
+  changed at run time by @ref set_thread_pool_high_water.
+ */
+#ifndef THREAD_POOL_HIGH_WATER
+#define THREAD_POOL_HIGH_WATER 64
+#endif
+
+/** @brief Maximum number of blocks in each core's thread pool cache. */
+#define THREAD_POOL_CORE_CACHE 8
+
+/** @brief Number of blocks pre-allocated into the depot at boot. */
+#define THREAD_POOL_PREFILL 8
+
+/** @brief Thread pool statistics.
+
+  Only blocks with the default stack size are pooled. Blocks allocated
+  but found in neither the core cache nor the depot
+  (i.e., @c allocs - @c core_hits - @c depot_hits) were freshly obtained from
+  the system allocator.
+ */
+typedef struct thread_pool_stats {
+	unsigned long allocs;     /**< @brief Blocks handed out to new threads */
+	unsigned long core_hits;  /**< @brief Allocations served by the per-core cache */
+	unsigned long depot_hits; /**< @brief Allocations served by the global depot */
+	unsigned long releases;   /**< @brief Blocks of exited threads returned to the pool */
+	unsigned long frees;      /**< @brief Blocks returned to the system allocator */
+	size_t stack_high_water;  /**< @brief The deepest stack usage of an exited thread, in bytes
+	                               (only measured with @c THREAD_STACK_STATISTICS) */
+} thread_pool_stats;
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/** @brief Types of scheduler trace events. */
+enum SCHED_TRACE_EVENT {
+	TRACE_SWITCH,   /**< @brief A thread was switched in; @c arg is the cause the previous one left */
+	TRACE_WAKEUP,   /**< @brief A thread was made ready by @ref wakeup */
+	TRACE_TIMEOUT,  /**< @brief A thread was made ready because its timeout expired */
+	TRACE_SLEEP,    /**< @brief A thread went to sleep; @c arg is the cause */
+	TRACE_PRIORITY, /**< @brief The priority of a thread changed; @c arg is the new priority */
+	TRACE_BOOST,    /**< @brief The priorities of the queued threads of a core were boosted */
+	TRACE_THROTTLE  /**< @brief A deadline thread exhausted its budget */
+};
+
+/** @brief A scheduler trace event. */
+typedef struct sched_trace_event {
+	TimerDuration time; /**< @brief The time of the event, from @c bios_clock() */
+	Tid_t tid;          /**< @brief The thread of the event (0 for the idle thread) */
+	int pid;            /**< @brief The process of the thread */
+	short type;         /**< @brief A @c SCHED_TRACE_EVENT */
+	short arg;          /**< @brief The cause or priority of the event */
+} sched_trace_event;
+
+/** @brief The number of events in the trace ring of each core (a power of 2). */
+#define SCHED_TRACE_SIZE 8192
+
+/** @brief Number of priority levels (one scheduler queue per level, at most 32). */
+#define queueNum 3
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
@@ -179,6 +297,28 @@ typedef struct core_control_block {
 	TCB* current_thread; /**< @brief Points to the thread currently owning the core */
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
+	volatile int cur_rank; /**< @brief The rank of the current thread (see sched_rank),
+	                            read by other cores without locking */
+
+	Spinlock sched_spinlock; /**< @brief Protects the scheduler queues of this core */
+	rlnode sched_queue[queueNum]; /**< @brief The scheduler queues of this core, one per priority */
+	uint sched_bitmap; /**< @brief Bit @c i is set iff @c sched_queue[i] is not empty */
+	volatile uint sched_load; /**< @brief The number of threads in the scheduler queues */
+	uint yield_calls; /**< @brief Calls to yield() on this core, since the last priority boost */
+	TCB* fair_heap; /**< @brief The ready threads of the fair policy, a heap ordered by vruntime */
+	TimerDuration min_vruntime; /**< @brief The smallest vruntime of a thread run by this core (fair policy) */
+	rlnode dl_queue; /**< @brief The ready deadline threads of this core, by earliest deadline */
+	TimerDuration slice_start; /**< @brief The time of the last call to yield() on this core */
+
+	sched_trace_event* trace; /**< @brief The trace ring of this core, or NULL if not tracing */
+	unsigned long trace_count; /**< @brief The number of events recorded in the trace ring */
+	int tickless; /**< @brief Set while the core runs without quantum interrupts */
+	int preempt_pending; /**< @brief Set when the alarm was shortened, to preempt the current thread */
+
+	rlnode thread_cache; /**< @brief Free thread blocks cached by this core */
+	uint thread_cache_size; /**< @brief The length of @c thread_cache */
+	thread_pool_stats pool_stats; /**< @brief Thread pool statistics of this core */
+	unsigned long ctx_switches; /**< @brief The number of context switches on this core */
 
 } CCB;
 
@@ -186,6 +326,42 @@ typedef struct core_control_block {
 extern CCB cctx[MAX_CORES];
 
 
+/** @brief A scheduler policy.
+
+  A policy decides the order in which the ready threads of a core are run,
+  and how their timeslices are adjusted. The ready queue of each core is 
+  kept in its CCB. The @c enqueue and @c pick_next methods are called with
+  the core's @c sched_spinlock held; the others are called by the core 
+  itself, in the non-preemptive domain, without it.
+
+  The policy is selected before boot, by @ref set_sched_policy. It does
+  not see deadline threads (see @ref sched_set_deadline), which are 
+  always scheduled ahead of the threads of the policy.
+ */
+typedef struct sched_policy {
+	const char* name; /**< @brief The name of the policy */
+
+	/** @brief Initialize the (empty) ready queue of a core. */
+	void (*init)(CCB* core);
+
+	/** @brief Add a ready thread to the queue of a core. */
+	void (*enqueue)(CCB* core, TCB* tcb);
+
+	/** @brief Remove and return the next thread of a non-empty queue.
+
+	  This must also set the initial timeslice (@c its) of the thread.
+	 */
+	TCB* (*pick_next)(CCB* core);
+
+	/** @brief The current thread of the core left its timeslice, for the given cause,
+	  after running for @c runtime microseconds. */
+	void (*on_yield)(CCB* core, TCB* current, enum SCHED_CAUSE cause, TimerDuration runtime);
+
+	/** @brief Called on every entry to the scheduler of the core, before @c on_yield. */
+	void (*on_tick)(CCB* core);
+} sched_policy;
+
+
 /** 
   @brief The current thread.
 
@@ -225,9 +401,14 @@ TCB* cur_thread();
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
-    @returns  A pointer to the TCB of the new thread, in the @c INIT state.
+    @param stack_size The stack size of the new thread, in bytes. If 0,
+                @c THREAD_STACK_SIZE is used. Otherwise, it is rounded up
+                to a multiple of the page size and to at least
+                @c THREAD_STACK_MIN.
+    @returns  A pointer to the TCB of the new thread, in the @c INIT state,
+                or @c NULL if @c stack_size exceeds @c THREAD_STACK_MAX.
 */
-TCB* spawn_thread(PCB* pcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size);
 
 /**
   @brief Wakeup a blocked thread.
@@ -241,6 +422,48 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup a batch of blocked threads.
+
+  This has the same effect as calling @ref wakeup on each thread, but the
+  threads are added to the scheduler queues under a single lock, and idle
+  cores are restarted once, for the whole batch. 
+
+  @param tcbs an array of threads to be made @c READY. Each thread whose
+         state was not @c STOPPED or @c INIT is replaced by @c NULL.
+  @param n the length of the array
+  @returns the number of threads made @c READY
+*/
+int wakeup_many(TCB** tcbs, int n);
+
+/**
+  @brief Lend a priority level to a thread (priority inheritance).
+
+  This is called when the current thread blocks on mutex @c lock, held 
+  by @c tcb. Under the MLFQ policy, if @c priority is higher than the 
+  priority of @c tcb, then @c tcb is raised to it (and moved to the 
+  matching queue, if it is queued), until it unlocks @c lock (see 
+  @ref sched_restore_priority). Inheritance is not transitive, and other
+  policies (and deadline threads) ignore it.
+
+  The caller must make sure that @c tcb does not exit during the call.
+
+  @param tcb the thread to boost
+  @param priority the priority level to lend
+  @param lock the mutex that the current thread blocks on
+*/
+void sched_inherit_priority(TCB* tcb, int priority, Mutex* lock);
+
+/**
+  @brief Return the current thread to the priority it had before any
+  inherited boost, if the boost was lent through mutex @c lock (see 
+  @ref sched_inherit_priority).
+
+  This is called as @c lock is unlocked. It takes the state spinlock of
+  the current thread, so it must not be called while holding it.
+*/
+void sched_restore_priority(Mutex* lock);
+
 /** 
   @brief Block the current thread.
 
@@ -298,6 +521,63 @@ void run_scheduler(void);
  */
 void initialize_scheduler(void);
 
+/**
+  @brief Finalize the scheduler.
+
+  This function is called by one core during kernel shutdown, after
+  all cores have returned from @ref run_scheduler. It writes the
+  scheduler trace (if tracing was enabled by @c set_sched_trace), and
+  releases the memory held by the thread pool.
+ */
+void finalize_scheduler(void);
+
+/**
+  @brief Make the current thread a deadline thread, or a normal one.
+
+  A deadline thread is granted @c runtime microseconds of execution in
+  every @c period microseconds. Ready deadline threads are scheduled
+  by earliest deadline first, ahead of all other threads. A deadline 
+  thread which exhausts its budget is throttled until the end of its 
+  period; one that sleeps past its deadline gets a new period when
+  it wakes up.
+
+  The sum of @c runtime/period over all deadline threads may not exceed
+  @c DL_MAX_BANDWIDTH per core.
+
+  @param runtime the runtime budget per period, or 0 to make the thread
+     a normal thread again
+  @param period the period
+  @returns 0 on success, or -1 if @c runtime > @c period, or if the
+     thread was not admitted.
+ */
+int sched_set_deadline(TimerDuration runtime, TimerDuration period);
+
+/** @brief The fraction of each core (out of 1024) available to deadline threads. */
+#define DL_MAX_BANDWIDTH 972
+
+/**
+  @brief Set the high-water mark of the thread pool.
+
+  At most @c hw free thread blocks will be kept in the global depot;
+  excess blocks are released immediately.
+
+  @returns the previous high-water mark.
+  @see THREAD_POOL_HIGH_WATER
+ */
+uint set_thread_pool_high_water(uint hw);
+
+/**
+  @brief Collect the thread pool statistics.
+
+  The statistics of all cores are summed into @c stats.
+ */
+void get_thread_pool_stats(thread_pool_stats* stats);
+
+/**
+  @brief Return the number of context switches on all cores, since boot.
+ */
+unsigned long get_context_switches();
+
 /**
   @brief Quantum (in microseconds) 
 
@@ -2,23 +2,37 @@
 #include "kernel_socket.h"
 
 
+/* 
+  Protects the PORT_MAP and the state of all sockets, including the 
+  connection requests. The data of connected peers flows through 
+  their pipes, which have their own locks.
+ */
+static Mutex port_mutex = MUTEX_INIT;
+
+
+static PIPE_CB* socket_read_pipe(void* socketcb_t);
+static PIPE_CB* socket_write_pipe(void* socketcb_t);
+
 static file_ops socket_file_ops = {
 	.Open = NULL,
 	.Read = socket_read,
 	.Write = socket_write,
-	.Close = socket_close
+	.Close = socket_close,
+	.ReadPipe = socket_read_pipe,
+	.WritePipe = socket_write_pipe
 };
 
-Fid_t sys_Socket(port_t port)
+/*
+  Create a socket at a new fid of the current process. Return the new
+  socket, or NULL if the fids are exhausted.
+ */
+static SOCKET_CB* socket_create(port_t port, Fid_t* sock)
 {
-	if(port <= -1 || port >= MAX_PORT + 1)
-		return NOFILE;
-
 	Fid_t fid[1];
 	FCB* fcb[1];
 
 	if(FCB_reserve(1, fid, fcb) == 0)
-		return NOFILE;
+		return NULL;
 
 	SOCKET_CB* socket_cb = xmalloc(sizeof(SOCKET_CB));
 	
@@ -29,8 +43,21 @@ Fid_t sys_Socket(port_t port)
 	
 	fcb[0]->streamobj = socket_cb;
 	fcb[0]->streamfunc = &socket_file_ops;
+	FCB_install(1, fid, fcb);
 
-	return fid[0];
+	*sock = fid[0];
+	return socket_cb;
+}
+
+Fid_t sys_Socket(port_t port)
+{
+	if(port <= -1 || port >= MAX_PORT + 1)
+		return NOFILE;
+
+	Fid_t fid;
+	if(socket_create(port, &fid) == NULL)
+		return NOFILE;
+	return fid;
 }
 
 int sys_Listen(Fid_t sock)
@@ -39,17 +66,25 @@ int sys_Listen(Fid_t sock)
 
 	if(socket_cb == NULL)
 		return -1;
+
+	int retval = -1;
+	Mutex_Lock(&port_mutex);
+
 	if(socket_cb->port == NOPORT || PORT_MAP[socket_cb->port] != NULL)
-		return -1;
+		goto finish;
 	if(socket_cb->type != SOCKET_UNBOUND)
-		return -1;
+		goto finish;
 
 	PORT_MAP[socket_cb->port] = socket_cb;
 	socket_cb->type = SOCKET_LISTENER;
 	rlnode_init(&socket_cb->listener_s.queue, NULL);
 	socket_cb->listener_s.req_available = COND_INIT;
+	retval = 0;
 
-	return 0;
+finish:
+	Mutex_Unlock(&port_mutex);
+	put_SCB(socket_cb);
+	return retval;
 }
 
 
@@ -59,22 +94,33 @@ Fid_t sys_Accept(Fid_t lsock)
 
 	if(server == NULL)
 		return NOFILE;
-	if(PORT_MAP[server->port] == NULL)
-		return NOFILE;
-	if(server->type != SOCKET_LISTENER)
-		return NOFILE;
 
-	while(is_rlist_empty(&server->listener_s.queue) && PORT_MAP[server->port] != NULL){
-		kernel_wait(&server->listener_s.req_available, SCHED_IO);
+	Fid_t server_peer_fid = NOFILE;
+	Mutex_Lock(&port_mutex);
+
+	if(PORT_MAP[server->port] != server || server->type != SOCKET_LISTENER) {
+		Mutex_Unlock(&port_mutex);
+		put_SCB(server);
+		return NOFILE;
 	}
 
+	/* 
+	  Keep the listener alive while we wait, but drop the FCB reference, 
+	  so that a Close() of the listener can unblock us. The last reference
+	  is dropped without port_mutex, since it closes the socket.
+	 */
 	server->refcount++;
+	Mutex_Unlock(&port_mutex);
+	put_SCB(server);
+	Mutex_Lock(&port_mutex);
 
-	if(PORT_MAP[server->port] == NULL){
-		SCB_decref(server);
-		return NOFILE;
+	while(is_rlist_empty(&server->listener_s.queue) && PORT_MAP[server->port] == server){
+		kernel_wait(&port_mutex, &server->listener_s.req_available, SCHED_IO);
 	}
 
+	if(PORT_MAP[server->port] != server)
+		goto finish;
+
 	rlnode* client_node = rlist_pop_front(&server->listener_s.queue);
 	assert(client_node != NULL);
 
@@ -83,55 +129,23 @@ Fid_t sys_Accept(Fid_t lsock)
 	//CON_REQ* con_req = (CON_REQ*)rlist_pop_front(&server->listener_s.queue)->con_req;
 	
 	SOCKET_CB* client_peer = con_req->peer;
-	Fid_t server_peer_fid = sys_Socket(server->port);
 
-	if(server_peer_fid == NOFILE){
-		SCB_decref(server);
+	/* A concurrent Close() of the new fid cannot free it, as we hold port_mutex */
+	SOCKET_CB* server_peer = socket_create(server->port, &server_peer_fid);
+
+	if(server_peer == NULL){
 		kernel_signal(&con_req->connected_cv);
-		return NOFILE;
+		goto finish;
 	}
 
 	con_req->admitted = 1;
 
-	SOCKET_CB* server_peer = get_SCB(server_peer_fid);
-
-	//init pipe_cb1
+	//init the pipes; their buffers are allocated on the first write
 	PIPE_CB* pipe_cb1 = (PIPE_CB*)xmalloc(sizeof(PIPE_CB));
+	pipe_init(pipe_cb1, client_peer->fcb, server_peer->fcb);
 
-	if(pipe_cb1 == NULL)
-		return NOFILE;
-
-	FCB* fcb[2];
-
-	fcb[0] = client_peer->fcb;
-	fcb[1] = server_peer->fcb;
-
-	pipe_cb1->has_space = COND_INIT;
-	pipe_cb1->has_data = COND_INIT;
-	pipe_cb1->r_position = 0;
-	pipe_cb1->w_position = 0;
-	pipe_cb1->reader = fcb[0];
-	pipe_cb1->writer = fcb[1];
-	pipe_cb1->space = PIPE_BUFFER_SIZE;
-
-	//init pipe_cb2
 	PIPE_CB* pipe_cb2 = (PIPE_CB*)xmalloc(sizeof(PIPE_CB));
-
-	if(pipe_cb2 == NULL)
-		return NOFILE;
-
-	//FCB* fcb[2];
-
-	fcb[0] = server_peer->fcb;
-	fcb[1] = client_peer->fcb;
-
-	pipe_cb2->has_space = COND_INIT;
-	pipe_cb2->has_data = COND_INIT;
-	pipe_cb2->r_position = 0;
-	pipe_cb2->w_position = 0;
-	pipe_cb2->reader = fcb[0];
-	pipe_cb2->writer = fcb[1];
-	pipe_cb2->space = PIPE_BUFFER_SIZE;
+	pipe_init(pipe_cb2, server_peer->fcb, client_peer->fcb);
 
 	//connect peers
 	server_peer->type = SOCKET_PEER;
@@ -146,7 +160,9 @@ Fid_t sys_Accept(Fid_t lsock)
 
 	kernel_signal(&con_req->connected_cv);
 
+finish:
 	SCB_decref(server);
+	Mutex_Unlock(&port_mutex);
 
 	return server_peer_fid;
 }
@@ -158,15 +174,20 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 
 	if(peer == NULL)
 		return -1;
-	if(peer->type != SOCKET_UNBOUND)
-		return -1;
-	if(port <= 0 || port >= MAX_PORT)
+	if(port <= 0 || port >= MAX_PORT) {
+		put_SCB(peer);
 		return -1;
+	}
+
+	Mutex_Lock(&port_mutex);
 
 	SOCKET_CB* server = PORT_MAP[port];
 
-	if(server == NULL || server->type != SOCKET_LISTENER)
+	if(peer->type != SOCKET_UNBOUND || server == NULL || server->type != SOCKET_LISTENER) {
+		Mutex_Unlock(&port_mutex);
+		put_SCB(peer);
 		return -1;
+	}
 
 	CON_REQ* con_req = (CON_REQ*)xmalloc(sizeof(CON_REQ));
 	con_req->admitted = 0;
@@ -180,24 +201,24 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 	peer->refcount++;
 
 	if(timeout > 0){
-		kernel_timedwait(&con_req->connected_cv, SCHED_IO, timeout);
+		/* The timeout is in msec, the wait is in usec */
+		kernel_timedwait(&port_mutex, &con_req->connected_cv, SCHED_IO, timeout*1000ul);
 	}
 	else{
-		kernel_wait(&con_req->connected_cv, SCHED_IO);
+		kernel_wait(&port_mutex, &con_req->connected_cv, SCHED_IO);
 	}
 
 	SCB_decref(peer);
 
-	if(con_req->admitted == 0){
-		rlist_remove(&con_req->queue_node);
-		free(con_req);
-		return -1;
-	}
+	int admitted = con_req->admitted;
 
 	rlist_remove(&con_req->queue_node);
 	free(con_req);	
 
-	return 0;
+	Mutex_Unlock(&port_mutex);
+	put_SCB(peer);
+
+	return admitted ? 0 : -1;
 }
 
 
@@ -205,8 +226,16 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 {
 	SOCKET_CB* socket_cb = get_SCB(sock);
 
-	if(socket_cb == NULL || socket_cb->type != SOCKET_PEER)
+	if(socket_cb == NULL)
+		return -1;
+
+	Mutex_Lock(&port_mutex);
+
+	if(socket_cb->type != SOCKET_PEER) {
+		Mutex_Unlock(&port_mutex);
+		put_SCB(socket_cb);
 		return -1;
+	}
 
 	switch(how){
 		case SHUTDOWN_READ:
@@ -225,24 +254,50 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 			break;
 	}
 
+	Mutex_Unlock(&port_mutex);
+	put_SCB(socket_cb);
 	return 0;
 }
 
+static PIPE_CB* socket_read_pipe(void* socketcb_t){
+
+	SOCKET_CB* socket_cb = (SOCKET_CB*) socketcb_t;
+
+	Mutex_Lock(&port_mutex);
+	PIPE_CB* pipe_cb = (socket_cb->type == SOCKET_PEER) ? socket_cb->peer_s.read_pipe : NULL;
+	if(pipe_cb != NULL)
+		pipe_incref(pipe_cb);
+	Mutex_Unlock(&port_mutex);
+
+	return pipe_cb;
+}
+
+static PIPE_CB* socket_write_pipe(void* socketcb_t){
+
+	SOCKET_CB* socket_cb = (SOCKET_CB*) socketcb_t;
+
+	Mutex_Lock(&port_mutex);
+	PIPE_CB* pipe_cb = (socket_cb->type == SOCKET_PEER) ? socket_cb->peer_s.write_pipe : NULL;
+	if(pipe_cb != NULL)
+		pipe_incref(pipe_cb);
+	Mutex_Unlock(&port_mutex);
+
+	return pipe_cb;
+}
+
 int socket_read(void* socketcb_t, char *buf, unsigned int size){
 
 	if(socketcb_t == NULL)
 		return -1;
 
-	SOCKET_CB* socket_cb = (SOCKET_CB*) socketcb_t;
+	PIPE_CB* pipe_cb = socket_read_pipe(socketcb_t);
 
-	if(socket_cb->type != SOCKET_PEER )
-		return -1;
-	if(socket_cb->peer_s.read_pipe == NULL)
+	if(pipe_cb == NULL)
 		return -1;
 
-	PIPE_CB* pipe_cb = socket_cb->peer_s.read_pipe;
-
-	return pipe_read(pipe_cb, buf, size);
+	int retcode = pipe_read(pipe_cb, buf, size);
+	pipe_decref(pipe_cb);
+	return retcode;
 }
 
 int socket_write(void* socketcb_t, const char *buf, unsigned int size){
@@ -250,16 +305,14 @@ int socket_write(void* socketcb_t, const char *buf, unsigned int size){
 	if(socketcb_t == NULL)
 		return -1;
 	
-	SOCKET_CB* socket_cb = (SOCKET_CB*) socketcb_t;
-	
-	if(socket_cb->type != SOCKET_PEER)
-		return -1;
-	if(socket_cb->peer_s.write_pipe == NULL)
-		return -1;
+	PIPE_CB* pipe_cb = socket_write_pipe(socketcb_t);
 
-	PIPE_CB* pipe_cb = socket_cb->peer_s.write_pipe;
+	if(pipe_cb == NULL)
+		return -1;
 
-	return pipe_write(pipe_cb, buf, size);
+	int retcode = pipe_write(pipe_cb, buf, size);
+	pipe_decref(pipe_cb);
+	return retcode;
 }
 
 int socket_close(void* _socketcb){
@@ -269,6 +322,8 @@ int socket_close(void* _socketcb){
 	
 	SOCKET_CB* socket_cb = (SOCKET_CB*) _socketcb;
 
+	Mutex_Lock(&port_mutex);
+
 	switch(socket_cb->type){
 		case SOCKET_PEER:
 			pipe_reader_close(socket_cb->peer_s.read_pipe);
@@ -288,19 +343,42 @@ int socket_close(void* _socketcb){
 
 	SCB_decref(socket_cb);
 
+	Mutex_Unlock(&port_mutex);
+
 	return 0;
 }
 
+/*
+  Return the socket at fid sock, or NULL if it is not a socket. This 
+  takes a reference to the FCB of the socket, so that a concurrent 
+  Close() cannot free the socket; release it with put_SCB. 
+ */
 SOCKET_CB* get_SCB(Fid_t sock){
 
-	FCB* fcb = get_fcb(sock);
+	FCB* fcb = get_fcb_ref(sock);
 
-	if(fcb == NULL || sock < 0 || sock > MAX_FILEID)
+	if(fcb == NULL)
 		return NULL;
 
+	if(fcb->streamfunc != &socket_file_ops) {
+		FCB_decref(fcb);
+		return NULL;
+	}
+
 	return fcb->streamobj;
 }
 
+/*
+  Drop the reference taken by get_SCB. This may close the socket, so
+  it must not be called with port_mutex held.
+ */
+void put_SCB(SOCKET_CB* socket_cb){
+	FCB_decref(socket_cb->fcb);
+}
+
+/*
+  Must be called with port_mutex held
+*/
 void SCB_decref(SOCKET_CB* socket_cb){
 
 	socket_cb->refcount--;
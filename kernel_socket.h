@@ -71,6 +71,8 @@ void SCB_decref(SOCKET_CB* socket_cb);
 
 SOCKET_CB* get_SCB(Fid_t sock);
 
+void put_SCB(SOCKET_CB* socket_cb);
+
 int socket_read(void* socketcb_t, char *buf, unsigned int size);
 
 int socket_write(void* socketcb_t, const char *buf, unsigned int size);
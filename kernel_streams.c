@@ -10,11 +10,19 @@
 
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
+static Mutex FCB_freelist_mutex = MUTEX_INIT;
+
+/* 
+  Released FCBs wait in limbo, in release order, until no lock-free
+  lookup (see get_fcb_ref) may still see them. 
+ */
+static rlnode FCB_limbo;
 
 
 void initialize_files()
 {
   rlnode_init(&FCB_freelist,NULL);
+  rlnode_init(&FCB_limbo,NULL);
   for(int i=0;i<MAX_FILES;i++) {
 
     FT[i].refcount = 0;
@@ -26,32 +34,54 @@ void initialize_files()
 
 FCB* acquire_FCB()
 {
+  FCB* fcb = NULL;
+  Mutex_Lock(&FCB_freelist_mutex);
+
+  /* Move the expired FCBs from the limbo to the free list */
+  while(! is_rlist_empty(& FCB_limbo) && epoch_expired(FCB_limbo.next->fcb->retired))
+    rlist_push_back(& FCB_freelist, rlist_pop_front(& FCB_limbo));
+
   if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+    fcb = rlist_pop_front(& FCB_freelist)->fcb;
     fcb->refcount = 0;
-    return fcb;
   }
-  else
-    return NULL;
+  Mutex_Unlock(&FCB_freelist_mutex);
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
-  rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  Mutex_Lock(&FCB_freelist_mutex);
+  fcb->retired = epoch_now();
+  rlist_push_back(& FCB_limbo, & fcb->freelist_node);
+  Mutex_Unlock(&FCB_freelist_mutex);
 }
 
 
+/*
+  The reference count is updated atomically, since the FIDTs of 
+  different processes share FCBs but are locked separately.
+ */
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(&fcb->refcount, 1, __ATOMIC_RELAXED);
+}
+
+int FCB_tryref(FCB* fcb)
+{
+  uint r = __atomic_load_n(&fcb->refcount, __ATOMIC_RELAXED);
+  while(r != 0)
+    if(__atomic_compare_exchange_n(&fcb->refcount, &r, r+1, 0, 
+        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return 1;
+  return 0;
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  if(__atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
     int retval = fcb->streamfunc->Close(fcb->streamobj);
     release_FCB(fcb);
     return retval;
@@ -62,12 +92,33 @@ int FCB_decref(FCB* fcb)
 
 
 
+/*
+  The FIDT slots are read without locking, and written with atomic 
+  stores under the PCB lock. 
+
+  A slot reserved by FCB_reserve holds an FCB with no references, so 
+  that lookups skip it until FCB_install gives it the reference of the
+  slot, after the stream is set up.
+ */
+static inline FCB* fidt_load(PCB* pcb, Fid_t fid)
+{
+  return __atomic_load_n(&pcb->FIDT[fid], __ATOMIC_ACQUIRE);
+}
+
+static inline void fidt_store(PCB* pcb, Fid_t fid, FCB* fcb)
+{
+  __atomic_store_n(&pcb->FIDT[fid], fcb, __ATOMIC_RELEASE);
+}
+
+
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
     size_t f=0;
     uint i;
 
+    Mutex_Lock(&cur->lock);
+
     /* Find distinct fids */
     for(i=0; i<num; i++) {
 	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
@@ -75,7 +126,7 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	if(f==MAX_FILEID) break;
 	fid[i] = f; f++;
     }
-    if(i<num) return 0;
+    if(i<num) goto fail;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,26 +137,41 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	goto fail;
     }
     /* Found all */
-    for(i=0;i<num;i++) {
-	cur->FIDT[fid[i]]=fcb[i];
-	FCB_incref(fcb[i]);
-    }
+    for(i=0;i<num;i++)
+	fidt_store(cur, fid[i], fcb[i]);
+    Mutex_Unlock(&cur->lock);
     return 1;
+
+fail:
+    Mutex_Unlock(&cur->lock);
+    return 0;
 }
 
 
 
+void FCB_install(size_t num, Fid_t *fid, FCB** fcb)
+{
+    for(size_t i=0; i<num ; i++) {
+	assert(fidt_load(CURPROC, fid[i])==fcb[i]);
+	__atomic_store_n(&fcb[i]->refcount, 1, __ATOMIC_RELEASE);
+    }
+}
+
+
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(&cur->lock);
     for(size_t i=0; i<num ; i++) {
 	assert(cur->FIDT[fid[i]]==fcb[i]);
-	cur->FIDT[fid[i]] = NULL;
+	fidt_store(cur, fid[i], NULL);
+	fcb[i]->refcount = 0;
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(&cur->lock);
 }
 
 
@@ -121,40 +187,43 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 
 
 FCB* get_fcb(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+  return fidt_load(CURPROC, fid);
+}
+
+
+FCB* get_fcb_ref(Fid_t fid)
 {
   if(fid < 0 || fid >= MAX_FILEID) return NULL;
 
-  return CURPROC->FIDT[fid];
+  PCB* cur = CURPROC;
+  int epoch = epoch_enter();
+  FCB* fcb = fidt_load(cur, fid);
+  if(fcb && ! FCB_tryref(fcb))
+    fcb = NULL;
+  epoch_exit(epoch);
+  return fcb;
 }
 
 
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devread)(void*,char*,uint);
-  void* sobj;
 
-  
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the stream, making sure that it will not be closed 
+     (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
-    sobj = fcb->streamobj;
-    devread = fcb->streamfunc->Read;
+    int (*devread)(void*,char*,uint) = fcb->streamfunc->Read;
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
     if(devread)
-      retcode = devread(sobj, buf, size);
+      retcode = devread(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
 
   return retcode;
 }
@@ -163,32 +232,21 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
 int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devwrite)(void*, const char*, uint) = NULL;
-  void* sobj = NULL;
 
-  
-  /* Get the fields from the stream */
-  FCB* fcb = get_fcb(fd);
+  /* Get the stream, making sure that it will not be closed 
+     (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
 
   if(fcb) {
-
-    sobj = fcb->streamobj;
-    devwrite = fcb->streamfunc->Write;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
+    int (*devwrite)(void*, const char*, uint) = fcb->streamfunc->Write;
 
     if(devwrite)
-      retcode = devwrite(sobj, buf, size);
+      retcode = devwrite(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
-
   }
 
-
   return retcode;
 }
 
@@ -196,13 +254,21 @@ int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 int sys_Close(int fd)
 {
   int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
+  if(retcode) return retcode;
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+  FCB* fcb = cur->FIDT[fd];
+  /* A reserved slot is not open yet */
+  if(fcb && __atomic_load_n(&fcb->refcount, __ATOMIC_ACQUIRE) == 0)
+    fcb = NULL;
+  else
+    fidt_store(cur, fd, NULL);
+  Mutex_Unlock(&cur->lock);
 
-  FCB* fcb = get_fcb(fd);
-
-  if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
+  /* The last reference may close the stream, which can block */
+  if(fcb)
     retcode = FCB_decref(fcb);    
-  }
 
   return retcode;
 }
@@ -221,18 +287,31 @@ int sys_Dup2(int oldfd, int newfd)
   if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+
+  FCB* old = cur->FIDT[oldfd];
+  FCB* new = cur->FIDT[newfd];
 
-  if(old==NULL) {
+  /* Reserved slots are not open yet, and cannot be replaced */
+  if(old==NULL || (new && __atomic_load_n(&new->refcount, __ATOMIC_ACQUIRE) == 0)) {
     retcode = -1;
+    new = NULL;
   }
-  else if(old!=new) {
-    if(new)
-      FCB_decref(new);
-    FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+  else if(old==new)
+    new = NULL;
+  else if(! FCB_tryref(old)) {
+    retcode = -1;
+    new = NULL;
   }
+  else
+    fidt_store(cur, newfd, old);
+
+  Mutex_Unlock(&cur->lock);
+
+  /* Drop the replaced stream outside the lock */
+  if(new)
+    FCB_decref(new);
 
   return retcode;
 }
@@ -261,6 +340,7 @@ Fid_t open_stream(Device_type major, unsigned int minor)
       FCB_unreserve(1, &fid, &fcb);
       goto finerr;
   }
+  FCB_install(1, &fid, &fcb);
   
   goto finok;
 finerr:
@@ -281,3 +361,15 @@ Fid_t sys_OpenTerminal(unsigned int termno)
   return open_stream(DEV_SERIAL, termno);
 }
 
+
+int sys_IsTerminal(Fid_t fd)
+{
+  FCB* fcb = get_fcb_ref(fd);
+  if(fcb == NULL)
+    return -1;
+
+  int retcode = (fcb->streamfunc == device_fops(DEV_SERIAL));
+  FCB_decref(fcb);
+  return retcode;
+}
+
@@ -4,7 +4,12 @@
 #include "tinyos.h"
 #include "kernel_dev.h"
 
+/** @brief The default capacity of a pipe (see @c SetPipeSize) */
 #define PIPE_BUFFER_SIZE 16384
+/** @brief The smallest buffer (and capacity) of a pipe; a power of 2 */
+#define PIPE_MIN_BUFFER 1024
+/** @brief The largest capacity of a pipe */
+#define PIPE_MAX_BUFFER (1<<20)
 /**
 	@file kernel_streams.h
 	@brief Support for I/O streams.
@@ -21,8 +26,10 @@
 
 	The streams of each process are held in the file table of the
 	PCB of the process. The system calls generally use the API
-	of this file to access FCBs: @ref get_fcb, @ref FCB_reserve
-	and @ref FCB_unreserve.
+	of this file to access FCBs: @ref get_fcb, @ref get_fcb_ref, 
+	@ref FCB_reserve, @ref FCB_install and @ref FCB_unreserve. The file table of a PCB
+	is protected by the PCB lock, and the reference count of an FCB 
+	is updated atomically.
 
 	Streams are connected to devices by virtue of a @c file_operations
 	object, which provides pointers to device-specific implementations
@@ -44,7 +51,8 @@ typedef struct file_control_block
   uint refcount;  			/**< @brief Reference counter. */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
-  rlnode freelist_node;		/**< @brief Intrusive list node */
+  rlnode freelist_node;		/**< @brief Intrusive node for the free list, or the limbo list */
+  unsigned long retired;	/**< @brief The epoch stamp of a released FCB (see epoch_now) */
 } FCB;
 
 
@@ -54,18 +62,43 @@ typedef struct file_control_block
 
 */
 
+/*
+	The buffer of a pipe is a ring, allocated on the first write. It grows 
+	(up to a power of 2 above the capacity) as the data in the pipe 
+	increases, and it shrinks when the pipe is drained after a period of 
+	lower load. It is released when the pipe is no longer usable.
+ */
 typedef struct pipe_control_block{
 
 	FCB *reader, *writer;
+	Mutex lock;       /**< @brief Protects the rest of the pipe */
 	CondVar has_space;
 	CondVar has_data;
-	int w_position, r_position;
-	char BUFFER[PIPE_BUFFER_SIZE];
+	unsigned int w_position, r_position;
+	char* BUFFER;     /**< @brief The ring buffer, or NULL */
+	unsigned int size;      /**< @brief The size of BUFFER, a power of 2 (or 0) */
 
-	int space; //available space
+	unsigned int count;     /**< @brief The bytes of data in the pipe */
+	unsigned int capacity;  /**< @brief Writers block while @c count reaches this */
+	unsigned int peak;      /**< @brief The maximum @c count since the pipe was last empty */
+
+	unsigned int refcount;  /**< @brief One per open end, plus one per @ref pipe_incref */
 	
 } PIPE_CB;
 
+/** @brief Initialize a pipe between two streams, with an unallocated buffer. 
+
+  The pipe holds a reference for each of its ends, which is dropped by
+  @ref pipe_reader_close and @ref pipe_writer_close.
+ */
+void pipe_init(PIPE_CB* pipe_cb, FCB* reader, FCB* writer);
+
+/** @brief Take a reference to a pipe, keeping it allocated after its ends close. */
+void pipe_incref(PIPE_CB* pipe_cb);
+
+/** @brief Drop a reference to a pipe, freeing it with the last one. */
+void pipe_decref(PIPE_CB* pipe_cb);
+
 int pipe_write(void* pipecb_t, const char *buf, unsigned int size);
 
 int pipe_read(void* pipecb_t, char *buf, unsigned int size);
@@ -90,6 +123,18 @@ void initialize_files();
 void FCB_incref(FCB* fcb);
 
 
+/**
+	@brief Increase the reference count of an fcb, unless it is 0
+
+	A count of 0 means that the fcb is closed, or that its fid is 
+	reserved but not installed yet (see @ref FCB_reserve).
+
+	@param fcb the fcb whose reference count will be increased
+	@returns 1 if a reference was taken, else 0
+*/
+int FCB_tryref(FCB* fcb);
+
+
 /**
 	@brief Decrease the reference count of the fcb.
 
@@ -113,8 +158,11 @@ int FCB_decref(FCB* fcb);
    If not, the state is unchanged (but the array contents
    may have been overwritten).
 
-   If these resources are not needed, the operation can be
-   reversed by calling @ref FCB_unreserve.
+   The fids are reserved, but they are not open yet: lookups 
+   (e.g., by a concurrent @c Read of another thread) do not find 
+   them. After setting up the streams of the FCBs, the caller must 
+   call @ref FCB_install. If these resources are not needed, the 
+   operation can be reversed by calling @ref FCB_unreserve.
 
    @param num the number of resources to reserve.
    @param fid array of size at least `num` of `Fid_t`.
@@ -124,6 +172,18 @@ int FCB_decref(FCB* fcb);
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
 
 
+/** @brief Open the fids reserved by @ref FCB_reserve.
+
+   This publishes the FCBs, whose @c streamobj and @c streamfunc must
+   be set up, at their fids, with a reference count of 1.
+
+   @param num the number of resources to install.
+   @param fid array of size at least `num` of `Fid_t`.
+   @param fcb array of size at least `num` of `FCB*`.
+*/
+void FCB_install(size_t num, Fid_t *fid, FCB** fcb);
+
+
 /** @brief Release a number of FCBs and corresponding fids.
 
    Given an array of fids of size @ num, this function will 
@@ -146,7 +206,9 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 /** @brief Translate an fid to an FCB.
 
-	This routine will return NULL if the fid is not legal.
+	This routine will return NULL if the fid is not legal. The lookup
+	takes no lock; the returned FCB may be closed at any time by another
+	thread, unless the caller otherwise holds a reference to it.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
@@ -154,6 +216,21 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Translate an fid to an FCB, taking a reference to it.
+
+	Like @ref get_fcb, but the reference count of the returned FCB 
+	is increased, so that another thread cannot close it while it is 
+	used. The lookup takes no lock: it runs in an epoch read-side section
+	(see epoch_enter), and a stream whose last reference is being dropped
+	is treated as closed. The caller must drop the reference with 
+	@ref FCB_decref.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL.
+ */
+FCB* get_fcb_ref(Fid_t fid);
+
+
 /** @} */
 
 #endif
@@ -11,24 +11,31 @@ SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(CreateThreadStack, Tid_t, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
+SYSCALL(ThreadSetDeadline, int, (unsigned long runtime, unsigned long period), (runtime, period))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
+SYSCALL(IsTerminal, int, (Fid_t fd), (fd))\
 SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL(Splice, int, (Fid_t in, Fid_t out, unsigned int size), (in, out, size))\
+SYSCALL(SetPipeSize, int, (Fid_t fd, unsigned int size), (fd, size))\
+SYSCALL(GetPipeMemory, unsigned long, (), ())\
 SYSCALL(Socket, Fid_t, (port_t port), (port))\
 SYSCALL(Listen, int, (Fid_t sock), (sock))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(OpenLockInfo, Fid_t, (), ())\
 
 
 
@@ -34,10 +34,20 @@ Allages pou exoun ginei
   @brief Create a new thread in the current process.
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
+{
+  return sys_CreateThreadStack(task, argl, args, 0);
+}
+
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+  */
+Tid_t sys_CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size)
 {
 
   /*Init and return a new TCB*/
-  TCB* tcb = spawn_thread(CURPROC, start_thread);
+  TCB* tcb = spawn_thread(CURPROC, start_thread, stack_size);
+  if(tcb == NULL)
+    return NOTHREAD;
   
   /*Acquire a PTCB*/
   PTCB* ptcb = (PTCB*)xmalloc(sizeof(PTCB)); //Allocate space
@@ -47,9 +57,6 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
   ptcb->tcb = tcb;
 
   rlnode_init(&ptcb->ptcb_list_node, ptcb);
-  rlist_push_back(&CURPROC->ptcb_list, &ptcb->ptcb_list_node);
-
-  CURPROC->thread_count++;
 
   /*Init PTCB*/
   ptcb->task = task;
@@ -63,6 +70,12 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
   ptcb->exit_cv = COND_INIT;
   
   ptcb->refcount = 1;
+
+  PCB* curproc = CURPROC;
+  Mutex_Lock(&curproc->lock);
+  rlist_push_back(&curproc->ptcb_list, &ptcb->ptcb_list_node);
+  curproc->thread_count++;
+  Mutex_Unlock(&curproc->lock);
   
   /*Wake up TCB*/
   wakeup(ptcb->tcb);
@@ -83,27 +96,32 @@ Tid_t sys_ThreadSelf()
   */
 int sys_ThreadJoin(Tid_t tid, int* exitval)
 {
+  PCB* curproc = CURPROC;
+  int ret = -1;
+
+  Mutex_Lock(&curproc->lock);
+
   /*Checks*/
   PTCB* ptcb = NULL;
 
-  if(rlist_find(&CURPROC->ptcb_list, (PTCB*)tid, NULL) != NULL) //Check if tid exists in ptcb_list
+  if(rlist_find(&curproc->ptcb_list, (PTCB*)tid, NULL) != NULL) //Check if tid exists in ptcb_list
     ptcb = (PTCB*)tid;
   if(ptcb == NULL)
-    return -1;
+    goto finish;
   if(sys_ThreadSelf() == tid) //Check if trying to join itself
-    return -1;
+    goto finish;
  
   /*Wait*/
   ptcb->refcount++;
   
   while(ptcb->exited != 1 && ptcb->detached != 1){
-    kernel_wait(&ptcb->exit_cv, SCHED_USER);
+    kernel_wait(&curproc->lock, &ptcb->exit_cv, SCHED_USER);
   }
 
   ptcb->refcount--;
 
   if(ptcb->detached)  //Check if detached
-    return -1;
+    goto finish;
 
   if(exitval!=NULL)
     *exitval=ptcb->exitval;
@@ -114,7 +132,11 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
     free(ptcb);
   }
 
-  return 0;
+  ret = 0;
+
+finish:
+  Mutex_Unlock(&curproc->lock);
+  return ret;
 }
 
 /**
@@ -122,20 +144,35 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   */
 int sys_ThreadDetach(Tid_t tid)
 {
+  PCB* curproc = CURPROC;
+  int ret = -1;
+
+  Mutex_Lock(&curproc->lock);
+
 	PTCB* ptcb = NULL;
 
-  if(rlist_find(&CURPROC->ptcb_list, (PTCB*)tid, NULL) != NULL) //Check if tid exists in ptcb_list
+  if(rlist_find(&curproc->ptcb_list, (PTCB*)tid, NULL) != NULL) //Check if tid exists in ptcb_list
     ptcb = (PTCB*)tid;
   if(ptcb == NULL)
-    return -1;
+    goto finish;
   if(ptcb->exited == 1) //Check if exited
-    return -1;
+    goto finish;
 
   ptcb->detached = 1; //Detach thread
   kernel_broadcast(&ptcb->exit_cv);
+  ret = 0;
 
-  return 0;
+finish:
+  Mutex_Unlock(&curproc->lock);
+  return ret;
+}
 
+/**
+  @brief Make the current thread a deadline thread.
+  */
+int sys_ThreadSetDeadline(unsigned long runtime, unsigned long period)
+{
+  return sched_set_deadline(runtime, period);
 }
 
 /**
@@ -143,77 +180,79 @@ int sys_ThreadDetach(Tid_t tid)
   */
 void sys_ThreadExit(int exitval)
 {
+  PCB *curproc = CURPROC;  /* cache for efficiency */
   PTCB* ptcb = cur_thread()->ptcb;
+
+  Mutex_Lock(&curproc->lock);
+
   ptcb->exited = 1;
   ptcb->exitval=exitval;
 
   kernel_broadcast(&ptcb->exit_cv);
 
+  curproc->thread_count--;
 
-  PCB *curproc = CURPROC;  /* cache for efficiency */
+  if(curproc->thread_count != 0) {
+    /* Other threads remain, the process lives on */
+    sleep_releasing(EXITED, &curproc->lock, SCHED_USER, NO_TIMEOUT);
+    return;
+  }
 
-  curproc->thread_count--;
+  Mutex_Unlock(&curproc->lock);
 
-  if(curproc->thread_count == 0){
+  /* 
+   Do all the other cleanup we want here, close files etc. 
+   We are the last thread, so nobody else touches the PCB.
+  */
 
-    /* Reparent any children of the exiting process to the 
-       initial task */
-    
-    if(get_pid(CURPROC)!=1){
-
-        PCB* initpcb = get_pcb(1);
-        
-        while(!is_rlist_empty(& curproc->children_list)) {
-          rlnode* child = rlist_pop_front(& curproc->children_list);
-          child->pcb->parent = initpcb;
-          rlist_push_front(& initpcb->children_list, child);
-        }
-
-        /* Add exited children to the initial task's exited list 
-           and signal the initial task */
-        if(!is_rlist_empty(& curproc->exited_list)) {
-          rlist_append(& initpcb->exited_list, &curproc->exited_list);
-          kernel_broadcast(& initpcb->child_exit);
-        }
-
-        /* Put me into my parent's exited list */
-        
-        rlist_push_front(& curproc->parent->exited_list, &curproc->exited_node);
-        kernel_broadcast(& curproc->parent->child_exit);
-      
+  /* The args data is released with the PCB, since OpenInfo streams may read it */
+
+  /* Clean up FIDT */
+  for(int i=0;i<MAX_FILEID;i++) {
+    FCB* fcb = curproc->FIDT[i];
+    if(fcb != NULL) {
+      __atomic_store_n(&curproc->FIDT[i], NULL, __ATOMIC_RELEASE);
+      FCB_decref(fcb);
     }
-    assert(is_rlist_empty(& curproc->children_list));
-    assert(is_rlist_empty(& curproc->exited_list));
+  }
 
-    /* 
-     Do all the other cleanup we want here, close files etc. 
-    */
+  /* Disconnect my main_thread */
+  curproc->main_thread = NULL;
 
-    /* Release the args data */
-    if(curproc->args) {
-     free(curproc->args);
-     curproc->args = NULL;
-    }
+  Mutex_Lock(&process_table_mutex);
 
-    /* Clean up FIDT */
-    for(int i=0;i<MAX_FILEID;i++) {
-      if(curproc->FIDT[i] != NULL) {
-        FCB_decref(curproc->FIDT[i]);
-        curproc->FIDT[i] = NULL;
+  /* Reparent any children of the exiting process to the 
+     initial task */
+  
+  if(get_pid(curproc)!=1){
+
+      PCB* initpcb = get_pcb(1);
+      
+      while(!is_rlist_empty(& curproc->children_list)) {
+        rlnode* child = rlist_pop_front(& curproc->children_list);
+        child->pcb->parent = initpcb;
+        rlist_push_front(& initpcb->children_list, child);
       }
-    }
 
-    /* Disconnect my main_thread */
-    curproc->main_thread = NULL;
+      /* Add exited children to the initial task's exited list 
+         and signal the initial task */
+      if(!is_rlist_empty(& curproc->exited_list)) {
+        rlist_append(& initpcb->exited_list, &curproc->exited_list);
+        kernel_broadcast(& initpcb->child_exit);
+      }
 
-    /* Now, mark the process as exited. */
-    curproc->pstate = ZOMBIE;
+      /* Put me into my parent's exited list */
+      
+      rlist_push_front(& curproc->parent->exited_list, &curproc->exited_node);
+      kernel_broadcast(& curproc->parent->child_exit);
     
-    //kernel_sleep(EXITED, SCHED_USER);
-
   }
+  assert(is_rlist_empty(& curproc->children_list));
+  assert(is_rlist_empty(& curproc->exited_list));
 
-  kernel_sleep(EXITED, SCHED_USER);
+  /* Now, mark the process as exited. */
+  curproc->pstate = ZOMBIE;
 
+  sleep_releasing(EXITED, &process_table_mutex, SCHED_USER, NO_TIMEOUT);
 }
 
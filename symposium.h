@@ -71,6 +71,12 @@
 */
 extern unsigned int fibo(unsigned int n);
 
+/** @brief Suppress the printing of the philosophers' state, if non-zero.
+
+	This is useful for timing tests. The default is 0.
+*/
+extern int symposium_quiet;
+
 /** @brief A philosopher's state. */
 typedef enum { NOTHERE=0, THINKING, HUNGRY, EATING } PHIL;
 
@@ -4,6 +4,8 @@
 #include <string.h>
 #include <time.h>
 #include <setjmp.h>
+#include <pthread.h>
+#include <sched.h>
 #include "util.h"
 
 #include "unit_testing.h"
@@ -317,17 +319,258 @@ BARE_TEST(test_pack_unpack,"Test packing and unpacking a argvuence of strings in
 
 
 
+
+/*
+	Lock-free queues
+ */
+
+BARE_TEST(test_spsc_ring,
+	"Test the SPSC ring sequentially: fill, drain and wrap around."
+	)
+{
+	void* slots[8];
+	spsc_ring q;
+	spsc_ring_init(&q, slots, 8);
+
+	ASSERT(spsc_ring_pop(&q)==NULL);
+	for(int round=0; round<5; round++) {
+		for(intptr_t i=1; i<=8; i++)
+			ASSERT(spsc_ring_push(&q, (void*)i));
+		ASSERT(! spsc_ring_push(&q, (void*)9));
+		for(intptr_t i=1; i<=8; i++)
+			ASSERT(spsc_ring_pop(&q)==(void*)i);
+		ASSERT(spsc_ring_pop(&q)==NULL);
+
+		/* leave the ring half-full, to move the wrap-around point */
+		for(intptr_t i=1; i<=3; i++) ASSERT(spsc_ring_push(&q, (void*)i));
+		for(intptr_t i=1; i<=3; i++) ASSERT(spsc_ring_pop(&q)==(void*)i);
+	}
+}
+
+
+BARE_TEST(test_mpsc_ring,
+	"Test the MPSC ring sequentially: fill, drain and wrap around."
+	)
+{
+	mpsc_cell cells[4];
+	mpsc_ring q;
+	mpsc_ring_init(&q, cells, 4);
+
+	ASSERT(mpsc_ring_pop(&q)==NULL);
+	for(int round=0; round<5; round++) {
+		for(intptr_t i=1; i<=4; i++)
+			ASSERT(mpsc_ring_push(&q, (void*)i));
+		ASSERT(! mpsc_ring_push(&q, (void*)5));
+		for(intptr_t i=1; i<=4; i++)
+			ASSERT(mpsc_ring_pop(&q)==(void*)i);
+		ASSERT(mpsc_ring_pop(&q)==NULL);
+
+		ASSERT(mpsc_ring_push(&q, (void*)7));
+		ASSERT(mpsc_ring_pop(&q)==(void*)7);
+	}
+}
+
+
+BARE_TEST(test_lf_queue,
+	"Test the intrusive SPSC and MPSC queues sequentially."
+	)
+{
+	qnode nodes[10];
+	for(intptr_t i=0; i<10; i++) qnode_init(&nodes[i], (void*)i);
+
+	spsc_queue sq;
+	spsc_queue_init(&sq);
+	mpsc_queue mq;
+	mpsc_queue_init(&mq);
+
+	ASSERT(lf_queue_empty(&sq) && spsc_queue_pop(&sq)==NULL);
+	ASSERT(lf_queue_empty(&mq) && mpsc_queue_pop(&mq)==NULL);
+
+	for(int round=0; round<3; round++) {
+		for(int i=0; i<5; i++) spsc_queue_push(&sq, &nodes[i]);
+		for(int i=5; i<10; i++) mpsc_queue_push(&mq, &nodes[i]);
+		ASSERT(! lf_queue_empty(&sq) && ! lf_queue_empty(&mq));
+
+		for(int i=0; i<5; i++) {
+			qnode* n = spsc_queue_pop(&sq);
+			ASSERT(n == &nodes[i] && n->obj == (void*)(intptr_t)i);
+		}
+		for(int i=5; i<10; i++)
+			ASSERT(mpsc_queue_pop(&mq) == &nodes[i]);
+
+		ASSERT(spsc_queue_pop(&sq)==NULL && lf_queue_empty(&sq));
+		ASSERT(mpsc_queue_pop(&mq)==NULL && lf_queue_empty(&mq));
+
+		/* A popped node can be pushed again */
+		mpsc_queue_push(&mq, &nodes[0]);
+		ASSERT(mpsc_queue_pop(&mq)==&nodes[0]);
+	}
+}
+
+
+/* 
+	Threaded tests. Each producer pushes the values 1..QCOUNT, tagged with
+	its index in the high bits. The consumer checks that the values of each 
+	producer arrive in order, and that none is lost.
+ */
+
+#define QCOUNT 200000
+#define QPRODUCERS 4
+#define QTAG(p, i)  ((void*)(((intptr_t)(p) << 32) | (i)))
+
+enum qkind { Q_SPSC_RING, Q_MPSC_RING, Q_SPSC_QUEUE, Q_MPSC_QUEUE };
+
+typedef struct {
+	enum qkind kind;
+	spsc_ring sr;
+	mpsc_ring mr;
+	lf_queue q;
+	qnode* nodes[QPRODUCERS];
+	int producers;
+	unsigned long count;
+} qtest;
+
+typedef struct { qtest* t; int id; } qproducer;
+
+static void* qproducer_main(void* arg)
+{
+	qproducer* p = arg;
+	qtest* t = p->t;
+	for(intptr_t i=1; i<=t->count; i++) {
+		void* item = QTAG(p->id, i);
+		switch(t->kind) {
+		case Q_SPSC_RING: while(! spsc_ring_push(&t->sr, item)) sched_yield(); break;
+		case Q_MPSC_RING: while(! mpsc_ring_push(&t->mr, item)) sched_yield(); break;
+		case Q_SPSC_QUEUE: 
+			spsc_queue_push(&t->q, qnode_init(&t->nodes[p->id][i-1], item)); break;
+		case Q_MPSC_QUEUE: 
+			mpsc_queue_push(&t->q, qnode_init(&t->nodes[p->id][i-1], item)); break;
+		}
+	}
+	return NULL;
+}
+
+static void* qtest_pop(qtest* t)
+{
+	switch(t->kind) {
+	case Q_SPSC_RING: return spsc_ring_pop(&t->sr);
+	case Q_MPSC_RING: return mpsc_ring_pop(&t->mr);
+	default: {
+		qnode* n = lf_queue_pop(&t->q);
+		return n ? n->obj : NULL;
+	}
+	}
+}
+
+/* Run the producers and the consumer, return the elapsed time in sec */
+static double qtest_run(enum qkind kind, int producers, unsigned long count)
+{
+	static void* slots[1024];
+	static mpsc_cell cells[1024];
+
+	qtest* t = malloc(sizeof(qtest));
+	t->kind = kind;
+	t->producers = producers;
+	t->count = count;
+	spsc_ring_init(&t->sr, slots, 1024);
+	mpsc_ring_init(&t->mr, cells, 1024);
+	lf_queue_init(&t->q);
+	for(int p=0; p<producers; p++)
+		t->nodes[p] = (kind>=Q_SPSC_QUEUE) ? malloc(count*sizeof(qnode)) : NULL;
+
+	struct timespec t1, t2;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	pthread_t tid[QPRODUCERS];
+	qproducer prod[QPRODUCERS];
+	for(int p=0; p<producers; p++) {
+		prod[p] = (qproducer){ t, p };
+		ASSERT(pthread_create(&tid[p], NULL, qproducer_main, &prod[p])==0);
+	}
+
+	intptr_t next[QPRODUCERS];
+	for(int p=0; p<producers; p++) next[p] = 1;
+	for(unsigned long n = 0; n < producers*count; ) {
+		void* item = qtest_pop(t);
+		if(item == NULL) { sched_yield(); continue; }
+		int p = (intptr_t)item >> 32;
+		ASSERT(p < producers);
+		ASSERT_MSG(item == QTAG(p, next[p]), "producer %d: expected %ld, got %ld\n",
+			p, (long)next[p], (long)((intptr_t)item & 0xffffffff));
+		next[p]++;
+		n++;
+	}
+	ASSERT(qtest_pop(t)==NULL);
+
+	for(int p=0; p<producers; p++) pthread_join(tid[p], NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+
+	for(int p=0; p<producers; p++) free(t->nodes[p]);
+	free(t);
+	return (t2.tv_sec - t1.tv_sec) + 1E-9*(t2.tv_nsec - t1.tv_nsec);
+}
+
+
+BARE_TEST(test_queues_threaded,
+	"Test the lock-free queues with concurrent producers and a consumer."
+	)
+{
+	qtest_run(Q_SPSC_RING, 1, QCOUNT);
+	qtest_run(Q_SPSC_QUEUE, 1, QCOUNT);
+	qtest_run(Q_MPSC_RING, QPRODUCERS, QCOUNT);
+	qtest_run(Q_MPSC_QUEUE, QPRODUCERS, QCOUNT);
+}
+
+
+TEST_SUITE(queue_tests,
+	"Tests for the lock-free queues")
+{
+	&test_spsc_ring,
+	&test_mpsc_ring,
+	&test_lf_queue,
+	&test_queues_threaded,
+	NULL
+};
+
+
+BARE_TEST(bench_queues,
+	"Measure the throughput of the lock-free queues."
+	)
+{
+	const unsigned long count = 2000000;
+	const char* name[] = { "SPSC ring", "MPSC ring", "SPSC queue", "MPSC queue" };
+	for(enum qkind k = Q_SPSC_RING; k <= Q_MPSC_QUEUE; k++) {
+		int producers = (k==Q_MPSC_RING || k==Q_MPSC_QUEUE) ? QPRODUCERS : 1;
+		double T = qtest_run(k, producers, count);
+		MSG("%-10s %d producer(s): %.2f Mops/sec\n", name[k], producers, 1E-6*producers*count/T);
+	}
+}
+
+
 TEST_SUITE(all_tests,
 	"All tests")
 {
 	&rlist_tests,
 	&test_pack_unpack,
+	&queue_tests,
+	NULL
+};
+
+
+TEST_SUITE(benchmarks,
+	"Performance benchmarks. These are not part of all_tests, as they only "
+	"report measurements."
+	)
+{
+	&bench_queues,
 	NULL
 };
 
 
 int main(int argc, char** argv)
 {
-	return register_test(&all_tests) || 
-		run_program(argc, argv, &all_tests);
+	register_test(&all_tests);
+	register_test(&benchmarks);
+	return run_program(argc, argv, &all_tests);
 }
\ No newline at end of file
@@ -72,11 +72,22 @@ typedef uintptr_t Tid_t;
     mutexes are suitable for use in user-space, as well as in the implementation 
     of the kernel.
 
+    A mutex is one word. When locked, it holds the owner thread, plus a flag
+    that is set when some thread may be sleeping, waiting for the mutex.
+
+    @note Earlier versions defined @c Mutex as a @c char, locked by test-and-set.
+    It is now a @c uintptr_t, with the size and alignment of a pointer, so
+    structures that embed mutexes grow, and code built against the old 
+    header must be recompiled. Initialize mutexes only with @ref MUTEX_INIT,
+    and do not read or write the word directly. A mutex is not a FIFO lock: 
+    an unlock wakes one sleeping waiter, which competes with running threads. 
+    The FIFO (ticket) locks of the kernel are the scheduler's @c Spinlock.
+
     @see Mutex_Lock
     @see Mutex_Unlock
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef uintptr_t Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -92,7 +103,9 @@ typedef char Mutex;
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
+  in kernel-space (preemptive domain), the locking will spin only while the owner
+  of the mutex is running on some core; otherwise, the thread sleeps until the 
+  mutex is unlocked.
   In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
 
   @see Mutex
@@ -101,9 +114,23 @@ typedef char Mutex;
   */
 void Mutex_Lock(Mutex*);
 
+#ifdef MUTEX_PROFILE
+/** @brief Lock a mutex, charging the lock statistics to call site @c where.
+
+  When compiled with @c MUTEX_PROFILE, @c Mutex_Lock is a macro that
+  passes its "file:line" to this function.
+  @see OpenLockInfo
+ */
+void Mutex_Lock_at(Mutex*, const char* where);
+#define __MUTEX_STR(line) #line
+#define __MUTEX_SITE(line) __FILE__ ":" __MUTEX_STR(line)
+#define Mutex_Lock(mx) Mutex_Lock_at((mx), __MUTEX_SITE(__LINE__))
+#endif
+
 /** @brief Unlock a mutex that you locked. 
   
-    This operation is non-blocking.
+    This operation is non-blocking. If threads sleep waiting for the mutex,
+    one of them is woken up.
     @see Mutex
     @see Mutex_Lock
 */
@@ -202,6 +229,104 @@ void Cond_Signal(CondVar*);
 void Cond_Broadcast(CondVar*); 
 
 
+/** @brief The number of reader counters of a @c RWLock. */
+#define RWLOCK_SLOTS 8
+
+/** @brief Reader-writer locks.
+
+  A reader-writer lock is held either by any number of readers, or by
+  one writer. It is meant for data that is read much more often than it
+  is written.
+
+  Readers only increment a counter, in one of @c RWLOCK_SLOTS cache lines
+  chosen by the current core, so that readers on different cores do not
+  contend. Writers are preferred: while a writer holds or waits for the
+  lock, new readers wait. The slots are aligned to cache lines; a lock
+  in dynamic memory should be allocated with @c aligned_alloc.
+
+  @see RWLock_ReadLock
+  @see RWLock_WriteLock
+  @see RWLOCK_INIT
+ */
+typedef struct {
+  struct {
+    _Alignas(64) long readers;          /**< Readers counted in this slot (may be negative) */
+    char pad[64-sizeof(long)];          /**< Keep each slot in its own cache line */
+  } slot[RWLOCK_SLOTS];
+  int writers;        /**< Writers holding or waiting for the lock */
+  int owned;          /**< Set while a writer holds the lock */
+  Mutex mx;           /**< Protects `owned` and the sleeping of waiters */
+  CondVar cv;         /**< Waiters sleep here */
+} RWLock;
+
+/** @brief This macro is used to initialize reader-writer locks.
+
+  @code
+  RWLock my_rwlock = RWLOCK_INIT;
+  @endcode
+ */
+#define RWLOCK_INIT ((RWLock){ .writers = 0, .owned = 0, .mx = MUTEX_INIT, .cv = COND_INIT })
+
+/** @brief Lock a reader-writer lock for reading, waiting as long as it takes. */
+void RWLock_ReadLock(RWLock* rw);
+
+/** @brief Lock a reader-writer lock for reading, waiting at most @c timeout milliseconds.
+  @returns 1 if the lock was acquired, 0 if the timeout expired
+ */
+int RWLock_TimedReadLock(RWLock* rw, timeout_t timeout);
+
+/** @brief Unlock a reader-writer lock that you locked for reading. */
+void RWLock_ReadUnlock(RWLock* rw);
+
+/** @brief Lock a reader-writer lock for writing, waiting as long as it takes. */
+void RWLock_WriteLock(RWLock* rw);
+
+/** @brief Lock a reader-writer lock for writing, waiting at most @c timeout milliseconds.
+  @returns 1 if the lock was acquired, 0 if the timeout expired
+ */
+int RWLock_TimedWriteLock(RWLock* rw, timeout_t timeout);
+
+/** @brief Unlock a reader-writer lock that you locked for writing. */
+void RWLock_WriteUnlock(RWLock* rw);
+
+
+/** @brief Counting semaphores.
+
+  A semaphore holds a count of available units. @c Sem_Wait takes a unit,
+  waiting until one is available, and @c Sem_Post returns one. Neither
+  call takes a lock, unless some thread has to sleep.
+
+  @see Sem_Wait
+  @see Sem_Post
+  @see SEMAPHORE_INIT
+ */
+typedef struct {
+  int count;          /**< The available units */
+  int waiters;        /**< The threads waiting for a unit */
+  Mutex mx;           /**< Protects the sleeping of waiters */
+  CondVar cv;         /**< Waiters sleep here */
+} Semaphore;
+
+/** @brief This macro is used to initialize a semaphore with @c n units.
+
+  @code
+  Semaphore my_sem = SEMAPHORE_INIT(4);
+  @endcode
+ */
+#define SEMAPHORE_INIT(n) ((Semaphore){ (n), 0, MUTEX_INIT, COND_INIT })
+
+/** @brief Take a unit from a semaphore, waiting as long as it takes. */
+void Sem_Wait(Semaphore* sem);
+
+/** @brief Take a unit from a semaphore, waiting at most @c timeout milliseconds.
+  @returns 1 if a unit was taken, 0 if the timeout expired
+ */
+int Sem_TimedWait(Semaphore* sem, timeout_t timeout);
+
+/** @brief Return a unit to a semaphore, waking up one waiter (if any). */
+void Sem_Post(Semaphore* sem);
+
+
 /*******************************************
  *
  * Process creation
@@ -319,6 +444,23 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+
+  This is the same as `CreateThread`, except that the new thread's
+  stack will have (at least) `stack_size` bytes. If `stack_size` is 0,
+  the default stack size is used. Stack memory is committed lazily, so
+  a large stack only costs what the thread actually uses. A stack
+  overflow is detected as a segmentation fault.
+
+  @param task a function to execute
+  @param stack_size the requested stack size, in bytes
+  @returns the Tid of the new thread, or NOTHREAD if `stack_size` is
+     too large.
+  @see CreateThread
+  */
+Tid_t CreateThreadStack(Task task, int argl, void* args, unsigned int stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -369,6 +511,26 @@ int ThreadJoin(Tid_t tid, int* exitval);
   */
 int ThreadDetach(Tid_t tid);
 
+/**
+  @brief Make the current thread a real-time (deadline) thread.
+
+  A deadline thread is guaranteed `runtime` microseconds of CPU time in 
+  every `period` microseconds, and is scheduled ahead of all normal 
+  threads, by earliest deadline first. If it tries to use more than 
+  `runtime` in a period, it is suspended until the end of the period.
+
+  The total CPU share requested by all deadline threads is limited,
+  so that some CPU time is always left for normal threads.
+
+  @param runtime the CPU time needed in every period, in microseconds,
+     or 0 to make the current thread a normal thread again
+  @param period the period, in microseconds
+  @returns 0 on success and -1 on error. Possible errors are:
+    - `runtime` is greater than `period`.
+    - the requested CPU share is not available.
+  */
+int ThreadSetDeadline(unsigned long runtime, unsigned long period);
+
 /**
   @brief Terminate the current thread.
   */
@@ -400,6 +562,18 @@ unsigned int GetTerminalDevices();
 Fid_t OpenTerminal(unsigned int termno);
 
 
+/** @brief Check if a file id refers to a terminal.
+
+  This can be used to choose the buffering of a stream (see @c fidopen),
+  like @c isatty() in Unix.
+
+  @param fd the file id to check
+  @return 1 if @c fd is a terminal stream, 0 if it is another stream, 
+    or -1 if @c fd is not a valid file id.
+ */
+int IsTerminal(Fid_t fd);
+
+
 /** @brief Open a stream on the null device.
 
   The null device is a virtual device representing an "infinite"
@@ -517,7 +691,7 @@ typedef struct pipe_s {
 	A pipe is a one-directional buffer accessed via two file ids,
 	one for each end of the buffer. The size of the buffer is 
 	implementation-specific, but can be assumed to be between 4 and 16 
-	kbytes. 
+	kbytes (see @c SetPipeSize). 
 
 	Once a pipe is constructed, it remains operational as long as both
 	ends are open. If the read end is closed, the write end becomes 
@@ -531,6 +705,55 @@ typedef struct pipe_s {
 */
 int Pipe(pipe_t* pipe);
 
+
+/**
+	@brief Move data from one stream to another.
+
+	This call moves up to @c size bytes from stream @c in to stream @c out,
+	as if by a @c Read from @c in into a buffer, followed by a @c Write of 
+	the buffer to @c out. When both streams are pipes or sockets, the data 
+	is moved directly from one pipe buffer to the other. For other streams 
+	(e.g., terminals) the data passes through a small kernel buffer.
+
+	Like @c Read, the call blocks until there is some data to move, and it 
+	may move fewer bytes than @c size, but at least 1. 
+
+	@param in the file id to read from
+	@param out the file id to write to
+	@param size the maximum number of bytes to move
+	@returns the number of bytes moved, 0 if @c in has reached end of file,
+		or -1 on error. Possible reasons for error:
+		- Either @c in or @c out is invalid, or cannot be read (resp. written).
+		- The data could not be written (e.g., the read end of @c out 
+		  is closed). When the data passes through the kernel buffer,
+		  this may happen after some of the data was written; the 
+		  data that was read from @c in but not written is lost.
+ */
+int Splice(Fid_t in, Fid_t out, unsigned int size);
+
+
+/**
+	@brief Set the capacity of the buffers of a pipe or a socket.
+
+	The capacity is the amount of data that a pipe can hold before writers
+	block. The memory for it is allocated as data is written, and it 
+	shrinks when the load drops. For a connected socket, the call sets 
+	the capacity of both directions. The size is adjusted to be between 
+	1 kbyte and 1 Mbyte. The default capacity is 16 kbytes.
+
+	@param fd a file id of a pipe or a connected socket
+	@param size the new capacity, or 0 to leave it unchanged
+	@returns the (new) capacity, or -1 on error. Possible reasons for error:
+		- @c fd is not a valid file id of a pipe or connected socket.
+ */
+int SetPipeSize(Fid_t fd, unsigned int size);
+
+
+/**
+	@brief Return the total memory of the buffers of all pipes and sockets, in bytes.
+ */
+unsigned long GetPipeMemory();
+
 /*******************************************
  *
  * Sockets (local)
@@ -760,6 +983,47 @@ typedef struct procinfo
 Fid_t OpenInfo();
 
 
+/**
+  @brief The max. size of the call site in a lockinfo structure.
+  */
+#define LOCKINFO_MAX_SITE (48)
+
+/**
+	@brief Lock statistics for one @c Mutex_Lock call site.
+
+	This structure is returned by lock information streams.
+	@see OpenLockInfo
+  */
+typedef struct lockinfo
+{
+	char site[LOCKINFO_MAX_SITE];  /**< @brief The call site, as "file:line" */
+	unsigned long acquired;    /**< @brief Acquisitions of a mutex at this site */
+	unsigned long contended;   /**< @brief Acquisitions that found the mutex locked */
+	unsigned long spins;       /**< @brief Spin iterations of contended acquisitions */
+	unsigned long yields;      /**< @brief Times a contended acquisition slept */
+	unsigned long hold_total;  /**< @brief Total time the mutex was held, in microseconds */
+	unsigned long hold_max;    /**< @brief Maximum time the mutex was held, in microseconds */
+} lockinfo;
+
+
+/**
+	@brief Open a lock information stream.
+
+	This is a read-only stream that returns a sequence of @c lockinfo
+	structures, each packed into a block of size @c sizeof(lockinfo), one
+	for each call site of @c Mutex_Lock in the kernel and in user code.
+
+	Lock statistics are only collected when TinyOS is compiled with
+	@c MUTEX_PROFILE (see the Makefile); otherwise, the stream is empty.
+	The statistics are reset at boot, and printed at shutdown.
+
+	@returns a file id on success, or NOFILE on error. Possible reasons
+		for error are:
+		- the available file ids for the process are exhausted.
+ */
+Fid_t OpenLockInfo();
+
+
 
 
 /*******************************************
@@ -780,6 +1044,35 @@ Fid_t OpenInfo();
    */
 void boot(unsigned int ncores, unsigned int terminals, Task boot_task, int argl, void* args);
 
+/** @brief Select the scheduler policy for the next boot.
+
+   The available policies are:
+   - "mlfq", a multi-level feedback queue (the default), and
+   - "fair", a fair-share policy, which runs the thread with the smallest 
+     virtual runtime.
+
+   This must be called before @c boot(). The policy stays in effect for 
+   all subsequent boots.
+
+   @param name the name of the policy
+   @returns 0 on success, or -1 if there is no policy by that name.
+   */
+int set_sched_policy(const char* name);
+
+/** @brief Trace the scheduler during subsequent boots.
+
+   While tracing, each core records the scheduler events (context switches,
+   wakeups, sleeps and priority changes) in a ring of fixed size, keeping 
+   the most recent ones. When the VM shuts down, the trace is written to 
+   `filename`, in the Chrome trace (JSON) format, which can be viewed with
+   `chrome://tracing` or Perfetto.
+
+   This must be called before @c boot().
+
+   @param filename the file to write the trace to, or NULL to stop tracing
+   */
+void set_sched_trace(const char* filename);
+
 
 /** @} */
 
@@ -168,6 +168,7 @@ int SystemInfo(size_t argc, const char** argv)
 {
 	printf("Number of cores         = %d\n", cpu_cores());
 	printf("Number of serial devices= %d\n", bios_serial_ports());
+	printf("Pipe buffer memory      = %lu\n", GetPipeMemory());
 	Fid_t finfo = OpenInfo();
 	if(finfo!=NOFILE) {
 		/* Print per-process info */
@@ -339,6 +340,7 @@ int More(size_t argc, const char** argv)
 			if(count % page == 0) {
 				/* Here, we have to use getline, unless we change terminal */
 				fprintf(fout, "press enter to continue:");
+				fflush(fout);
 				(void)getline(&_line, &_lno, fkbd);
 			}
 		}
@@ -731,7 +733,7 @@ static void send_message(Fid_t sock, void* buf, size_t len)
 	}
 	if(count!=len) {
 		printf("In client: I/O error writing %zu bytes (%zu written)\n", len, count);
-		Exit(1);
+		ExitProgram(1);
 	}
 }
 
@@ -759,15 +761,8 @@ int RemoteClient(size_t argc, const char** argv)
 	send_message(sock, args, argl);
 	ShutDown(sock, SHUTDOWN_WRITE);
 
-	/* Read the server data and display */
-	char c;
-	FILE* fin = fidopen(sock, "r");
-	FILE* fout = fidopen(1, "w");
-	while((c=fgetc(fin))!=EOF) {
-		fputc(c, fout);
-	}
-	fclose(fin);
-	fclose(fout);
+	/* Relay the server data to the output */
+	while(Splice(sock, 1, 4096) > 0);
 	return 0;
 }
 
@@ -903,6 +898,7 @@ int Shell(size_t argc, const char** argv)
 
 		/* Read the command line */
 		fprintf(fout, "%% "); 
+		fflush(fout);
 		ssize_t rc;
 
 		again:
@@ -11,20 +11,55 @@
 
 
 
+/*
+	C streams on file ids.
+
+	The buffer of a stream lives in the process that opened it. Therefore,
+	each buffered stream is registered with its process, so that it can be
+	flushed when the process is done (see fidcloseall and ExitProgram).
+
+	The streams are registered by pid, which is reused. A process that 
+	ends without closing its streams (e.g., by calling Exit) leaves them 
+	registered. When a program started by Execute gets the pid, they are
+	unregistered and closed in discard mode, which drops their output.
+ */
+
+typedef struct fid_stream {
+	Fid_t fid;		/* the tinyos file id */
+	Pid_t owner;		/* the process that opened the stream */
+	int discard;		/* set when the output must be dropped */
+	FILE* file;		/* the C stream */
+	rlnode node;		/* node in fid_streams, if buffered */
+	char buffer[];		/* the stdio buffer */
+} fid_stream;
+
+static rlnode fid_streams = { .prev = &fid_streams, .next = &fid_streams };
+static Mutex fid_streams_mx = MUTEX_INIT;
+
+
 static ssize_t tinyos_fid_read(void *cookie, char *buf, size_t size)
 {
-	return Read(*(Fid_t*)cookie, buf, size); 
+	return Read(((fid_stream*)cookie)->fid, buf, size); 
 }
 
 static ssize_t tinyos_fid_write(void *cookie, const char *buf, size_t size)
 {
-	int ret = Write(*(Fid_t*)cookie, buf, size); 
+	fid_stream* s = cookie;
+	if(s->discard) 
+		return size;
+	int ret = Write(s->fid, buf, size); 
 	return (ret<0) ? 0 : ret;
 }
 
 static int tinyos_fid_close(void* cookie)
 {
-	free(cookie);
+	fid_stream* s = cookie;
+	if(s->node.next != &s->node) {
+		Mutex_Lock(&fid_streams_mx);
+		rlist_remove(&s->node);
+		Mutex_Unlock(&fid_streams_mx);
+	}
+	free(s);
 	return 0;
 }
 
@@ -38,7 +73,11 @@ static cookie_io_functions_t  tinyos_fid_functions =
 
 static FILE* get_std_stream(int fid, const char* mode)
 {
-	FILE* term = fidopen(fid, mode);
+	/* 
+		These streams are shared by all processes, so they cannot buffer 
+		data (which would be written to the file id of another process) 
+	*/
+	FILE* term = fidopen_buffered(fid, mode, 0);
 	assert(term);
 	/* This is glibc-specific and tunrs off fstream locking */
 	__fsetlocking(term, FSETLOCKING_BYCALLER);	
@@ -48,15 +87,94 @@ static FILE* get_std_stream(int fid, const char* mode)
 
 FILE* fidopen(Fid_t fid, const char* mode)
 {
+	return fidopen_buffered(fid, mode, FIDOPEN_BUFSIZ);
+}
 
-	Fid_t* fidloc = (Fid_t *) malloc(sizeof(Fid_t));
-	* fidloc = fid;
-	FILE* f = fopencookie(fidloc, mode, tinyos_fid_functions);
+FILE* fidopen_buffered(Fid_t fid, const char* mode, size_t size)
+{
+	fid_stream* s = (fid_stream*) malloc(sizeof(fid_stream)+size);
+	if(s == NULL)
+		return NULL;
+	s->fid = fid;
+	s->owner = GetPid();
+	s->discard = 0;
+	rlnode_init(&s->node, s);
+
+	FILE* f = fopencookie(s, mode, tinyos_fid_functions);
+	if(f == NULL) {
+		free(s);
+		return NULL;
+	}
+	s->file = f;
 
-	CHECKRC(setvbuf(f, NULL, _IONBF, 0));
+	if(size == 0) {
+		CHECKRC(setvbuf(f, NULL, _IONBF, 0));
+		return f;
+	}
+
+	/* Terminals are interactive, other streams are filled in bulk */
+	int mode_buf = (IsTerminal(fid)==1) ? _IOLBF : _IOFBF;
+	CHECKRC(setvbuf(f, s->buffer, mode_buf, size));
+
+	Mutex_Lock(&fid_streams_mx);
+	rlist_push_back(&fid_streams, &s->node);
+	Mutex_Unlock(&fid_streams_mx);
 	return f;
 }
 
+void fidcloseall()
+{
+	Pid_t pid = GetPid();
+	for(;;) {
+		FILE* f = NULL;
+		Mutex_Lock(&fid_streams_mx);
+		for(rlnode* n = fid_streams.next; n != &fid_streams; n = n->next) {
+			fid_stream* s = n->obj;
+			if(s->owner == pid) { f = s->file; break; }
+		}
+		Mutex_Unlock(&fid_streams_mx);
+
+		if(f == NULL) break;
+		fclose(f);
+	}
+}
+
+/*
+  Free the streams left registered under our pid by an earlier process.
+  Their fids are not ours, so their buffered output is dropped: each one 
+  is unregistered and marked for discarding, and only then closed.
+ */
+static void fiddiscard_stale()
+{
+	Pid_t pid = GetPid();
+	rlnode stale;
+	rlnode_init(&stale, NULL);
+
+	Mutex_Lock(&fid_streams_mx);
+	for(rlnode* n = fid_streams.next; n != &fid_streams; ) {
+		fid_stream* s = n->obj;
+		n = n->next;
+		if(s->owner == pid) {
+			rlist_remove(&s->node);
+			rlist_push_back(&stale, &s->node);
+		}
+	}
+	Mutex_Unlock(&fid_streams_mx);
+
+	while(! is_rlist_empty(&stale)) {
+		fid_stream* s = rlist_pop_front(&stale)->obj;
+		rlnode_init(&s->node, s);
+		s->discard = 1;
+		fclose(s->file);
+	}
+}
+
+void ExitProgram(int exitval)
+{
+	fidcloseall();
+	Exit(exitval);
+}
+
 FILE *saved_in = NULL, *saved_out = NULL;
 
 
@@ -108,8 +226,15 @@ static int exec_wrapper(int argl, void* args)
 	const char* argv[argc];
 	argvunpack(argc, argv, argl, args);
 
+	/* Streams still registered under our pid belong to an earlier process */
+	fiddiscard_stale();
+
 	/* Make the call */
-	return prog(argc, argv);
+	int exitval = prog(argc, argv);
+
+	/* Flush the streams that the program left open */
+	fidcloseall();
+	return exitval;
 }
 
 
@@ -13,14 +13,55 @@
   */
 
 
+/** @brief The default buffer size of streams opened by @ref fidopen. */
+#define FIDOPEN_BUFSIZ 4096
+
 /**
     @brief Open a C stream on a tinyos file descriptor.
 
+	The stream is buffered with a buffer of @ref FIDOPEN_BUFSIZ bytes 
+	(see @ref fidopen_buffered).
+
 	This call returns a new FILE pointer on success and NULL
 	on failure.
 */
 FILE* fidopen(Fid_t fid, const char* mode);
 
+/**
+    @brief Open a C stream on a tinyos file descriptor, with a given buffer size.
+
+	If @c size is 0, the stream is unbuffered, and every character is read 
+	or written by a separate system call. Else, a terminal stream is 
+	line-buffered and any other stream (e.g., a pipe or a socket) is fully 
+	buffered.
+
+	Output in the buffer is written when the buffer fills, when the 
+	stream is flushed or closed, or (for terminals) at the end of a line.
+	Therefore, programs should @c fflush an output stream before 
+	waiting for input that depends on it (e.g., after a prompt).
+
+	This call returns a new FILE pointer on success and NULL
+	on failure.
+*/
+FILE* fidopen_buffered(Fid_t fid, const char* mode, size_t size);
+
+/**
+	@brief Close all buffered streams opened by the current process.
+
+	This flushes any output still in the buffers. It is called when a 
+	program started by @ref Execute returns. A program that ends in any 
+	other way (e.g., by calling @c Exit) should call this first, or call 
+	@ref ExitProgram, else buffered output may be lost.
+  */
+void fidcloseall();
+
+/**
+	@brief Exit the current process, after closing its buffered streams.
+
+	This is @c Exit, preceded by @ref fidcloseall.
+  */
+void ExitProgram(int exitval);
+
 void tinyos_replace_stdio();
 void tinyos_restore_stdio();
 void tinyos_pseudo_console();
@@ -835,6 +835,7 @@ static struct argp_option options [] = {
 	{"list", 'l', 0, 0, "Show a list of available tests" },
 	{"verbose", 'v', 0, 0, "Be verbose: show test descriptions"},
 	{"nocolor", 'n', 0, 0, "Do not color the output"},
+	{"sched", 's', "<policy>", 0, "Scheduler policy (mlfq or fair)" },
 	{ NULL }
 };
 
@@ -948,6 +949,11 @@ parse_options(int key, char *arg, struct argp_state *state)
 				argp_error(state, "Error in parsing list of terminals: %s\n",arg);				
 			break;
 
+		case 's':
+			if(set_sched_policy(arg) != 0)
+				argp_error(state, "Unknown scheduler policy: %s\n",arg);
+			break;
+
 		case ARGP_KEY_ARG:
 			if(ARGS.ntests >= MAX_TESTS) {
 				argp_error(state, "Number of tests too large (maximum=%d)",MAX_TESTS);
@@ -581,6 +581,301 @@ static inline void rlist_select(rlnode* Lsrc, rlnode* Ldest, int (*pred)(rlnode*
 
 
 
+/*******************************************************
+ *
+ *
+ *******************************************************/
+
+/**
+	@defgroup lfqueues  Lock-free queues
+	@brief  Single-consumer queues, without locks.
+
+	These queues need no external locking, as long as there is a single
+	consumer (and, for the SPSC queues, a single producer). None of their
+	operations ever waits for another thread, so they can be used between 
+	interrupt handlers and kernel code, and between cores.
+
+	There are two kinds of queue, each in two variants:
+	- A ring is a bounded array of pointers, provided by the caller. A push
+	  fails when the ring is full.
+	- A queue is an unbounded, intrusive list of @c qnode, embedded in the
+	  queued objects. A push never fails.
+	
+	The indices (or ends) that the producers and the consumer write are 
+	kept in separate cache lines, so that they do not contend.
+
+	A pop returns NULL when the queue is empty. A pop of an MPSC queue may
+	also return NULL while a producer is between the two steps of its push;
+	the element becomes visible when the push completes.
+
+	@{
+*/
+
+/** @brief The size of a cache line, to keep apart the fields of queues. */
+#define CACHE_LINE_SIZE 64
+
+/** @brief Declare a struct field in its own cache line. */
+#define CACHE_ALIGNED _Alignas(CACHE_LINE_SIZE)
+
+
+/**
+	@brief A bounded single-producer/single-consumer ring.
+
+	Each side caches the index of the other side, and only re-reads it 
+	when the ring seems full (or empty).
+ */
+typedef struct {
+	CACHE_ALIGNED size_t tail;	/**< @brief The next slot to push (written by the producer) */
+	size_t head_cache;		/**< @brief The producer's copy of @c head */
+	CACHE_ALIGNED size_t head;	/**< @brief The next slot to pop (written by the consumer) */
+	size_t tail_cache;		/**< @brief The consumer's copy of @c tail */
+	CACHE_ALIGNED void** slots;	/**< @brief The array of slots */
+	size_t mask;			/**< @brief The number of slots minus 1 */
+} spsc_ring;
+
+/**
+	@brief Initialize a ring over an array of slots.
+
+	@param q the ring
+	@param slots an array of @c size pointers
+	@param size the number of slots, a power of 2
+ */
+static inline void spsc_ring_init(spsc_ring* q, void** slots, size_t size)
+{
+	assert(size > 0 && (size & (size-1)) == 0);
+	q->head = q->tail = q->head_cache = q->tail_cache = 0;
+	q->slots = slots;
+	q->mask = size - 1;
+}
+
+/** @brief Push an element; return 0 if the ring is full. */
+static inline int spsc_ring_push(spsc_ring* q, void* item)
+{
+	size_t tail = q->tail;
+	if(tail - q->head_cache > q->mask) {
+		q->head_cache = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		if(tail - q->head_cache > q->mask) return 0;
+	}
+	q->slots[tail & q->mask] = item;
+	__atomic_store_n(&q->tail, tail+1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/** @brief Pop an element; return NULL if the ring is empty. */
+static inline void* spsc_ring_pop(spsc_ring* q)
+{
+	size_t head = q->head;
+	if(head == q->tail_cache) {
+		q->tail_cache = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		if(head == q->tail_cache) return NULL;
+	}
+	void* item = q->slots[head & q->mask];
+	__atomic_store_n(&q->head, head+1, __ATOMIC_RELEASE);
+	return item;
+}
+
+
+/** @brief A slot of an MPSC ring. */
+typedef struct {
+	size_t seq;		/**< @brief The push that may fill this slot next (see mpsc_ring) */
+	void* item;		/**< @brief The element */
+} mpsc_cell;
+
+/**
+	@brief A bounded multi-producer/single-consumer ring.
+
+	Producers claim a slot by advancing @c tail with compare-and-swap.
+	Each slot carries a sequence number, which tells whether it is free 
+	for push @c i (seq==i), or holds the element of push @c i (seq==i+1).
+ */
+typedef struct {
+	CACHE_ALIGNED size_t tail;	/**< @brief The next push (written by the producers) */
+	CACHE_ALIGNED size_t head;	/**< @brief The next pop (written by the consumer) */
+	CACHE_ALIGNED mpsc_cell* cells;	/**< @brief The array of slots */
+	size_t mask;			/**< @brief The number of slots minus 1 */
+} mpsc_ring;
+
+/**
+	@brief Initialize a ring over an array of cells.
+
+	@param q the ring
+	@param cells an array of @c size cells
+	@param size the number of cells, a power of 2
+ */
+static inline void mpsc_ring_init(mpsc_ring* q, mpsc_cell* cells, size_t size)
+{
+	assert(size > 0 && (size & (size-1)) == 0);
+	q->head = q->tail = 0;
+	q->cells = cells;
+	q->mask = size - 1;
+	for(size_t i=0; i<size; i++) {
+		cells[i].seq = i;
+		cells[i].item = NULL;
+	}
+}
+
+/** @brief Push an element; return 0 if the ring is full. */
+static inline int mpsc_ring_push(mpsc_ring* q, void* item)
+{
+	size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	while(1) {
+		mpsc_cell* cell = &q->cells[pos & q->mask];
+		intptr_t dif = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+		if(dif == 0) {
+			if(__atomic_compare_exchange_n(&q->tail, &pos, pos+1, 1, 
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				cell->item = item;
+				__atomic_store_n(&cell->seq, pos+1, __ATOMIC_RELEASE);
+				return 1;
+			}
+		}
+		else if(dif < 0)
+			return 0;	/* full */
+		else
+			pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	}
+}
+
+/** @brief Pop an element; return NULL if the ring is empty. */
+static inline void* mpsc_ring_pop(mpsc_ring* q)
+{
+	mpsc_cell* cell = &q->cells[q->head & q->mask];
+	if(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != q->head+1)
+		return NULL;
+	void* item = cell->item;
+	__atomic_store_n(&cell->seq, q->head + q->mask + 1, __ATOMIC_RELEASE);
+	q->head++;
+	return item;
+}
+
+
+/**
+	@brief A node of an intrusive lock-free queue.
+
+	Like @c rlnode, it is embedded in the queued object, and it can 
+	point back to it.
+ */
+typedef struct queue_node {
+	struct queue_node* next;	/**< @brief The next node in the queue */
+	void* obj;			/**< @brief The object of the node */
+} qnode;
+
+/** @brief Initialize a node, pointing to an object. */
+static inline qnode* qnode_init(qnode* n, void* obj)
+{
+	n->next = NULL;
+	n->obj = obj;
+	return n;
+}
+
+/**
+	@brief An unbounded intrusive queue, with a single consumer.
+
+	This is Vyukov's queue: the nodes are linked from @c head to @c tail,
+	and a push swaps itself into @c tail and then links the previous
+	tail to itself. The queue always holds at least one node; when it
+	would become empty, a @c stub node is pushed. 
+
+	The same structure serves as an SPSC queue and as an MPSC queue. 
+	Even with a single producer, the consumer pushes the stub, so @c tail
+	is always swapped atomically.
+ */
+typedef struct {
+	CACHE_ALIGNED qnode* tail;	/**< @brief The last node (written by the producers) */
+	CACHE_ALIGNED qnode* head;	/**< @brief The first node (written by the consumer) */
+	qnode stub;			/**< @brief The node that keeps the queue non-empty */
+} lf_queue;
+
+/** @brief An unbounded single-producer/single-consumer intrusive queue. */
+typedef lf_queue spsc_queue;
+
+/** @brief An unbounded multi-producer/single-consumer intrusive queue. */
+typedef lf_queue mpsc_queue;
+
+/** @brief Initialize an empty queue. */
+static inline void lf_queue_init(lf_queue* q)
+{
+	qnode_init(&q->stub, NULL);
+	q->head = q->tail = &q->stub;
+}
+
+/** @brief Initialize an empty SPSC queue. */
+static inline void spsc_queue_init(spsc_queue* q) { lf_queue_init(q); }
+
+/** @brief Initialize an empty MPSC queue. */
+static inline void mpsc_queue_init(mpsc_queue* q) { lf_queue_init(q); }
+
+/** @brief Push a node to an MPSC queue, from any thread (wait-free). */
+static inline void mpsc_queue_push(mpsc_queue* q, qnode* n)
+{
+	__atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+	qnode* prev = __atomic_exchange_n(&q->tail, n, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+/** 
+	@brief Push a node to an SPSC queue, from its single producer. 
+
+	This is the MPSC push, since the consumer may push the stub at the
+	same time (see lf_queue_pop).
+ */
+static inline void spsc_queue_push(spsc_queue* q, qnode* n)
+{
+	mpsc_queue_push(q, n);
+}
+
+/**
+	@brief Pop a node from a queue, by its single consumer.
+
+	@returns the popped node, or NULL if the queue is empty (or, for an 
+	MPSC queue, if the next node is still being pushed).
+ */
+static inline qnode* lf_queue_pop(lf_queue* q)
+{
+	qnode* head = q->head;
+	qnode* next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+	/* Skip the stub */
+	if(head == &q->stub) {
+		if(next == NULL) return NULL;
+		q->head = head = next;
+		next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+	}
+	if(next != NULL) {
+		q->head = next;
+		return head;
+	}
+
+	/* head is the last node; a push may be linking a node after it */
+	if(head != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	/* Push the stub behind head, so that head can be removed */
+	mpsc_queue_push(q, &q->stub);
+	next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+	if(next != NULL) {
+		q->head = next;
+		return head;
+	}
+	return NULL;
+}
+
+/** @brief Pop a node from an SPSC queue. */
+static inline qnode* spsc_queue_pop(spsc_queue* q) { return lf_queue_pop(q); }
+
+/** @brief Pop a node from an MPSC queue. */
+static inline qnode* mpsc_queue_pop(mpsc_queue* q) { return lf_queue_pop(q); }
+
+/** @brief Check if a queue is empty (from its consumer). */
+static inline int lf_queue_empty(lf_queue* q)
+{
+	return q->head == &q->stub && __atomic_load_n(&q->stub.next, __ATOMIC_ACQUIRE) == NULL;
+}
+
+/* @} lfqueues */
+
+
+
 /*
 	Some helpers for packing and unpacking vectors of strings into
 	(argl, args)
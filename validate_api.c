@@ -2,14 +2,17 @@
 #include <assert.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <math.h>
+#include <ctype.h>
 #include <setjmp.h>
 
 #include "util.h"
 #include "symposium.h"
 #include "tinyoslib.h"
 #include "unit_testing.h"
+#include "kernel_cc.h"    /* for the lock benchmarks */
 
 
 /*
@@ -510,6 +513,440 @@ BOOT_TEST(test_cond_timedwait_broadcast,
 
 
 
+static struct {
+	Mutex mx;
+	CondVar cv;
+	CondVar pcv;
+	int waiting;
+	int signalled;
+} BC;
+
+static int broadcast_waiter(int argl, void* args)
+{
+	Mutex_Lock(&BC.mx);
+	BC.waiting++;
+	Cond_Signal(&BC.pcv);
+	if(Cond_TimedWait(&BC.mx, &BC.cv, 10000000))
+		BC.signalled++;
+	Mutex_Unlock(&BC.mx);
+	return 0;
+}
+
+BOOT_TEST(test_cond_broadcast_many,
+	"Test that a broadcast to more waiters than a wakeup batch wakes them all,\n"
+	"and that each of their timed waits reports that it was signalled."
+	)
+{
+	const int N=100;
+	BC.mx = MUTEX_INIT;
+	BC.cv = BC.pcv = COND_INIT;
+	BC.waiting = BC.signalled = 0;
+
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) tids[i] = CreateThread(broadcast_waiter, 0, NULL);
+
+	Mutex_Lock(&BC.mx);
+	while(BC.waiting!=N) Cond_Wait(&BC.mx, &BC.pcv);
+	Cond_Broadcast(&BC.cv);
+	Mutex_Unlock(&BC.mx);
+
+	for(int i=0; i<N; i++) ASSERT(ThreadJoin(tids[i], NULL)==0);
+	ASSERT(BC.signalled==N);
+	return 0;
+}
+
+
+/*
+  Waiters with a short timeout race broadcasts that morph them onto the
+  mutex, which the broadcaster holds past their timeout. A waiter that 
+  times out while morphed must leave the wait queue of the mutex.
+*/
+void mark_time(struct timeval* t);
+double time_since(struct timeval* t0);
+
+#define MORPH_WAITERS 4
+#define MORPH_ROUNDS 300
+
+static struct {
+	Mutex mx;
+	CondVar cv;
+	CondVar pcv;
+	int waiting;
+	int stop;
+} MORPH;
+
+static int morph_waiter(int argl, void* args)
+{
+	Mutex_Lock(&MORPH.mx);
+	MORPH.waiting++;
+	Cond_Signal(&MORPH.pcv);
+	while(! MORPH.stop)
+		Cond_TimedWait(&MORPH.mx, &MORPH.cv, 1);
+	Mutex_Unlock(&MORPH.mx);
+	return 0;
+}
+
+static int morph_timeout_race(int argl, void* args)
+{
+	MORPH.mx = MUTEX_INIT;
+	MORPH.cv = MORPH.pcv = COND_INIT;
+	MORPH.waiting = 0;
+	MORPH.stop = 0;
+
+	Tid_t tids[MORPH_WAITERS];
+	for(int i=0; i<MORPH_WAITERS; i++) 
+		tids[i] = CreateThread(morph_waiter, 0, NULL);
+
+	Mutex_Lock(&MORPH.mx);
+	while(MORPH.waiting != MORPH_WAITERS) Cond_Wait(&MORPH.mx, &MORPH.pcv);
+	Mutex_Unlock(&MORPH.mx);
+
+	for(int r=0; r<MORPH_ROUNDS; r++) {
+		Mutex_Lock(&MORPH.mx);
+		Cond_Broadcast(&MORPH.cv);
+		/* Hold the mutex for up to two timeouts, varying the phase */
+		struct timeval t0;
+		mark_time(&t0);
+		while(time_since(&t0) < (r%5) * 0.0005)
+			fibo(10);
+		Mutex_Unlock(&MORPH.mx);
+	}
+
+	Mutex_Lock(&MORPH.mx);
+	MORPH.stop = 1;
+	Cond_Broadcast(&MORPH.cv);
+	Mutex_Unlock(&MORPH.mx);
+
+	for(int i=0; i<MORPH_WAITERS; i++) ASSERT(ThreadJoin(tids[i], NULL)==0);
+	return 0;
+}
+
+BARE_TEST(test_cond_broadcast_morph_timeout,
+	"Test that timed waiters which time out after a broadcast has moved them\n"
+	"to the wait queue of their mutex (wait morphing) leave it cleanly.\n"
+	"Morphing is forced, even without parallel cores.",
+	.timeout = 60
+	)
+{
+	set_cv_morph(1);
+	boot(1, 0, morph_timeout_race, 0, NULL);
+	boot(2, 0, morph_timeout_race, 0, NULL);
+	set_cv_morph(0);
+}
+
+#undef MORPH_WAITERS
+#undef MORPH_ROUNDS
+
+
+static struct {
+	RWLock rw;
+	int a, b;
+	int readers, writers;
+	int max_readers;
+	int errors;
+} RW;
+
+/* Writers keep a==b, outside the lock; readers check it */
+static int rwlock_worker(int argl, void* args)
+{
+	for(int i=0; i<200; i++) {
+		if(argl) {
+			RWLock_WriteLock(&RW.rw);
+			if(__atomic_add_fetch(&RW.writers, 1, __ATOMIC_SEQ_CST) != 1 || RW.readers != 0)
+				RW.errors++;
+			RW.a++;
+			fibo(10);
+			RW.b++;
+			__atomic_sub_fetch(&RW.writers, 1, __ATOMIC_SEQ_CST);
+			RWLock_WriteUnlock(&RW.rw);
+		} else {
+			RWLock_ReadLock(&RW.rw);
+			int r = __atomic_add_fetch(&RW.readers, 1, __ATOMIC_SEQ_CST);
+			if(r > RW.max_readers) RW.max_readers = r;
+			if(RW.writers != 0 || RW.a != RW.b)
+				__atomic_add_fetch(&RW.errors, 1, __ATOMIC_SEQ_CST);
+			fibo(10);
+			__atomic_sub_fetch(&RW.readers, 1, __ATOMIC_SEQ_CST);
+			RWLock_ReadUnlock(&RW.rw);
+		}
+	}
+	return 0;
+}
+
+BOOT_TEST(test_rwlock_exclusion,
+	"Test that a reader-writer lock excludes writers from each other and from\n"
+	"readers, while readers share it."
+	)
+{
+	const int N=12;
+	RW.rw = RWLOCK_INIT;
+	RW.a = RW.b = RW.readers = RW.writers = RW.max_readers = RW.errors = 0;
+
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) tids[i] = CreateThread(rwlock_worker, (i%4==0), NULL);
+	for(int i=0; i<N; i++) ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(RW.errors == 0);
+	ASSERT(RW.a == RW.b && RW.a == 3*200);
+	return 0;
+}
+
+
+static int rwlock_timed_reader(int argl, void* args)
+{
+	if(! RWLock_TimedReadLock(&RW.rw, 50)) return 0;
+	RWLock_ReadUnlock(&RW.rw);
+	return 1;
+}
+
+static int rwlock_timed_writer(int argl, void* args)
+{
+	if(! RWLock_TimedWriteLock(&RW.rw, 50)) return 0;
+	RWLock_WriteUnlock(&RW.rw);
+	return 1;
+}
+
+static int join_value(Tid_t tid)
+{
+	int retval;
+	ASSERT(ThreadJoin(tid, &retval)==0);
+	return retval;
+}
+
+BOOT_TEST(test_rwlock_timeout,
+	"Test that the timed locks of a reader-writer lock time out while the lock\n"
+	"is held in a conflicting mode, and that a writer that timed out does not\n"
+	"keep readers waiting."
+	)
+{
+	RW.rw = RWLOCK_INIT;
+
+	RWLock_WriteLock(&RW.rw);
+	ASSERT(join_value(CreateThread(rwlock_timed_reader, 0, NULL)) == 0);
+	ASSERT(join_value(CreateThread(rwlock_timed_writer, 0, NULL)) == 0);
+	RWLock_WriteUnlock(&RW.rw);
+
+	RWLock_ReadLock(&RW.rw);
+	ASSERT(join_value(CreateThread(rwlock_timed_writer, 0, NULL)) == 0);
+	ASSERT(join_value(CreateThread(rwlock_timed_reader, 0, NULL)) == 1);
+	RWLock_ReadUnlock(&RW.rw);
+
+	ASSERT(join_value(CreateThread(rwlock_timed_writer, 0, NULL)) == 1);
+	return 0;
+}
+
+
+static struct {
+	Semaphore sem;
+	int inside, max_inside;
+} SEM;
+
+static int semaphore_worker(int argl, void* args)
+{
+	for(int i=0; i<100; i++) {
+		Sem_Wait(&SEM.sem);
+		int n = __atomic_add_fetch(&SEM.inside, 1, __ATOMIC_SEQ_CST);
+		if(n > SEM.max_inside) SEM.max_inside = n;
+		fibo(10);
+		__atomic_sub_fetch(&SEM.inside, 1, __ATOMIC_SEQ_CST);
+		Sem_Post(&SEM.sem);
+	}
+	return 0;
+}
+
+static int semaphore_timed(int argl, void* args)
+{
+	return Sem_TimedWait(&SEM.sem, argl);
+}
+
+BOOT_TEST(test_semaphore,
+	"Test that a counting semaphore admits at most as many threads as its\n"
+	"count, and that its timed wait times out when no unit is posted."
+	)
+{
+	const int N=10;
+	SEM.sem = SEMAPHORE_INIT(3);
+	SEM.inside = SEM.max_inside = 0;
+
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) tids[i] = CreateThread(semaphore_worker, 0, NULL);
+	for(int i=0; i<N; i++) ASSERT(ThreadJoin(tids[i], NULL)==0);
+	ASSERT(SEM.max_inside >= 1 && SEM.max_inside <= 3);
+	ASSERT(SEM.sem.count == 3);
+
+	/* Take all units; then a timed wait fails, until a unit is posted */
+	for(int i=0; i<3; i++) Sem_Wait(&SEM.sem);
+	ASSERT(join_value(CreateThread(semaphore_timed, 50, NULL)) == 0);
+	Tid_t t = CreateThread(semaphore_timed, 10000, NULL);
+	Sem_Post(&SEM.sem);
+	ASSERT(join_value(t) == 1);
+	ASSERT(SEM.sem.count == 0);
+	return 0;
+}
+
+
+static Mutex profiled_mutex = MUTEX_INIT;
+static int profiled_line;
+
+static int lock_profile_worker(int argl, void* args)
+{
+	for(int i=0; i<100; i++) {
+		Mutex_Lock(&profiled_mutex); profiled_line = __LINE__;
+		fibo(10);
+		Mutex_Unlock(&profiled_mutex);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_lock_profile,
+	"Test that the lock information stream reports the acquisitions at each\n"
+	"call site of Mutex_Lock, when TinyOS is compiled with MUTEX_PROFILE, and\n"
+	"that it is empty otherwise."
+	)
+{
+	const int N=4;
+	Tid_t tids[N];
+	for(int i=0; i<N; i++) tids[i] = CreateThread(lock_profile_worker, 0, NULL);
+	for(int i=0; i<N; i++) ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	/* The site of the Mutex_Lock in lock_profile_worker */
+	char site[LOCKINFO_MAX_SITE];
+	snprintf(site, sizeof(site), "%s:%d", __FILE__, profiled_line);
+
+	Fid_t fid = OpenLockInfo();
+	ASSERT(fid != NOFILE);
+
+	lockinfo info;
+	int sites = 0, found = 0;
+	while(Read(fid, (char*)&info, sizeof(info)) == sizeof(info)) {
+		sites++;
+		if(strcmp(info.site, site) == 0) {
+			found = 1;
+			ASSERT(info.acquired == N*100);
+			ASSERT(info.contended <= info.acquired);
+			ASSERT(info.hold_max <= info.hold_total);
+		}
+	}
+	ASSERT(Close(fid) == 0);
+
+#ifdef MUTEX_PROFILE
+	ASSERT(found);
+#else
+	ASSERT(sites == 0 && !found);
+#endif
+	return 0;
+}
+
+
+static struct {
+	Fid_t fid;
+	volatile int stop;
+	int reads, fails;
+} LF;
+
+/* Read the fid while another thread closes and reopens it */
+static int lookup_reader(int argl, void* args)
+{
+	char c;
+	while(! LF.stop) {
+		int rc = Read(LF.fid, &c, 1);
+		if(rc == 1) LF.reads++;
+		else if(rc == -1) LF.fails++;
+		else return 1;
+	}
+	return 0;
+}
+
+static int procinfo_reader(int argl, void* args)
+{
+	procinfo info;
+	while(! LF.stop) {
+		Fid_t f = OpenInfo();
+		if(f == NOFILE) return 1;
+		while(Read(f, (char*)&info, sizeof(info)) == sizeof(info))
+			if(info.pid < 0 || info.pid >= MAX_PROC || info.argl < 0) return 1;
+		Close(f);
+	}
+	return 0;
+}
+
+static int short_child(int argl, void* args) { return argl; }
+
+BOOT_TEST(test_lockfree_lookups,
+	"Test that lock-free lookups of file ids and of the process table are\n"
+	"safe, while other threads close and reopen files, and create and\n"
+	"reap processes."
+	)
+{
+	/* Use the last fid, since procinfo_reader opens the lowest free one */
+	LF.fid = MAX_FILEID-1;
+	LF.stop = 0;
+	LF.reads = LF.fails = 0;
+	Fid_t f = OpenNull();
+	ASSERT(f != NOFILE);
+	ASSERT(Dup2(f, LF.fid) == 0 && Close(f) == 0);
+
+	Tid_t reader = CreateThread(lookup_reader, 0, NULL);
+	Tid_t pinfo = CreateThread(procinfo_reader, 0, NULL);
+
+	for(int i=0; i<300; i++) {
+		ASSERT(Close(LF.fid) == 0);
+		f = OpenNull();
+		ASSERT(f != NOFILE);
+		ASSERT(Dup2(f, LF.fid) == 0 && Close(f) == 0);
+		char arg[16] = "abcdefghijklmno";
+		Pid_t pid = Exec(short_child, sizeof(arg), arg);
+		ASSERT(pid != NOPROC);
+		ASSERT(WaitChild(pid, NULL) == pid);
+	}
+
+	LF.stop = 1;
+	int retval;
+	ASSERT(ThreadJoin(reader, &retval) == 0 && retval == 0);
+	ASSERT(ThreadJoin(pinfo, &retval) == 0 && retval == 0);
+	ASSERT(LF.reads > 0);
+	return 0;
+}
+
+
+/* Read and duplicate the lowest fids, while the main thread opens them */
+static int opening_reader(int argl, void* args)
+{
+	procinfo info;
+	while(! LF.stop)
+		for(Fid_t f=0; f<4; f++) {
+			if(Read(f, (char*)&info, sizeof(info)) == sizeof(info) && info.pid < 0) 
+				return 1;
+			if(Dup2(f, MAX_FILEID-1) == 0)
+				Close(MAX_FILEID-1);
+		}
+	return 0;
+}
+
+BOOT_TEST(test_lookup_during_open,
+	"Test that a fid which is being opened by one thread cannot be used by\n"
+	"another thread before its stream is set up."
+	)
+{
+	LF.stop = 0;
+	Tid_t reader = CreateThread(opening_reader, 0, NULL);
+
+	for(int i=0; i<2000; i++) {
+		Fid_t f = OpenInfo();
+		ASSERT(f != NOFILE);
+		ASSERT(Close(f) == 0);
+		f = OpenNull();
+		ASSERT(f != NOFILE);
+		ASSERT(Close(f) == 0);
+	}
+
+	LF.stop = 1;
+	int retval;
+	ASSERT(ThreadJoin(reader, &retval) == 0 && retval == 0);
+	return 0;
+}
+
+
 /*********************************************
  *
  *
@@ -920,6 +1357,14 @@ TEST_SUITE(basic_tests,
 	&test_cond_timedwait_timeout,
 	&test_cond_timedwait_signal,
 	&test_cond_timedwait_broadcast,
+	&test_cond_broadcast_many,
+	&test_cond_broadcast_morph_timeout,
+	&test_rwlock_exclusion,
+	&test_rwlock_timeout,
+	&test_semaphore,
+	&test_lock_profile,
+	&test_lockfree_lookups,
+	&test_lookup_during_open,
 	&test_null_device,
 	&test_get_terminals,
 	&test_open_terminals,
@@ -1398,127 +1843,653 @@ BOOT_TEST(test_cyclic_joins,
 }
 
 
-TEST_SUITE(thread_tests, 
-	"A suite of tests for threads."
-	)
+/* Use about argl kbytes of stack, and return the sum of the frames */
+static int stack_recursion_task(int argl, void* args)
 {
-	&test_join_illegal_tid_gives_error,
-	&test_detach_illegal_tid_gives_error,
-	&test_detach_self,
-	&test_detach_other,
-	&test_multiple_detach,
-	&test_join_main_thread,
-	&test_detach_main_thread,
-	&test_detach_after_join,
-	&test_create_join_thread,
-	&test_join_many_threads,
-	&test_exit_many_threads,
-	&test_main_exit_cleanup,
-	&test_noexit_cleanup,
-	&test_cyclic_joins,
-	NULL
-};
-
-
+	volatile char frame[1000];
+	for(int i=0; i<1000; i++) frame[i] = (char) i;
+	if(argl == 0) return 0;
+	return stack_recursion_task(argl-1, args) + frame[argl % 1000];
+}
 
+BOOT_TEST(test_create_thread_stack_size,
+	"Test that threads can be created with a smaller or larger stack size than\n"
+	"the default, and that an excessive stack size is rejected."
+	)
+{
+	int expected = 0;
+	for(int i=1; i<=1024; i++) expected += (char) (i % 1000);
 
+	/* A 4 Mbyte stack can hold 1024 frames of 1 kbyte */
+	Tid_t t = CreateThreadStack(stack_recursion_task, 1024, NULL, 4<<20);
+	ASSERT(t != NOTHREAD);
+	int exitval;
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval == expected);
 
+	/* A small stack */
+	t = CreateThreadStack(stack_recursion_task, 4, NULL, 1);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, NULL)==0);
 
+	/* The default stack */
+	t = CreateThreadStack(stack_recursion_task, 64, NULL, 0);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, NULL)==0);
 
-/*********************************************
- *
- *
- *
- *  Pipe tests
- *
- *
- *
- *********************************************/
+	ASSERT(CreateThreadStack(stack_recursion_task, 0, NULL, 1u<<31) == NOTHREAD);
+	return 0;
+}
 
 
+/* A CPU-bound thread */
+static int fair_spinner(int argl, void* args)
+{
+	fibo(25);
+	return argl;
+}
 
-BOOT_TEST(test_pipe_open,
-	"Open a pipe and put just a little data in it"
-	)
+/* An I/O-like thread, which sleeps in short timed waits */
+static int fair_sleeper(int argl, void* args)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-	int rc;
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	for(int i=0; i<argl; i++)
+		Cond_TimedWait(&mx, &cv, 1);
+	Mutex_Unlock(&mx);
+	return argl;
+}
 
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
-	}
-	char buffer[12] = { [0] = 0 };
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
-		ASSERT(strcmp(buffer, "Hello world")==0);
+static int fair_mixed_load(int argl, void* args)
+{
+	Tid_t tids[9];
+	for(int i=0; i<8; i++)
+		tids[i] = CreateThread(fair_spinner, i, NULL);
+	tids[8] = CreateThread(fair_sleeper, 20, NULL);
+
+	for(int i=0; i<9; i++) {
+		int exitval;
+		ASSERT(ThreadJoin(tids[i], &exitval)==0);
+		ASSERT(exitval == (i<8 ? i : 20));
 	}
 	return 0;
 }
 
-
-BOOT_TEST(test_pipe_fails_on_exhausted_fid,
-	"Test that Pipe will fail if the fids are exhausted."
+BARE_TEST(test_sched_policy_fair,
+	"Test that the kernel runs a mixed load of CPU-bound and sleeping threads\n"
+	"with the fair scheduler policy, and that unknown policies are rejected.\n"
+	"The default (mlfq) policy is selected afterwards."
 	)
 {
-	pipe_t pipe;
-	for(uint i=0; i< (MAX_FILEID/2); i++ )
-		ASSERT(Pipe(&pipe)==0);
-	for(uint i=0; i< (MAX_FILEID/2); i++ )
-		ASSERT(Pipe(&pipe)==-1);	
-	return 0;
+	ASSERT(set_sched_policy("no such policy") == -1);
+	ASSERT(set_sched_policy("fair") == 0);
+	boot(1, 0, fair_mixed_load, 0, NULL);
+	boot(2, 0, fair_mixed_load, 0, NULL);
+	ASSERT(set_sched_policy("mlfq") == 0);
 }
 
 
-
-BOOT_TEST(test_pipe_close_reader,
-	"Open a pipe and put just a little data in it"
+BARE_TEST(test_sched_trace,
+	"Test that the scheduler trace is written in the Chrome trace format,\n"
+	"when tracing is enabled."
 	)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-	int rc;
+	char fname[] = "/tmp/tinyos_trace_XXXXXX";
+	int fd = mkstemp(fname);
+	ASSERT(fd != -1);
+	close(fd);
+
+	set_sched_trace(fname);
+	boot(2, 0, fair_mixed_load, 0, NULL);
+	set_sched_trace(NULL);
+
+	FILE* f = fopen(fname, "r");
+	ASSERT(f != NULL);
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	rewind(f);
+	char* trace = xmalloc(size+1);
+	ASSERT(fread(trace, 1, size, f) == size);
+	trace[size] = '\0';
+	fclose(f);
+	unlink(fname);
+
+	ASSERT(strncmp(trace, "{\"traceEvents\":[", 16) == 0);
+	ASSERT(strcmp(trace + size - 4, "\n]}\n") == 0);
+	ASSERT(strstr(trace, "\"ph\":\"X\"") != NULL);
+	ASSERT(strstr(trace, "\"name\":\"wakeup\"") != NULL);
+	ASSERT(strstr(trace, "\"name\":\"sleep\"") != NULL);
+	ASSERT(strstr(trace, "\"name\":\"core 1\"") != NULL);
+	free(trace);
+}
+
+
+#define DL_PERIOD 20000
+#define DL_RUNTIME 5000
+#define DL_JOBS 100
 
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
-	}
-	Close(pipe.read);
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==-1);
+/*
+  A periodic thread, which does a small job at every period, and counts
+  the jobs that did not finish by the end of their period. If argl is
+  non-zero, it runs as a deadline thread.
+ */
+static int periodic_task(int argl, void* args)
+{
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	int misses = 0;
+
+	if(argl)
+		ASSERT(ThreadSetDeadline(DL_RUNTIME, DL_PERIOD)==0);
+
+	struct timeval t0;
+	mark_time(&t0);
+	Mutex_Lock(&mx);
+	for(int k=0; k<DL_JOBS; k++) {
+		/* Wait for the release of job k */
+		double wait;
+		while((wait = k*DL_PERIOD*1E-6 - time_since(&t0)) > 0)
+			Cond_TimedWait(&mx, &cv, (timeout_t)(wait*1000) + 1);
+
+		fibo(18);
+		if(time_since(&t0) > (k+1)*DL_PERIOD*1E-6)
+			misses++;
 	}
-	return 0;
+	Mutex_Unlock(&mx);
+	return misses;
 }
 
-BOOT_TEST(test_pipe_close_writer,
-	"Open a pipe and put just a little data in it"
-	)
+static int deadline_misses(int deadline)
 {
-	pipe_t pipe;
-	ASSERT(Pipe(&pipe)==0);	
-	int rc;
+	/* A symposium in the background */
+	symposium_t symp = { .N = 5, .bites = 5 };
+	adjust_symposium(&symp, -2, 0);
+	symposium_quiet = 1;
+	Pid_t pid = Exec(SymposiumOfThreads, sizeof(symp), &symp);
+
+	int misses;
+	Tid_t t = CreateThread(periodic_task, deadline, NULL);
+	ASSERT(ThreadJoin(t, &misses)==0);
+	ASSERT(WaitChild(pid, NULL)==pid);
+	return misses;
+}
 
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
-	}
+static struct {
+	Mutex mx;
+	CondVar cv;
+	int requested, release;
+} DLA;
 
-	char buffer[12] = { [0] = 0 };
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
-		ASSERT(strcmp(buffer, "Hello world")==0);
+/* Ask for argl/1000 of a core, and wait to be released */
+static int admission_child(int argl, void* args)
+{
+	int ret = ThreadSetDeadline(argl, 1000);
+	Mutex_Lock(&DLA.mx);
+	DLA.requested++;
+	Cond_Broadcast(&DLA.cv);
+	while(!DLA.release)
+		Cond_Wait(&DLA.mx, &DLA.cv);
+	Mutex_Unlock(&DLA.mx);
+	return ret;
+}
+
+BOOT_TEST(test_deadline_admission,
+	"Test that ThreadSetDeadline rejects bad parameters and requests that\n"
+	"exceed the available bandwidth."
+	)
+{
+	DLA.mx = MUTEX_INIT;
+	DLA.cv = COND_INIT;
+	DLA.requested = DLA.release = 0;
+
+	ASSERT(ThreadSetDeadline(2000, 1000) == -1);
+	ASSERT(ThreadSetDeadline(1000, 2000) == 0);
+
+	/* Together with us, only ncores-1 threads of 95% can be admitted */
+	int ncores = cpu_cores();
+	Tid_t tids[MAX_CORES];
+	for(int i=0; i<ncores; i++)
+		tids[i] = CreateThread(admission_child, 950, NULL);
+
+	Mutex_Lock(&DLA.mx);
+	while(DLA.requested < ncores)
+		Cond_Wait(&DLA.mx, &DLA.cv);
+	DLA.release = 1;
+	Cond_Broadcast(&DLA.cv);
+	Mutex_Unlock(&DLA.mx);
+
+	int admitted = 0;
+	for(int i=0; i<ncores; i++) {
+		int retval;
+		ASSERT(ThreadJoin(tids[i], &retval)==0);
+		if(retval==0) admitted++;
 	}
-	Close(pipe.write);
-	for(int i=0;i<3;i++) {
-		ASSERT((rc=Read(pipe.read, buffer, 12))==0);
+	ASSERT(admitted == ncores-1);
+
+	/* The bandwidth of exited deadline threads is returned */
+	ASSERT(ThreadSetDeadline(0, 0) == 0);
+	for(int i=0; i<10; i++) {
+		int retval;
+		ASSERT(ThreadJoin(CreateThread(admission_child, 900, NULL), &retval)==0);
+		ASSERT(retval == 0);
 	}
 	return 0;
 }
 
+static volatile int budget_hog_stop;
 
-/* Takes one integer argument, writes that many bytes to stdout.
- */
-int data_producer(int argl, void* args)
+static int budget_hog(int argl, void* args)
 {
-	assert(argl == sizeof(int));
+	ASSERT(ThreadSetDeadline(2000, 10000)==0);
+	while(!budget_hog_stop)
+		fibo(20);
+	return 0;
+}
+
+BOOT_TEST(test_deadline_budget,
+	"Test that a CPU-bound deadline thread is throttled when its budget is\n"
+	"exhausted, so that normal threads can run.",
+	.timeout = 20
+	)
+{
+	budget_hog_stop = 0;
+	Tid_t hogs[MAX_CORES];
+	for(int i=0; i<cpu_cores(); i++)
+		hogs[i] = CreateThread(budget_hog, 0, NULL);
+
+	fibo(34);
+	budget_hog_stop = 1;
+
+	for(int i=0; i<cpu_cores(); i++)
+		ASSERT(ThreadJoin(hogs[i], NULL)==0);
+	return 0;
+}
+
+static volatile unsigned long slice_hog_count;
+
+static int slice_hog(int argl, void* args)
+{
+	while(!budget_hog_stop)
+		slice_hog_count++;
+	return 0;
+}
+
+BOOT_TEST(test_deadline_long_runtime,
+	"Test that a deadline thread with a runtime longer than a quantum keeps\n"
+	"the core from one slice to the next, ahead of a CPU-bound normal thread."
+	)
+{
+	budget_hog_stop = 0;
+	slice_hog_count = 0;
+	Tid_t hog = CreateThread(slice_hog, 0, NULL);
+	while(slice_hog_count == 0)
+		fibo(15);
+
+	/* A fresh budget of 3 quanta (10 msec each, see QUANTUM); run for 2 of them */
+	ASSERT(ThreadSetDeadline(3*10000, 100000)==0);
+	struct timeval t0;
+	mark_time(&t0);
+	unsigned long c0 = slice_hog_count;
+	while(time_since(&t0) < 2*10000*1E-6)
+		fibo(10);
+	unsigned long c1 = slice_hog_count;
+
+	budget_hog_stop = 1;
+	ASSERT(ThreadSetDeadline(0, 0)==0);
+	ASSERT(ThreadJoin(hog, NULL)==0);
+
+	/* On a single core, the hog can only run if we were preempted */
+	if(cpu_cores()==1)
+		ASSERT_MSG(c1 == c0, "the normal thread ran %lu times\n", c1-c0);
+	return 0;
+}
+
+BOOT_TEST(test_deadline_misses,
+	"Test that a periodic deadline thread meets its deadlines, while a symposium\n"
+	"is running in the background, and compare with a normal thread.",
+	.timeout = 60
+	)
+{
+	int normal = deadline_misses(0);
+	int deadline = deadline_misses(1);
+	MSG("Deadline misses in %d jobs: %d as a normal thread, %d as a deadline thread\n",
+		DL_JOBS, normal, deadline);
+	ASSERT(deadline <= DL_JOBS/20);
+	return 0;
+}
+
+#undef DL_PERIOD
+#undef DL_RUNTIME
+#undef DL_JOBS
+
+
+/*
+  CPU-bound threads, one more than the cores, so that they drop to the
+  lowest priority. Every PREEMPT_SPIN seconds, the first one signals a 
+  waiting thread, which has kept a higher priority.
+*/
+#define PREEMPT_ROUNDS 10
+#define PREEMPT_SPIN 0.04
+
+static struct {
+	Mutex mx;
+	CondVar cv;
+	int round;
+	struct timeval signalled;
+	volatile int stop;
+} PREEMPT;
+
+static int preempt_hog(int argl, void* args)
+{
+	for(int r=1; argl==0 && r<=PREEMPT_ROUNDS; r++) {
+		struct timeval t0;
+		mark_time(&t0);
+		while(time_since(&t0) < PREEMPT_SPIN)
+			fibo(15);
+
+		Mutex_Lock(&PREEMPT.mx);
+		PREEMPT.round = r;
+		mark_time(&PREEMPT.signalled);
+		Cond_Signal(&PREEMPT.cv);
+		Mutex_Unlock(&PREEMPT.mx);
+	}
+
+	while(! PREEMPT.stop)
+		fibo(15);
+	return 0;
+}
+
+static int wakeup_preemption(int argl, void* args)
+{
+	PREEMPT.mx = MUTEX_INIT;
+	PREEMPT.cv = COND_INIT;
+	PREEMPT.round = 0;
+	PREEMPT.stop = 0;
+
+	Tid_t hogs[MAX_CORES+1];
+	for(int i=0; i<=cpu_cores(); i++)
+		hogs[i] = CreateThread(preempt_hog, i, NULL);
+
+	int fast = 0;
+	Mutex_Lock(&PREEMPT.mx);
+	for(int r=1; r<=PREEMPT_ROUNDS; r++) {
+		while(PREEMPT.round < r)
+			Cond_Wait(&PREEMPT.mx, &PREEMPT.cv);
+		/* Without preemption, we would wait for a quantum (10 msec) to expire */
+		if(time_since(&PREEMPT.signalled) < 0.005)
+			fast++;
+	}
+	Mutex_Unlock(&PREEMPT.mx);
+
+	PREEMPT.stop = 1;
+	for(int i=0; i<=cpu_cores(); i++)
+		ASSERT(ThreadJoin(hogs[i], NULL)==0);
+	MSG("%d cores: %d of %d wakeups ran within 5 msec\n", cpu_cores(), fast, PREEMPT_ROUNDS);
+	return 0;
+}
+
+/* 
+  This depends on wall-clock timing, so it is a benchmark and not a test:
+  on a loaded host, the woken thread may be late no matter the scheduler.
+*/
+BARE_TEST(bench_wakeup_preemption,
+	"Measure how often a thread woken up by a lower-priority CPU-bound thread\n"
+	"runs at once, without waiting for the quantum of the CPU-bound thread to\n"
+	"expire. This benchmark uses the mlfq policy.",
+	.timeout = 20
+	)
+{
+	ASSERT(set_sched_policy("mlfq") == 0);
+	boot(1, 0, wakeup_preemption, 0, NULL);
+	boot(2, 0, wakeup_preemption, 0, NULL);
+}
+
+#undef PREEMPT_ROUNDS
+#undef PREEMPT_SPIN
+
+
+/*
+  A low-priority thread holds a mutex for INVERT_CS seconds of CPU work,
+  while CPU-bound threads of the same priority compete with it. A waiting
+  thread of high priority then blocks on the mutex. Without priority 
+  inheritance, it waits for the owner's work to be shared among all the 
+  CPU-bound threads; with it, the owner runs ahead of them.
+*/
+#define INVERT_CS 0.03
+
+static struct {
+	Mutex mx;
+	Mutex gate;
+	CondVar cv;
+	int work;
+	volatile int ready;
+	volatile int held;
+	volatile int stop;
+} INVERT;
+
+static int invert_owner(int argl, void* args)
+{
+	/* Measure the work, and drop to the lowest priority doing so */
+	struct timeval t0;
+	int work = 0;
+	mark_time(&t0);
+	while(time_since(&t0) < INVERT_CS) {
+		fibo(15);
+		work++;
+	}
+
+	Mutex_Lock(&INVERT.gate);
+	INVERT.work = work;
+	INVERT.ready = 1;
+	Cond_Broadcast(&INVERT.cv);
+	while(INVERT.ready < 2)
+		Cond_Wait(&INVERT.gate, &INVERT.cv);
+	Mutex_Unlock(&INVERT.gate);
+
+	Mutex_Lock(&INVERT.mx);
+	Mutex_Lock(&INVERT.gate);
+	INVERT.held = 1;
+	Cond_Broadcast(&INVERT.cv);
+	Mutex_Unlock(&INVERT.gate);
+	for(int i=0; i<work; i++)
+		fibo(15);
+	Mutex_Unlock(&INVERT.mx);
+	return 0;
+}
+
+static int invert_hog(int argl, void* args)
+{
+	while(! INVERT.stop)
+		fibo(15);
+	return 0;
+}
+
+static int priority_inversion(int argl, void* args)
+{
+	INVERT.mx = MUTEX_INIT;
+	INVERT.gate = MUTEX_INIT;
+	INVERT.cv = COND_INIT;
+	INVERT.ready = INVERT.held = INVERT.stop = 0;
+
+	Tid_t owner = CreateThread(invert_owner, 0, NULL);
+	Mutex_Lock(&INVERT.gate);
+	while(! INVERT.ready)
+		Cond_Wait(&INVERT.gate, &INVERT.cv);
+	Mutex_Unlock(&INVERT.gate);
+
+	int nhogs = cpu_cores()+3;
+	Tid_t hogs[MAX_CORES+3];
+	for(int i=0; i<nhogs; i++)
+		hogs[i] = CreateThread(invert_hog, 0, NULL);
+
+	Mutex_Lock(&INVERT.gate);
+	INVERT.ready = 2;
+	Cond_Broadcast(&INVERT.cv);
+	while(! INVERT.held)
+		Cond_Wait(&INVERT.gate, &INVERT.cv);
+	Mutex_Unlock(&INVERT.gate);
+
+	struct timeval t0;
+	mark_time(&t0);
+	Mutex_Lock(&INVERT.mx);
+	double wait = time_since(&t0);
+	Mutex_Unlock(&INVERT.mx);
+
+	INVERT.stop = 1;
+	for(int i=0; i<nhogs; i++)
+		ASSERT(ThreadJoin(hogs[i], NULL)==0);
+	ASSERT(ThreadJoin(owner, NULL)==0);
+
+	/* Without inheritance, this is about (nhogs+1)/cores times INVERT_CS */
+	ASSERT_MSG(wait < 2*INVERT_CS, "waited %.3f sec for a %.3f sec critical section\n", wait, INVERT_CS);
+	return 0;
+}
+
+BARE_TEST(test_priority_inheritance,
+	"Test that a low-priority thread holding a mutex runs at the priority of\n"
+	"a higher-priority thread blocked on the mutex, ahead of CPU-bound threads.\n"
+	"This test uses the mlfq policy.",
+	.timeout = 20
+	)
+{
+	ASSERT(set_sched_policy("mlfq") == 0);
+	boot(1, 0, priority_inversion, 0, NULL);
+	boot(2, 0, priority_inversion, 0, NULL);
+}
+
+#undef INVERT_CS
+
+
+TEST_SUITE(thread_tests, 
+	"A suite of tests for threads."
+	)
+{
+	&test_join_illegal_tid_gives_error,
+	&test_detach_illegal_tid_gives_error,
+	&test_detach_self,
+	&test_detach_other,
+	&test_multiple_detach,
+	&test_join_main_thread,
+	&test_detach_main_thread,
+	&test_detach_after_join,
+	&test_create_join_thread,
+	&test_join_many_threads,
+	&test_exit_many_threads,
+	&test_main_exit_cleanup,
+	&test_noexit_cleanup,
+	&test_cyclic_joins,
+	&test_create_thread_stack_size,
+	&test_sched_policy_fair,
+	&test_sched_trace,
+	&test_deadline_admission,
+	&test_deadline_budget,
+	&test_deadline_long_runtime,
+	&test_deadline_misses,
+	&test_priority_inheritance,
+	NULL
+};
+
+
+
+
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Pipe tests
+ *
+ *
+ *
+ *********************************************/
+
+
+
+BOOT_TEST(test_pipe_open,
+	"Open a pipe and put just a little data in it"
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+	int rc;
+
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	}
+	char buffer[12] = { [0] = 0 };
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
+		ASSERT(strcmp(buffer, "Hello world")==0);
+	}
+	return 0;
+}
+
+
+BOOT_TEST(test_pipe_fails_on_exhausted_fid,
+	"Test that Pipe will fail if the fids are exhausted."
+	)
+{
+	pipe_t pipe;
+	for(uint i=0; i< (MAX_FILEID/2); i++ )
+		ASSERT(Pipe(&pipe)==0);
+	for(uint i=0; i< (MAX_FILEID/2); i++ )
+		ASSERT(Pipe(&pipe)==-1);	
+	return 0;
+}
+
+
+
+BOOT_TEST(test_pipe_close_reader,
+	"Open a pipe and put just a little data in it"
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+	int rc;
+
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	}
+	Close(pipe.read);
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==-1);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_pipe_close_writer,
+	"Open a pipe and put just a little data in it"
+	)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);	
+	int rc;
+
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Write(pipe.write, "Hello world", 12))==12);
+	}
+
+	char buffer[12] = { [0] = 0 };
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Read(pipe.read, buffer, 12))==12);
+		ASSERT(strcmp(buffer, "Hello world")==0);
+	}
+	Close(pipe.write);
+	for(int i=0;i<3;i++) {
+		ASSERT((rc=Read(pipe.read, buffer, 12))==0);
+	}
+	return 0;
+}
+
+
+/* Takes one integer argument, writes that many bytes to stdout.
+ */
+int data_producer(int argl, void* args)
+{
+	assert(argl == sizeof(int));
 	int nbytes = *(int*)args;
 
 	Close(0);
@@ -1633,64 +2604,311 @@ BOOT_TEST(test_pipe_multi_producer,
 }
 
 
-TEST_SUITE(pipe_tests,
-	"A suite of tests for pipes. We are focusing on correctness, not performance."
+BOOT_TEST(test_pipe_stdio,
+	"Test buffered C streams on pipes, and that a program of Execute which\n"
+	"does not close its output stream still has its output flushed."
 	)
 {
-	&test_pipe_open,
-	&test_pipe_fails_on_exhausted_fid,
-	&test_pipe_close_reader,
-	&test_pipe_close_writer,
-	&test_pipe_single_producer,
-	&test_pipe_multi_producer,
-	NULL
-};
+	int writer(size_t argc, const char** argv)
+	{
+		FILE* fout = fidopen(atoi(argv[1]), "w");
+		ASSERT(fout != NULL);
+		for(int i=0; i<1000; i++)
+			fprintf(fout, "line %d\n", i);
+		/* no fclose! */
+		return 0;
+	}
 
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
+	ASSERT(IsTerminal(pipe.read)==0);
+	ASSERT(IsTerminal(pipe.write)==0);
+	ASSERT(IsTerminal(NOFILE)==-1);
+	ASSERT(IsTerminal(MAX_FILEID-1)==-1 || pipe.write==MAX_FILEID-1);
+
+	char fidstr[16];
+	sprintf(fidstr, "%d", pipe.write);
+	const char* argv[] = { "writer", fidstr };
+	Pid_t pid = Execute(writer, 2, argv);
+	ASSERT(pid != NOPROC);
+	Close(pipe.write);
 
+	FILE* fin = fidopen(pipe.read, "r");
+	char* line = NULL;
+	size_t llen = 0;
+	char expected[32];
+	for(int i=0; i<1000; i++) {
+		ASSERT(getline(&line, &llen, fin) > 0);
+		sprintf(expected, "line %d\n", i);
+		ASSERT(strcmp(line, expected)==0);
+	}
+	ASSERT(getline(&line, &llen, fin) == -1 && feof(fin));
+	free(line);
+	fclose(fin);
 
+	ASSERT(WaitChild(pid, NULL)==pid);
+	return 0;
+}
 
-/*********************************************
- *
- *
- *
- *  Socket tests
- *
- *
- *
- *********************************************/
 
-struct connect_sockets
+BOOT_TEST(test_exit_drops_buffered_output,
+	"Test that the buffered output of a program which calls Exit is dropped,\n"
+	"and not written by the next program of Execute with the same pid."
+	)
 {
-	Fid_t sock1, lsock, *sock2;
-	port_t port;
-};
+	int exiting_writer(size_t argc, const char** argv)
+	{
+		FILE* fout = fidopen(atoi(argv[1]), "w");
+		ASSERT(fout != NULL);
+		fputs("stale", fout);
+		Exit(0);
+		return 1;
+	}
 
-static int connect_sockets_connect_process(int argl, void* args) {
-	struct connect_sockets* A = args;
-	ASSERT(Connect(A->sock1, A->port, 1000)==0);
-	return 0;
-}
+	int writer(size_t argc, const char** argv)
+	{
+		FILE* fout = fidopen(atoi(argv[1]), "w");
+		ASSERT(fout != NULL);
+		fputs("fresh", fout);
+		return 0;
+	}
 
-void connect_sockets(Fid_t sock1, Fid_t lsock, Fid_t* sock2, port_t port)
-{
-	struct connect_sockets A = { 
-		.sock1=sock1, .lsock=lsock, .sock2=sock2, .port=port
-	};
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe)==0);
 
-	/* Spawn a child to connect sock1 to port (where lsock must be listening) */
-	Pid_t pid = Exec(connect_sockets_connect_process, sizeof(A), &A);
+	char fidstr[16];
+	sprintf(fidstr, "%d", pipe.write);
+	const char* argv[] = { "writer", fidstr };
+
+	Pid_t pid = Execute(exiting_writer, 2, argv);
 	ASSERT(pid != NOPROC);
+	ASSERT(WaitChild(pid, NULL)==pid);
 
-	/* accept the child's connection here */
-	*sock2 = Accept(lsock);
-	ASSERT(*sock2 != NOFILE);
+	/* The freed pid is reused first */
+	Pid_t pid2 = Execute(writer, 2, argv);
+	ASSERT(pid2 == pid);
+	ASSERT(WaitChild(pid2, NULL)==pid2);
+	Close(pipe.write);
 
-	/* Clean up child */
-	ASSERT(WaitChild(pid, NULL)==pid);
+	char buf[16];
+	int n = 0, rc;
+	while((rc = Read(pipe.read, buf+n, sizeof(buf)-1-n)) > 0)
+		n += rc;
+	buf[n] = '\0';
+	ASSERT(strcmp(buf, "fresh")==0);
+	Close(pipe.read);
+	return 0;
 }
 
 
-void check_transfer(Fid_t from, Fid_t to)
+#define SPLICE_BYTES 100000
+
+/* Write SPLICE_BYTES of a pattern into argl, and close it */
+static int splice_source(int argl, void* args)
+{
+	char buf[1000];
+	for(int n=0; n<SPLICE_BYTES; n+=sizeof(buf)) {
+		for(int i=0; i<sizeof(buf); i++) buf[i] = (char)((n+i) % 251);
+		for(int w=0; w<sizeof(buf); ) {
+			int rc = Write(argl, buf+w, sizeof(buf)-w);
+			ASSERT(rc > 0);
+			w += rc;
+		}
+	}
+	Close(argl);
+	return 0;
+}
+
+/* Read the pattern from argl until EOF */
+static int splice_sink(int argl, void* args)
+{
+	char buf[333];
+	int total = 0, n;
+	while((n = Read(argl, buf, sizeof(buf))) > 0) {
+		for(int i=0; i<n; i++)
+			ASSERT(buf[i] == (char)((total+i) % 251));
+		total += n;
+	}
+	ASSERT(n == 0);
+	ASSERT(total == SPLICE_BYTES);
+	return 0;
+}
+
+/* Splice from in to out until EOF, in chunks of size */
+static int splice_all(Fid_t in, Fid_t out, unsigned int size)
+{
+	int total = 0, n;
+	while((n = Splice(in, out, size)) > 0) {
+		ASSERT(n <= size);
+		total += n;
+	}
+	ASSERT(n == 0);
+	return total;
+}
+
+BOOT_TEST(test_splice,
+	"Test that Splice moves data between pipes, and through a kernel buffer\n"
+	"to and from other streams, and that it reports EOF and errors."
+	)
+{
+	pipe_t A, B;
+	ASSERT(Pipe(&A)==0);
+	ASSERT(Pipe(&B)==0);
+
+	/* Pipe to pipe, with a chunk size that does not divide the buffer size */
+	Tid_t src = CreateThread(splice_source, A.write, NULL);
+	Tid_t dst = CreateThread(splice_sink, B.read, NULL);
+	ASSERT(splice_all(A.read, B.write, 7777) == SPLICE_BYTES);
+	ASSERT(Close(B.write)==0);
+	ASSERT(ThreadJoin(src, NULL)==0);
+	ASSERT(ThreadJoin(dst, NULL)==0);
+
+	/* A is at EOF */
+	Fid_t null = OpenNull();
+	ASSERT(null != NOFILE);
+	ASSERT(Splice(A.read, null, 10) == 0);
+	ASSERT(Close(A.read)==0);
+
+	/* Through a kernel buffer: from the null device, and to it */
+	ASSERT(Pipe(&A)==0);
+	ASSERT(Splice(null, A.write, 100) == 100);
+	ASSERT(Splice(A.read, null, 1000) == 100);
+	ASSERT(Splice(null, A.write, 0) == 0);
+
+	/* Errors */
+	ASSERT(Splice(NOFILE, A.write, 10) == -1);
+	ASSERT(Splice(null, NOFILE, 10) == -1);
+	ASSERT(Splice(A.write, null, 10) == -1);
+	ASSERT(Splice(null, A.read, 10) == -1);
+
+	/* Broken pipe */
+	ASSERT(Pipe(&B)==0);
+	ASSERT(Close(B.read)==0);
+	ASSERT(Write(A.write, "hello", 5) == 5);
+	ASSERT(Splice(A.read, B.write, 10) == -1);
+	return 0;
+}
+
+BOOT_TEST(test_pipe_sizes,
+	"Test that pipe buffers are allocated on demand, that they shrink after\n"
+	"the load drops, and that SetPipeSize controls the capacity of pipes."
+	)
+{
+	unsigned long m0 = GetPipeMemory();
+	static char buf[65536];
+
+	pipe_t A;
+	ASSERT(Pipe(&A)==0);
+	ASSERT(GetPipeMemory() == m0);
+
+	ASSERT(SetPipeSize(A.read, 0) == 16384);
+	ASSERT(SetPipeSize(A.write, 100) == 1024);
+	ASSERT(SetPipeSize(A.write, 1<<30) == (1<<20));
+	ASSERT(SetPipeSize(A.write, 65536) == 65536);
+	ASSERT(SetPipeSize(A.read, 0) == 65536);
+	ASSERT(SetPipeSize(NOFILE, 1024) == -1);
+	Fid_t null = OpenNull();
+	ASSERT(null != NOFILE);
+	ASSERT(SetPipeSize(null, 1024) == -1);
+
+	/* The buffer grows to the capacity */
+	ASSERT(Write(A.write, buf, 10) == 10);
+	ASSERT(GetPipeMemory() == m0 + 1024);
+	ASSERT(Write(A.write, buf, sizeof(buf)) == sizeof(buf)-10);
+	ASSERT(GetPipeMemory() == m0 + 65536);
+	ASSERT(Read(A.read, buf, sizeof(buf)) == sizeof(buf));
+	ASSERT(GetPipeMemory() == m0 + 65536);
+
+	/* After a burst of small data, it shrinks when drained */
+	ASSERT(Write(A.write, buf, 10) == 10);
+	ASSERT(Read(A.read, buf, sizeof(buf)) == 10);
+	ASSERT(GetPipeMemory() == m0 + 2048);
+
+	/* A smaller capacity limits writes */
+	ASSERT(SetPipeSize(A.write, 1500) == 1500);
+	ASSERT(Write(A.write, buf, 2000) == 1500);
+
+	/* It is released when the pipe is done */
+	ASSERT(Close(A.write)==0);
+	ASSERT(GetPipeMemory() == m0 + 2048);
+	ASSERT(Read(A.read, buf, 2000) == 1500);
+	ASSERT(Read(A.read, buf, 2000) == 0);
+	ASSERT(GetPipeMemory() == m0);
+	ASSERT(Close(A.read)==0);
+
+	/* Closing the reader releases unread data */
+	ASSERT(Pipe(&A)==0);
+	ASSERT(Write(A.write, buf, 100) == 100);
+	ASSERT(GetPipeMemory() == m0 + 1024);
+	ASSERT(Close(A.read)==0);
+	ASSERT(GetPipeMemory() == m0);
+	ASSERT(Close(A.write)==0);
+	return 0;
+}
+
+
+TEST_SUITE(pipe_tests,
+	"A suite of tests for pipes. We are focusing on correctness, not performance."
+	)
+{
+	&test_pipe_open,
+	&test_pipe_fails_on_exhausted_fid,
+	&test_pipe_close_reader,
+	&test_pipe_close_writer,
+	&test_pipe_single_producer,
+	&test_pipe_multi_producer,
+	&test_pipe_stdio,
+	&test_exit_drops_buffered_output,
+	&test_splice,
+	&test_pipe_sizes,
+	NULL
+};
+
+
+
+
+/*********************************************
+ *
+ *
+ *
+ *  Socket tests
+ *
+ *
+ *
+ *********************************************/
+
+struct connect_sockets
+{
+	Fid_t sock1, lsock, *sock2;
+	port_t port;
+};
+
+static int connect_sockets_connect_process(int argl, void* args) {
+	struct connect_sockets* A = args;
+	ASSERT(Connect(A->sock1, A->port, 1000)==0);
+	return 0;
+}
+
+void connect_sockets(Fid_t sock1, Fid_t lsock, Fid_t* sock2, port_t port)
+{
+	struct connect_sockets A = { 
+		.sock1=sock1, .lsock=lsock, .sock2=sock2, .port=port
+	};
+
+	/* Spawn a child to connect sock1 to port (where lsock must be listening) */
+	Pid_t pid = Exec(connect_sockets_connect_process, sizeof(A), &A);
+	ASSERT(pid != NOPROC);
+
+	/* accept the child's connection here */
+	*sock2 = Accept(lsock);
+	ASSERT(*sock2 != NOFILE);
+
+	/* Clean up child */
+	ASSERT(WaitChild(pid, NULL)==pid);
+}
+
+
+void check_transfer(Fid_t from, Fid_t to)
 {
 	char buffer[12] = {[0]=0};
 	int rc;
@@ -2067,6 +3285,80 @@ BOOT_TEST(test_socket_single_producer,
 	return 0;
 }
 
+BOOT_TEST(test_socket_splice,
+	"Test Splice from a pipe to a socket, and from a socket to a pipe."
+	)
+{
+	Fid_t sock[2], lsock;
+	lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	sock[0] = Socket(NOPORT); ASSERT(sock[0]!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+	connect_sockets(sock[0], lsock, sock+1, 100);
+
+	pipe_t A, B;
+	ASSERT(Pipe(&A)==0);
+	ASSERT(Pipe(&B)==0);
+
+	/* A -> sock[0] -> sock[1] -> B */
+	Tid_t src = CreateThread(splice_source, A.write, NULL);
+	Tid_t dst = CreateThread(splice_sink, B.read, NULL);
+
+	int relay(int argl, void* args) {
+		ASSERT(splice_all(sock[1], B.write, 5000) == SPLICE_BYTES);
+		ASSERT(Close(B.write)==0);
+		return 0;
+	}
+	Tid_t rel = CreateThread(relay, 0, NULL);
+
+	ASSERT(splice_all(A.read, sock[0], 3000) == SPLICE_BYTES);
+	ASSERT(ShutDown(sock[0], SHUTDOWN_WRITE)==0);
+
+	ASSERT(ThreadJoin(src, NULL)==0);
+	ASSERT(ThreadJoin(rel, NULL)==0);
+	ASSERT(ThreadJoin(dst, NULL)==0);
+
+	/* A listening socket has no data to splice */
+	Fid_t null = OpenNull();
+	ASSERT(null != NOFILE);
+	ASSERT(Splice(lsock, null, 10) == -1);
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_pipe_sizes,
+	"Test that idle connections have no pipe buffers, and that SetPipeSize\n"
+	"sets the capacity of both directions of a connection."
+	)
+{
+	unsigned long m0 = GetPipeMemory();
+	Fid_t lsock = Socket(100);   ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(SetPipeSize(lsock, 4096) == -1);
+
+	Fid_t sock[3][2];
+	for(int i=0; i<3; i++) {
+		sock[i][0] = Socket(NOPORT); ASSERT(sock[i][0]!=NOFILE);
+		connect_sockets(sock[i][0], lsock, &sock[i][1], 100);
+	}
+	ASSERT(GetPipeMemory() == m0);
+
+	static char buf[5000];
+	ASSERT(SetPipeSize(sock[0][0], 4096) == 4096);
+	ASSERT(Write(sock[0][0], buf, sizeof(buf)) == 4096);
+	ASSERT(Write(sock[0][1], buf, sizeof(buf)) == 4096);
+	ASSERT(GetPipeMemory() == m0 + 2*4096);
+	ASSERT(Read(sock[0][1], buf, sizeof(buf)) == 4096);
+	ASSERT(Read(sock[0][0], buf, sizeof(buf)) == 4096);
+
+	for(int i=0; i<3; i++) {
+		ASSERT(Close(sock[i][0])==0);
+		ASSERT(Close(sock[i][1])==0);
+	}
+	ASSERT(GetPipeMemory() == m0);
+	return 0;
+}
+
+
 BOOT_TEST(test_socket_multi_producer,
 	"Test blocking in the pipe by 10 producers and single consumer sending 10Mbytes of data."
 	)
@@ -2222,6 +3514,8 @@ TEST_SUITE(socket_tests,
 	&test_socket_small_transfer,
 	&test_socket_single_producer,
 	&test_socket_multi_producer,
+	&test_socket_splice,
+	&test_socket_pipe_sizes,
 
 	&test_shudown_read,
 	&test_shudown_write,
@@ -2539,11 +3833,33 @@ BOOT_TEST(test_term_input_driver_interrupt,
 
 
 
+BOOT_TEST(test_isterminal,
+	"Test that IsTerminal recognizes terminal streams.",
+	.minimum_terminals = 1
+	)
+{
+	Fid_t term = OpenTerminal(0);
+	ASSERT(term != NOFILE);
+	ASSERT(IsTerminal(term)==1);
+
+	Fid_t null = OpenNull();
+	ASSERT(null != NOFILE);
+	ASSERT(IsTerminal(null)==0);
+
+	ASSERT(Dup2(term, null)==0);
+	ASSERT(IsTerminal(null)==1);
+	ASSERT(Close(term)==0);
+	ASSERT(IsTerminal(term)==-1);
+	return 0;
+}
+
+
 TEST_SUITE(io_tests,
 	"A suite of tests which test the concurrency of terminal I/O."
 	)
 {
 	&test_input_concurrency,
+	&test_isterminal,
 	&test_term_input_driver_interrupt,
 	NULL
 };
@@ -2551,6 +3867,800 @@ TEST_SUITE(io_tests,
 
 
 
+/*********************************************
+ *
+ *
+ *
+ *  Benchmarks
+ *
+ *
+ *
+ *********************************************/
+
+
+#define NSLEEPERS 10000
+#define NROUNDS 10000
+
+static struct {
+	Mutex mx;
+	CondVar sleep_cv, ping_cv, pong_cv;
+	int asleep, stop, turn;
+} SL;
+
+/* Each sleeper has a different timeout (10 minutes and argl msec) */
+static int timedwait_sleeper(int argl, void* args)
+{
+	Mutex_Lock(&SL.mx);
+	SL.asleep++;
+	while(!SL.stop)
+		Cond_TimedWait(&SL.mx, &SL.sleep_cv, 600000 + argl);
+	Mutex_Unlock(&SL.mx);
+	return 0;
+}
+
+/* The ping-pong timeouts are longer than those of all sleepers */
+static int timedwait_ponger(int argl, void* args)
+{
+	Mutex_Lock(&SL.mx);
+	for(int i=0; i<NROUNDS; i++) {
+		while(SL.turn == 0)
+			Cond_TimedWait(&SL.mx, &SL.pong_cv, 1200000);
+		SL.turn = 0;
+		Cond_Signal(&SL.ping_cv);
+	}
+	Mutex_Unlock(&SL.mx);
+	return 0;
+}
+
+BOOT_TEST(bench_timedwait_many_sleepers,
+	"Measure the throughput of timed waits on condition variables, while\n"
+	"10000 threads are sleeping with a timeout.",
+	.timeout = 300
+	)
+{
+	SL.mx = MUTEX_INIT;
+	SL.sleep_cv = SL.ping_cv = SL.pong_cv = COND_INIT;
+	SL.asleep = SL.stop = SL.turn = 0;
+
+	struct timeval t0;
+	Tid_t* tids = xmalloc(NSLEEPERS*sizeof(Tid_t));
+
+	mark_time(&t0);
+	for(int i=0; i<NSLEEPERS; i++) {
+		tids[i] = CreateThread(timedwait_sleeper, i, NULL);
+		ASSERT(tids[i] != NOTHREAD);
+	}
+	Mutex_Lock(&SL.mx);
+	while(SL.asleep < NSLEEPERS)
+		Cond_TimedWait(&SL.mx, &SL.ping_cv, 1);
+	double Tsleep = time_since(&t0);
+
+	mark_time(&t0);
+	Tid_t pong = CreateThread(timedwait_ponger, 0, NULL);
+	for(int i=0; i<NROUNDS; i++) {
+		SL.turn = 1;
+		Cond_Signal(&SL.pong_cv);
+		while(SL.turn == 1)
+			Cond_TimedWait(&SL.mx, &SL.ping_cv, 1200000);
+	}
+	double Tping = time_since(&t0);
+
+	mark_time(&t0);
+	SL.stop = 1;
+	Cond_Broadcast(&SL.sleep_cv);
+	Mutex_Unlock(&SL.mx);
+	for(int i=0; i<NSLEEPERS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL) == 0);
+	double Twake = time_since(&t0);
+	ASSERT(ThreadJoin(pong, NULL) == 0);
+	free(tids);
+
+	MSG("%d sleepers: spawn and sleep %.3f sec, %.0f timed waits/sec, wakeup all %.3f sec\n",
+		NSLEEPERS, Tsleep, 2*NROUNDS/Tping, Twake);
+	return 0;
+}
+
+#undef NSLEEPERS
+#undef NROUNDS
+
+
+#define NCHURN 100000
+#define NBATCH 16
+
+static int churn_task(int argl, void* args) { return argl; }
+
+BOOT_TEST(bench_thread_churn,
+	"Measure the throughput of CreateThread/ThreadJoin cycles, one at a time\n"
+	"and in batches of 16 threads.",
+	.timeout = 120
+	)
+{
+	struct timeval t0;
+
+	mark_time(&t0);
+	for(int i=0; i<NCHURN; i++) {
+		Tid_t t = CreateThread(churn_task, i, NULL);
+		int retval;
+		ASSERT(ThreadJoin(t, &retval) == 0);
+		ASSERT(retval == i);
+	}
+	double Tone = time_since(&t0);
+
+	mark_time(&t0);
+	for(int i=0; i<NCHURN; i+=NBATCH) {
+		Tid_t tids[NBATCH];
+		for(int j=0; j<NBATCH; j++)
+			tids[j] = CreateThread(churn_task, j, NULL);
+		for(int j=0; j<NBATCH; j++)
+			ASSERT(ThreadJoin(tids[j], NULL) == 0);
+	}
+	double Tbatch = time_since(&t0);
+
+	MSG("%.0f threads/sec one at a time, %.0f threads/sec in batches of %d\n",
+		NCHURN/Tone, NCHURN/Tbatch, NBATCH);
+	return 0;
+}
+
+#undef NCHURN
+#undef NBATCH
+
+
+#define NROUNDS 200000
+
+static struct {
+	Mutex mx;
+	CondVar cv[2];
+	int turn;
+} PP;
+
+/* Pass the turn back and forth with thread (1-argl), NROUNDS times */
+static int ping_pong_task(int argl, void* args)
+{
+	Mutex_Lock(&PP.mx);
+	for(int i=0; i<NROUNDS; i++) {
+		while(PP.turn != argl)
+			Cond_Wait(&PP.mx, &PP.cv[argl]);
+		PP.turn = 1-argl;
+		Cond_Signal(&PP.cv[1-argl]);
+	}
+	Mutex_Unlock(&PP.mx);
+	return 0;
+}
+
+BOOT_TEST(bench_context_switch,
+	"Measure the throughput of context switches, by two threads playing\n"
+	"ping-pong on a condition variable. Build with 'make UCONTEXT=1' to\n"
+	"compare the hand-written context switch with ucontext.",
+	.timeout = 120
+	)
+{
+	PP.mx = MUTEX_INIT;
+	PP.cv[0] = PP.cv[1] = COND_INIT;
+	PP.turn = 0;
+
+	struct timeval t0;
+	mark_time(&t0);
+	Tid_t ping = CreateThread(ping_pong_task, 0, NULL);
+	Tid_t pong = CreateThread(ping_pong_task, 1, NULL);
+	ASSERT(ThreadJoin(ping, NULL) == 0);
+	ASSERT(ThreadJoin(pong, NULL) == 0);
+	double T = time_since(&t0);
+
+	MSG("%s context switch: %.0f ping-pong switches/sec\n",
+		cpu_context_backend, 2*NROUNDS/T);
+	return 0;
+}
+
+#undef NROUNDS
+
+
+#define NPAIRS 4
+#define NBYTES (16<<20)
+#define CHUNK 512
+
+/* Write NBYTES into the pipe whose write end is argl */
+static int pipe_pair_writer(int argl, void* args)
+{
+	char buf[CHUNK];
+	memset(buf, 'x', CHUNK);
+	for(int n=0; n<NBYTES; n+=CHUNK)
+		ASSERT(Write(argl, buf, CHUNK) == CHUNK);
+	Close(argl);
+	return 0;
+}
+
+/* Each pair is a separate process, with its own pipe, writer and reader */
+static int pipe_pair_proc(int argl, void* args)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe) == 0);
+	Tid_t w = CreateThread(pipe_pair_writer, pipe.write, NULL);
+
+	char buf[CHUNK];
+	int total = 0, n;
+	while((n = Read(pipe.read, buf, CHUNK)) > 0)
+		total += n;
+	ASSERT(total == NBYTES);
+	ASSERT(ThreadJoin(w, NULL) == 0);
+	return 0;
+}
+
+static double pipe_pairs_T;
+
+static int pipe_pairs_boot(int argl, void* args)
+{
+	struct timeval t0;
+	mark_time(&t0);
+	for(int i=0; i<argl; i++)
+		ASSERT(Exec(pipe_pair_proc, 0, NULL) != NOPROC);
+	for(int i=0; i<argl; i++)
+		ASSERT(WaitChild(NOPROC, NULL) != NOPROC);
+	pipe_pairs_T = time_since(&t0);
+	return 0;
+}
+
+BARE_TEST(bench_pipe_pairs,
+	"Measure the pipe throughput of 1 and 4 independent reader/writer pairs,\n"
+	"each in its own process, on 1, 2 and 4 cores. Syscalls on disjoint\n"
+	"processes and pipes take disjoint locks, so they can run in parallel.",
+	.timeout = 300
+	)
+{
+	uint cores[] = { 1, 2, 4 };
+	uint pairs[] = { 1, NPAIRS };
+	for(int c=0; c<3; c++)
+		for(int p=0; p<2; p++) {
+			boot(cores[c], 0, pipe_pairs_boot, pairs[p], NULL);
+			MSG("%u cores, %u pairs: %.1f MB/sec\n", cores[c], pairs[p],
+				pairs[p]*(NBYTES/1048576.0)/pipe_pairs_T);
+		}
+}
+
+#undef NPAIRS
+#undef NBYTES
+#undef CHUNK
+
+
+/* The write size and the number of bytes to send, in bench_pipe_write_sizes */
+static struct { unsigned int chunk, total; double T; } PWS;
+
+/* Each write of a chunk may be short, when the chunk exceeds the free space */
+static int pipe_sized_writer(int argl, void* args)
+{
+	static char buf[65536];
+	for(unsigned int n=0; n<PWS.total; n+=PWS.chunk)
+		for(unsigned int w=0; w<PWS.chunk; ) {
+			int rc = Write(argl, buf+w, PWS.chunk-w);
+			ASSERT(rc > 0);
+			w += rc;
+		}
+	Close(argl);
+	return 0;
+}
+
+static int pipe_write_sizes_boot(int argl, void* args)
+{
+	pipe_t pipe;
+	ASSERT(Pipe(&pipe) == 0);
+	ASSERT(SetPipeSize(pipe.write, argl) == argl);
+
+	struct timeval t0;
+	mark_time(&t0);
+	Tid_t w = CreateThread(pipe_sized_writer, pipe.write, NULL);
+
+	static char buf[65536];
+	unsigned int total = 0;
+	int n;
+	while((n = Read(pipe.read, buf, sizeof(buf))) > 0)
+		total += n;
+	ASSERT(total == PWS.total);
+	ASSERT(ThreadJoin(w, NULL) == 0);
+	PWS.T = time_since(&t0);
+	return 0;
+}
+
+BARE_TEST(bench_pipe_write_sizes,
+	"Measure the pipe throughput for writes of 1, 64, 4096 and 65536 bytes,\n"
+	"with a single reader reading up to 64 kbytes at a time, on 1 core,\n"
+	"for the default pipe capacity and for a capacity of 1 Mbyte."
+	)
+{
+	unsigned int chunk[] = { 1, 64, 4096, 65536 };
+	unsigned int capacity[] = { 16384, 1<<20 };
+	for(int k=0; k<2; k++)
+		for(int c=0; c<4; c++) {
+			PWS.chunk = chunk[c];
+			PWS.total = (chunk[c] == 1) ? (1<<20) : (64<<20);
+			boot(1, 0, pipe_write_sizes_boot, capacity[k], NULL);
+			MSG("capacity %7u, writes of %5u bytes: %8.1f MB/sec\n", capacity[k], chunk[c], 
+				(PWS.total/1048576.0)/PWS.T);
+		}
+}
+
+
+#define NBYTES (64<<20)
+#define CHUNK 4096
+
+static double relay_T;
+
+static int relay_writer(int argl, void* args)
+{
+	static char buf[CHUNK];
+	for(int n=0; n<NBYTES; n+=CHUNK)
+		ASSERT(Write(argl, buf, CHUNK) == CHUNK);
+	Close(argl);
+	return 0;
+}
+
+static int relay_reader(int argl, void* args)
+{
+	static char buf[CHUNK];
+	int total = 0, n;
+	while((n = Read(argl, buf, CHUNK)) > 0)
+		total += n;
+	ASSERT(total == NBYTES);
+	return 0;
+}
+
+/* Relay between two pipes, with Read/Write if argl==0, or with Splice */
+static int relay_boot(int argl, void* args)
+{
+	pipe_t A, B;
+	ASSERT(Pipe(&A)==0 && Pipe(&B)==0);
+
+	struct timeval t0;
+	mark_time(&t0);
+	Tid_t w = CreateThread(relay_writer, A.write, NULL);
+	Tid_t r = CreateThread(relay_reader, B.read, NULL);
+
+	static char buf[CHUNK];
+	int n;
+	if(argl)
+		while((n = Splice(A.read, B.write, CHUNK)) > 0);
+	else
+		while((n = Read(A.read, buf, CHUNK)) > 0)
+			ASSERT(Write(B.write, buf, n) == n);
+	Close(B.write);
+
+	ASSERT(ThreadJoin(w, NULL)==0);
+	ASSERT(ThreadJoin(r, NULL)==0);
+	relay_T = time_since(&t0);
+	return 0;
+}
+
+BARE_TEST(bench_splice,
+	"Measure the throughput of relaying data from one pipe to another,\n"
+	"with Read and Write through a user buffer, and with Splice."
+	)
+{
+	for(int splice=0; splice<2; splice++) {
+		boot(1, 0, relay_boot, splice, NULL);
+		MSG("%-10s: %.1f MB/sec\n", splice ? "Splice" : "Read/Write", 
+			(NBYTES/1048576.0)/relay_T);
+	}
+}
+
+#undef NBYTES
+#undef CHUNK
+
+
+#define NBYTES (1<<20)
+
+/* The streams of a stage of the pipeline, and the pipe fids to close */
+typedef struct {
+	Fid_t in, out;
+	Fid_t pipes[4];
+	size_t bufsize;
+} pipeline_stage;
+
+static void pipeline_open(pipeline_stage* st, FILE** fin, FILE** fout)
+{
+	for(int i=0; i<4; i++)
+		if(st->pipes[i]!=st->in && st->pipes[i]!=st->out)
+			Close(st->pipes[i]);
+	*fin = (st->in==NOFILE) ? NULL : fidopen_buffered(st->in, "r", st->bufsize);
+	*fout = (st->out==NOFILE) ? NULL : fidopen_buffered(st->out, "w", st->bufsize);
+}
+
+/* Like cat */
+static int pipeline_source(int argl, void* args)
+{
+	FILE *fin, *fout;
+	pipeline_open(args, &fin, &fout);
+	for(int i=0; i<NBYTES; i++)
+		fputc((i % 64 == 63) ? '\n' : 'a' + i%26, fout);
+	fclose(fout);
+	return 0;
+}
+
+/* Like capitalize */
+static int pipeline_filter(int argl, void* args)
+{
+	FILE *fin, *fout;
+	pipeline_open(args, &fin, &fout);
+	int c;
+	while((c = fgetc(fin)) != EOF)
+		fputc(toupper(c), fout);
+	fclose(fin);
+	fclose(fout);
+	return 0;
+}
+
+/* Like wc */
+static int pipeline_sink(int argl, void* args)
+{
+	FILE *fin, *fout;
+	pipeline_open(args, &fin, &fout);
+	int c, n = 0;
+	while((c = fgetc(fin)) != EOF) n++;
+	fclose(fin);
+	ASSERT(n == NBYTES);
+	return 0;
+}
+
+static double pipeline_T;
+
+static int pipeline_boot(int argl, void* args)
+{
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0 && Pipe(&p2)==0);
+	Fid_t pipes[4] = { p1.read, p1.write, p2.read, p2.write };
+
+	pipeline_stage st[3] = {
+		{ NOFILE, p1.write }, { p1.read, p2.write }, { p2.read, NOFILE }
+	};
+	Task stage[3] = { pipeline_source, pipeline_filter, pipeline_sink };
+
+	struct timeval t0;
+	mark_time(&t0);
+	for(int i=0; i<3; i++) {
+		memcpy(st[i].pipes, pipes, sizeof(pipes));
+		st[i].bufsize = argl;
+		ASSERT(Exec(stage[i], sizeof(pipeline_stage), &st[i]) != NOPROC);
+	}
+	for(int i=0; i<4; i++)
+		Close(pipes[i]);
+	for(int i=0; i<3; i++)
+		ASSERT(WaitChild(NOPROC, NULL) != NOPROC);
+	pipeline_T = time_since(&t0);
+	return 0;
+}
+
+BARE_TEST(bench_stdio_pipeline,
+	"Measure the throughput of a 'cat | capitalize | wc' pipeline of processes\n"
+	"using fgetc/fputc on unbuffered and on buffered C streams (see fidopen)."
+	)
+{
+	size_t bufsize[] = { 0, 512, FIDOPEN_BUFSIZ };
+	for(int b=0; b<3; b++) {
+		boot(1, 0, pipeline_boot, bufsize[b], NULL);
+		MSG("buffer of %5zu bytes: %.2f MB/sec\n", bufsize[b], (NBYTES/1048576.0)/pipeline_T);
+	}
+}
+
+#undef NBYTES
+
+
+#define LOCK_WINDOW 300
+
+static struct {
+	int spin;             /* 1 to use the Spinlock, 0 for the Mutex */
+	Mutex mx;
+	Spinlock sl;
+	volatile int stop;
+	unsigned long counter;
+	unsigned long count[MAX_CORES];
+} LC;
+
+/* Lock and unlock in the non-preemptive domain, until stopped */
+static int lock_contender(int argl, void* args)
+{
+	unsigned long n = 0;
+	while(! LC.stop) {
+		int pre = preempt_off;
+		if(LC.spin) Spinlock_Lock(&LC.sl); else Mutex_Lock(&LC.mx);
+		LC.counter++;
+		if(LC.spin) Spinlock_Unlock(&LC.sl); else Mutex_Unlock(&LC.mx);
+		if(pre) preempt_on;
+		n++;
+	}
+	LC.count[argl] = n;
+	return 0;
+}
+
+static int lock_contention_boot(int argl, void* args)
+{
+	uint K = cpu_cores();
+	Tid_t tids[MAX_CORES];
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	LC.spin = argl;
+	LC.mx = MUTEX_INIT;
+	LC.sl = SPINLOCK_INIT;
+	LC.stop = 0;
+	LC.counter = 0;
+
+	for(uint i=0; i<K; i++)
+		tids[i] = CreateThread(lock_contender, i, NULL);
+
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, LOCK_WINDOW);
+	Mutex_Unlock(&mx);
+	LC.stop = 1;
+
+	for(uint i=0; i<K; i++)
+		ASSERT(ThreadJoin(tids[i], NULL) == 0);
+	return 0;
+}
+
+BARE_TEST(bench_lock_contention,
+	"Measure the throughput and fairness of the test-and-set Mutex and the\n"
+	"ticket Spinlock, with one thread per core hammering the same lock with\n"
+	"preemption off, on 1, 2 and 4 cores.",
+	.timeout = 60
+	)
+{
+	uint cores[] = { 1, 2, 4 };
+	for(int c=0; c<3; c++)
+		for(int spin=0; spin<2; spin++) {
+			boot(cores[c], 0, lock_contention_boot, spin, NULL);
+			unsigned long total = 0, lo = LC.count[0], hi = LC.count[0];
+			for(uint i=0; i<cores[c]; i++) {
+				total += LC.count[i];
+				if(LC.count[i] < lo) lo = LC.count[i];
+				if(LC.count[i] > hi) hi = LC.count[i];
+			}
+			ASSERT(LC.counter == total);
+			MSG("%u cores, %-8s: %.2f Mlocks/sec, per-core min/max %.2f\n", 
+				cores[c], spin ? "Spinlock" : "Mutex", 
+				total/(LOCK_WINDOW*1000.0), hi ? (double)lo/hi : 1.0);
+		}
+}
+
+#undef LOCK_WINDOW
+
+
+#define NCONTENDERS 16
+#define NCRIT 2000
+
+static Mutex MC_mx;
+static unsigned long MC_counter;
+
+/* Alternate between work inside and outside the critical section */
+static int mutex_contender(int argl, void* args)
+{
+	for(int i=0; i<NCRIT; i++) {
+		Mutex_Lock(&MC_mx);
+		MC_counter += fibo(12);
+		Mutex_Unlock(&MC_mx);
+		fibo(12);
+	}
+	return 0;
+}
+
+static int mutex_contention_boot(int argl, void* args)
+{
+	Tid_t tids[NCONTENDERS];
+	MC_mx = MUTEX_INIT;
+	MC_counter = 0;
+	for(int i=0; i<NCONTENDERS; i++)
+		tids[i] = CreateThread(mutex_contender, 0, NULL);
+	for(int i=0; i<NCONTENDERS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL) == 0);
+	ASSERT(MC_counter == (unsigned long)NCONTENDERS*NCRIT*fibo(12));
+
+	symposium_t symp = { .N = 10, .bites = 10 };
+	adjust_symposium(&symp, -4, 0);
+	symposium_quiet = 1;
+	SymposiumOfThreads(sizeof(symp), &symp);
+	return 0;
+}
+
+static double cpu_seconds()
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec 
+		+ 1E-6*(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec);
+}
+
+BARE_TEST(bench_mutex_contention,
+	"Measure the wall and CPU time of 16 threads contending for one Mutex,\n"
+	"followed by a symposium of 10 philosophers, on 1, 2 and 4 cores. CPU\n"
+	"time in excess of the wall time is spent by waiters.",
+	.timeout = 300
+	)
+{
+	uint cores[] = { 1, 2, 4 };
+	for(int c=0; c<3; c++) {
+		struct timeval t0;
+		double cpu0 = cpu_seconds();
+		mark_time(&t0);
+		boot(cores[c], 0, mutex_contention_boot, 0, NULL);
+		MSG("%u cores: %.2f sec wall, %.2f sec CPU\n", cores[c], 
+			time_since(&t0), cpu_seconds()-cpu0);
+	}
+}
+
+#undef NCONTENDERS
+#undef NCRIT
+
+
+#define NWAITERS 16
+#define NBROADCASTS 2000
+
+static struct {
+	Mutex mx;
+	CondVar go, done;
+	int gen, acks;
+	double switches;
+} BR;
+
+/* Acknowledge each generation */
+static int broadcast_follower(int argl, void* args)
+{
+	Mutex_Lock(&BR.mx);
+	for(int g=1; g<=NBROADCASTS; g++) {
+		while(BR.gen < g)
+			Cond_Wait(&BR.mx, &BR.go);
+		if(++BR.acks == NWAITERS)
+			Cond_Signal(&BR.done);
+	}
+	Mutex_Unlock(&BR.mx);
+	return 0;
+}
+
+static int broadcast_boot(int argl, void* args)
+{
+	Tid_t tids[NWAITERS];
+	BR.mx = MUTEX_INIT;
+	BR.go = BR.done = COND_INIT;
+	BR.gen = BR.acks = 0;
+	for(int i=0; i<NWAITERS; i++)
+		tids[i] = CreateThread(broadcast_follower, 0, NULL);
+
+	unsigned long sw0 = get_context_switches();
+	Mutex_Lock(&BR.mx);
+	for(int g=1; g<=NBROADCASTS; g++) {
+		BR.acks = 0;
+		BR.gen = g;
+		Cond_Broadcast(&BR.go);
+		while(BR.acks < NWAITERS)
+			Cond_Wait(&BR.mx, &BR.done);
+	}
+	Mutex_Unlock(&BR.mx);
+	BR.switches = (double)(get_context_switches() - sw0) / NBROADCASTS;
+
+	for(int i=0; i<NWAITERS; i++)
+		ASSERT(ThreadJoin(tids[i], NULL) == 0);
+	return 0;
+}
+
+BARE_TEST(bench_cond_broadcast,
+	"Measure the context switches per Cond_Broadcast, when 16 threads wait\n"
+	"on the condition and contend for its mutex, on 1, 2 and 4 cores.",
+	.timeout = 120
+	)
+{
+	uint cores[] = { 1, 2, 4 };
+	for(int c=0; c<3; c++) {
+		struct timeval t0;
+		mark_time(&t0);
+		boot(cores[c], 0, broadcast_boot, 0, NULL);
+		MSG("%u cores: %.1f context switches per broadcast, %.0f broadcasts/sec\n",
+			cores[c], BR.switches, NBROADCASTS/time_since(&t0));
+	}
+}
+
+#undef NWAITERS
+#undef NBROADCASTS
+
+
+/*
+  A read-mostly table: each operation looks up a key by scanning the
+  table, and every RM_WRITE_EVERY operations is an update instead.
+  The table is protected by a Mutex, or by a RWLock.
+*/
+#define RM_TABLE 64
+#define RM_OPS 20000
+#define RM_WRITE_EVERY 100
+
+static struct {
+	int use_rwlock;
+	Mutex mx;
+	RWLock rw;
+	int table[RM_TABLE];
+	volatile int found;
+} RM;
+
+static int read_mostly_worker(int argl, void* args)
+{
+	int found = 0;
+	for(int i=0; i<RM_OPS; i++) {
+		int key = (i*31 + argl) % RM_TABLE;
+		int write = (i % RM_WRITE_EVERY) == 0;
+		if(RM.use_rwlock) {
+			if(write) RWLock_WriteLock(&RM.rw); else RWLock_ReadLock(&RM.rw);
+		} else
+			Mutex_Lock(&RM.mx);
+
+		if(write)
+			RM.table[key]++;
+		else
+			for(int j=0; j<RM_TABLE; j++)
+				if(RM.table[j] == key) found++;
+
+		if(RM.use_rwlock) {
+			if(write) RWLock_WriteUnlock(&RM.rw); else RWLock_ReadUnlock(&RM.rw);
+		} else
+			Mutex_Unlock(&RM.mx);
+	}
+	RM.found += found;
+	return 0;
+}
+
+static int read_mostly_boot(int argl, void* args)
+{
+	Tid_t tids[MAX_CORES];
+	uint n = cpu_cores();
+	for(uint i=0; i<n; i++)
+		tids[i] = CreateThread(read_mostly_worker, i, NULL);
+	for(uint i=0; i<n; i++)
+		ASSERT(ThreadJoin(tids[i], NULL) == 0);
+	return 0;
+}
+
+BARE_TEST(bench_rwlock_read_mostly,
+	"Measure the operations/sec on a table with 1% writes, protected by a\n"
+	"Mutex or by a RWLock, with one thread per core on 1, 2 and 4 cores.",
+	.timeout = 300
+	)
+{
+	uint cores[] = { 1, 2, 4 };
+	for(int c=0; c<3; c++) {
+		double rate[2];
+		for(int k=0; k<2; k++) {
+			RM.use_rwlock = k;
+			RM.mx = MUTEX_INIT;
+			RM.rw = RWLOCK_INIT;
+			struct timeval t0;
+			mark_time(&t0);
+			boot(cores[c], 0, read_mostly_boot, 0, NULL);
+			rate[k] = cores[c]*RM_OPS / time_since(&t0);
+		}
+		MSG("%u cores: Mutex %.0f ops/sec, RWLock %.0f ops/sec\n", cores[c], rate[0], rate[1]);
+	}
+}
+
+#undef RM_TABLE
+#undef RM_OPS
+#undef RM_WRITE_EVERY
+
+
+TEST_SUITE(benchmarks,
+	"A suite of performance benchmarks. These are not part of all_tests,\n"
+	"as they take a long time and only report measurements."
+	)
+{
+	&bench_timedwait_many_sleepers,
+	&bench_thread_churn,
+	&bench_context_switch,
+	&bench_wakeup_preemption,
+	&bench_pipe_pairs,
+	&bench_pipe_write_sizes,
+	&bench_stdio_pipeline,
+	&bench_splice,
+	&bench_lock_contention,
+	&bench_mutex_contention,
+	&bench_cond_broadcast,
+	&bench_rwlock_read_mostly,
+	NULL
+};
+
+
+
+
 /*********************************************
  *
  *
@@ -2613,6 +4723,7 @@ int main(int argc, char** argv)
 {
 	register_test(&all_tests);
 	register_test(&user_tests);
+	register_test(&benchmarks);
 	return run_program(argc, argv, &all_tests);
 }
 